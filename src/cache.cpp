@@ -0,0 +1,237 @@
+/*
+ * CMF2IMF - convert CMF files into id Software IMF files
+ * Copyright (C) 2010 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <algorithm>
+#include <fstream>
+#include <vector>
+
+#include "cache.hpp"
+
+namespace cache {
+
+// Extension given to every file in the cache, so we never remove anything
+// else that happens to be in the directory.
+#define CACHE_EXT ".imfc"
+
+// Temporary files older than this were left behind by a crashed process
+#define CACHE_TEMP_AGE (60 * 60)
+
+/// 64-bit FNV-1a hash
+static uint64_t fnv1a(uint64_t iHash, const void *pData, size_t iLength)
+{
+	const uint8_t *p = (const uint8_t *)pData;
+	for (size_t i = 0; i < iLength; i++) {
+		iHash ^= p[i];
+		iHash *= 0x100000001B3ULL;
+	}
+	return iHash;
+}
+
+store::store(const std::string& strDir)
+	throw (std::ios::failure) :
+	strDir(strDir)
+{
+	if ((mkdir(strDir.c_str(), 0777) < 0) && (errno != EEXIST)) {
+		throw std::ios::failure("Unable to create cache directory " + strDir
+			+ ": " + strerror(errno));
+	}
+}
+
+std::string store::key(const char *pData, size_t iLength, const imf::OPTIONS& opt)
+	throw ()
+{
+	uint64_t iHash = 0xCBF29CE484222325ULL;
+	iHash = fnv1a(iHash, IMF_CONVERTER_VERSION, sizeof(IMF_CONVERTER_VERSION));
+	uint32_t iOptions[8] = {
+		(uint32_t)opt.iSpeed,
+		(uint32_t)opt.iType,
+		opt.iStart,
+		opt.iEnd,
+		(uint32_t)opt.bLookahead,
+		(uint32_t)opt.bPrefetch,
+		opt.iBusBudget,
+		opt.iBusTolerance
+	};
+	iHash = fnv1a(iHash, iOptions, sizeof(iOptions));
+	if ((opt.pBank) && (!opt.pBank->empty())) {
+		iHash = fnv1a(iHash, &opt.pBank->front(), opt.pBank->size() * sizeof(cmf::SBI));
+	}
+	iHash = fnv1a(iHash, pData, iLength);
+
+	// Include the length as well, to make collisions even less likely
+	char cKey[40];
+	snprintf(cKey, sizeof(cKey), "%016llx-%llx", (unsigned long long)iHash,
+		(unsigned long long)iLength);
+	return cKey;
+}
+
+std::string store::path(const std::string& strKey) const
+	throw ()
+{
+	return this->strDir + "/" + strKey + CACHE_EXT;
+}
+
+bool store::fetch(const std::string& strKey, const std::string& strDest)
+	throw ()
+{
+	// Leave the existing output alone unless there's something to replace it
+	// with.  This also marks the cached file as recently used.
+	std::string strData;
+	if (!this->read(strKey, strData)) return false;
+
+	// Always copy rather than link, so the output is the user's own file and
+	// touching or deleting it has no effect on the cache.
+	std::ofstream outfile(strDest.c_str(), std::ios::out | std::ios::trunc | std::ios::binary);
+	if (!outfile.is_open()) return false;
+	outfile.write(strData.data(), strData.length());
+	outfile.close();
+	return !outfile.fail();
+}
+
+bool store::read(const std::string& strKey, std::string& strData)
+	throw ()
+{
+	std::string strPath = this->path(strKey);
+	int fd = open(strPath.c_str(), O_RDONLY);
+	if (fd < 0) return false;
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return false;
+	}
+	strData.resize(st.st_size);
+	size_t iPos = 0;
+	while (iPos < strData.length()) {
+		ssize_t iRead = ::read(fd, &strData[iPos], strData.length() - iPos);
+		if (iRead <= 0) {
+			if ((iRead < 0) && (errno == EINTR)) continue;
+			close(fd);
+			return false;
+		}
+		iPos += iRead;
+	}
+	close(fd);
+	utimes(strPath.c_str(), NULL);
+	return true;
+}
+
+void store::add(const std::string& strKey, const std::string& strData)
+	throw (std::ios::failure)
+{
+	// Write to a temporary file first and rename it into place, so nobody
+	// else ever sees a partly written file.
+	std::string strTemp = this->strDir + "/" + strKey + ".tmp.XXXXXX";
+	int fd = mkstemp(&strTemp[0]);
+	if (fd < 0) {
+		throw std::ios::failure("Unable to create file in cache directory: "
+			+ std::string(strerror(errno)));
+	}
+	size_t iPos = 0;
+	while (iPos < strData.length()) {
+		ssize_t iWritten = write(fd, strData.data() + iPos, strData.length() - iPos);
+		if (iWritten < 0) {
+			if (errno == EINTR) continue;
+			close(fd);
+			unlink(strTemp.c_str());
+			throw std::ios::failure("Unable to write to cache: "
+				+ std::string(strerror(errno)));
+		}
+		iPos += iWritten;
+	}
+	// Nothing should ever change a cached file once it's in place
+	fchmod(fd, 0444);
+	close(fd);
+	if (rename(strTemp.c_str(), this->path(strKey).c_str()) < 0) {
+		unlink(strTemp.c_str());
+		throw std::ios::failure("Unable to add file to cache: "
+			+ std::string(strerror(errno)));
+	}
+	return;
+}
+
+/// A file in the cache directory, for working out which ones to remove
+typedef struct {
+	std::string strPath;
+	time_t iLastUsed;
+	uint64_t iSize;
+} CACHEFILE;
+
+static bool olderThan(const CACHEFILE& a, const CACHEFILE& b)
+{
+	return a.iLastUsed < b.iLastUsed;
+}
+
+void store::evict(uint64_t iMaxSize, time_t iMaxAge)
+	throw ()
+{
+	DIR *d = opendir(this->strDir.c_str());
+	if (!d) return;
+
+	time_t iNow = time(NULL);
+	std::vector<CACHEFILE> files;
+	uint64_t iTotal = 0;
+	struct dirent *e;
+	while ((e = readdir(d)) != NULL) {
+		std::string strName = e->d_name;
+		bool bTemp = (strName.find(".tmp.") != std::string::npos);
+		if ((!bTemp) && ((strName.length() < sizeof(CACHE_EXT)) ||
+			(strName.compare(strName.length() - sizeof(CACHE_EXT) + 1,
+				std::string::npos, CACHE_EXT) != 0))
+		) {
+			continue; // not one of ours
+		}
+		CACHEFILE f;
+		f.strPath = this->strDir + "/" + strName;
+		struct stat st;
+		if (stat(f.strPath.c_str(), &st) < 0) continue; // already removed
+		if (bTemp) {
+			// Only clean up temp files left behind by a process that died
+			if (iNow - st.st_mtime > CACHE_TEMP_AGE) unlink(f.strPath.c_str());
+			continue;
+		}
+		if (iNow - st.st_mtime > iMaxAge) {
+			unlink(f.strPath.c_str());
+			continue;
+		}
+		f.iLastUsed = st.st_mtime;
+		f.iSize = st.st_size;
+		iTotal += f.iSize;
+		files.push_back(f);
+	}
+	closedir(d);
+
+	if (iTotal <= iMaxSize) return;
+	std::sort(files.begin(), files.end(), olderThan);
+	for (std::vector<CACHEFILE>::iterator i = files.begin(); i != files.end(); i++) {
+		if (iTotal <= iMaxSize) break;
+		unlink(i->strPath.c_str());
+		iTotal -= i->iSize;
+	}
+	return;
+}
+
+} // namespace cache
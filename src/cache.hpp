@@ -0,0 +1,92 @@
+/*
+ * CMF2IMF - convert CMF files into id Software IMF files
+ * Copyright (C) 2010 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CACHE_HPP_
+#define CACHE_HPP_
+
+#include <iostream>
+#include <string>
+#include <time.h>
+#include <stdint.h>
+
+#include "imf.hpp"
+
+namespace cache {
+
+/// Cache of previously converted songs, stored in a directory.
+/**
+ * Each file in the directory is an IMF file named after a hash of the CMF
+ * data, the conversion options and the converter version.  Files are only
+ * ever created by renaming a finished temporary file into place, so several
+ * processes can safely share the one directory.
+ */
+class store {
+	private:
+		std::string strDir;
+
+	public:
+		/// Open a cache directory, creating it if it doesn't exist.
+		store(const std::string& strDir)
+			throw (std::ios::failure);
+
+		/// Work out the cache key for a conversion.
+		/**
+		 * @param pData CMF data.
+		 * @param iLength Length of pData.
+		 * @param opt Options the CMF will be converted with.
+		 */
+		static std::string key(const char *pData, size_t iLength, const imf::OPTIONS& opt)
+			throw ();
+
+		/// Copy a cached file to strDest.
+		/**
+		 * @return true on success, false if the key isn't in the cache.
+		 */
+		bool fetch(const std::string& strKey, const std::string& strDest)
+			throw ();
+
+		/// Read a cached file into memory.
+		/**
+		 * @return true on success, false if the key isn't in the cache.
+		 */
+		bool read(const std::string& strKey, std::string& strData)
+			throw ();
+
+		/// Add a converted file to the cache.
+		void add(const std::string& strKey, const std::string& strData)
+			throw (std::ios::failure);
+
+		/// Remove old files until the cache is small enough.
+		/**
+		 * @param iMaxSize Total size in bytes to reduce the cache down to.  The
+		 *   least recently used files are removed first.
+		 *
+		 * @param iMaxAge Remove any file that hasn't been used for this many
+		 *   seconds.
+		 */
+		void evict(uint64_t iMaxSize, time_t iMaxAge)
+			throw ();
+
+	private:
+		std::string path(const std::string& strKey) const
+			throw ();
+};
+
+} // namespace cache
+
+#endif // CACHE_HPP_
@@ -22,6 +22,7 @@
 
 #include <boost/bind.hpp>
 #include <iostream>
+#include <vector>
 #include <stdint.h>
 
 namespace cmf {
@@ -72,9 +73,158 @@ typedef struct {
 	int iMIDIPatch;   // Current MIDI patch set on this OPL channel
 } OPLCHANNEL;
 
-class player {
+/// Instrument used by each melodic note in a song, in the order the notes are
+/// played.  Recorded on one run through a song so the next run can plan which
+/// OPL channel each note goes on.
+typedef std::vector<uint8_t> NOTEPLAN;
+
+/// Everything that changes as a song plays, so a second player can carry on
+/// from the same point.
+typedef struct {
+	std::streamoff iPos;          // Offset of the next event in the song data
+	uint8_t iCurrentRegs[256];
+	MIDICHANNEL chMIDI[16];
+	OPLCHANNEL chOPL[9];
+	bool bPercussive;
+	int iTranspose;
+	uint8_t iPrevCommand;
+	int iNoteCount;
+	uint16_t iPendingBend;
+	uint32_t iCurrentTime;
+	uint64_t iSongTicks;
+	uint32_t iPlanPos;
+	unsigned int iInstrumentChanges;
+} PLAYERSTATE;
+
+/// Plan position of an instrument that won't be used again
+#define PLAN_NEVER 0xFFFFFFFF
+
+/// Lookup tables used by the velocity policies
+extern const uint8_t cPercVelocityLevels[128];
+extern const uint8_t cVelocityLevels[128];
+
+/// @name Velocity policies
+/// Map a note's velocity to an OPL output level (0 == loudest, 0x3F == silent.)
+///@{
+
+/// Creative's own player ignores the velocity of melodic notes, and only uses
+/// it for the volume of percussion notes.
+struct velocity_creative {
+	enum { bMelodic = false }; ///< Set the level of melodic notes too?
+	static uint8_t percLevel(uint8_t iVelocity) { return cPercVelocityLevels[iVelocity & 0x7F]; }
+	static uint8_t melodicLevel(uint8_t) { return 0; }
+};
+
+/// Let the velocity affect the volume of every note (as presumably the
+/// composer originally intended.)  The Xargon demo song is a good example of
+/// a song that uses note velocity.
+struct velocity_full {
+	enum { bMelodic = true };
+	static uint8_t percLevel(uint8_t iVelocity) { return cVelocityLevels[iVelocity & 0x7F]; }
+	static uint8_t melodicLevel(uint8_t iVelocity) { return cVelocityLevels[iVelocity & 0x7F]; }
+};
+///@}
+
+/// @name Percussion policies
+/// Decide which OPL rhythm-mode channel plays each percussive MIDI channel.
+///@{
+
+/// Lookup table for percussion_creative, indexed by MIDI channel - 11
+extern const uint8_t cPercChannels[5];
+
+/// MIDI channels 11 to 15 play the rhythm-mode instruments, as in a CMF file.
+struct percussion_creative {
+	enum { bEnabled = true };
+	/// When a MIDI instrument is played on a percussive channel (e.g. 11), figure
+	/// out which OPL rhythm-mode channel it must be played on (e.g. 7)
+	static uint8_t channel(uint8_t iMIDIChannel) { return cPercChannels[iMIDIChannel - 11]; }
+};
+
+/// Never use rhythm mode, every channel is melodic.
+struct percussion_none {
+	enum { bEnabled = false };
+	static uint8_t channel(uint8_t) { return 0; }
+};
+///@}
+
+/// @name Log policies
+/// Where progress and warning messages go.
+///@{
+
+/// Write messages to a stream, stdout unless player::setLog() is used.
+class log_stream {
+	private:
+		std::ostream *pStream;
+
+	public:
+		log_stream() : pStream(&std::cout) { }
+		void setStream(std::ostream& s) { this->pStream = &s; }
+
+		template <typename T>
+		log_stream& operator << (const T& v) { *this->pStream << v; return *this; }
+		log_stream& operator << (std::ostream& (*fn)(std::ostream&)) { fn(*this->pStream); return *this; }
+		log_stream& operator << (std::ios_base& (*fn)(std::ios_base&)) { fn(*this->pStream); return *this; }
+};
+
+/// Throw away all messages.  Everything inlines to nothing.
+class log_none {
+	public:
+		void setStream(std::ostream&) { }
+
+		template <typename T>
+		log_none& operator << (const T&) { return *this; }
+		log_none& operator << (std::ostream& (*)(std::ostream&)) { return *this; }
+		log_none& operator << (std::ios_base& (*)(std::ios_base&)) { return *this; }
+};
+///@}
+
+/// @name Setup policies
+/// Registers written by init() before the song starts.
+///@{
+
+/// Set the chip up the same way as Creative's player.
+struct setup_creative {
+	enum { bPresetPercussion = true }; ///< Load the last five instruments into the percussion channels?
+	static const uint8_t cRegs[][2];   ///< Register/value pairs to write
+	static const unsigned int iNumRegs;
+};
+
+/// Only write the registers needed for the song to play correctly.
+struct setup_minimal {
+	enum { bPresetPercussion = false };
+	static const uint8_t cRegs[][2];
+	static const unsigned int iNumRegs;
+};
+///@}
+
+/// Player behaviour matching Creative Labs' own CMF player.
+/**
+ * To change the behaviour, create a similar structure with different
+ * policies, include cmf_impl.hpp and use basic_player<your_policy>.
+ * Behaviour that isn't selected is compiled out completely.
+ */
+struct policy_creative {
+	typedef velocity_creative velocity;
+	typedef percussion_creative percussion;
+	typedef log_stream log;
+	typedef setup_creative setup;
+};
+
+/// Same as policy_creative but without any messages, for use in servers or
+/// when converting many songs at once.
+struct policy_quiet {
+	typedef velocity_creative velocity;
+	typedef percussion_creative percussion;
+	typedef log_none log;
+	typedef setup_creative setup;
+};
+
+template <class Policy>
+class basic_player {
 	private:
 		std::istream &data;
+		const SBI *pBank; // Instruments supplied by the caller (if bHeaderless)
+		bool bHeaderless; // true if data only holds events, e.g. from a MIDI file
 		FN_SETREGISTER cbSetRegister;
 		FN_DELAY cbDelay;
 		uint32_t iPlayPointer;		// Current location of playback pointer
@@ -88,17 +238,158 @@ class player {
 		int iNoteCount;  // Used to count how long notes have been playing for
 		MIDICHANNEL chMIDI[16];
 		OPLCHANNEL chOPL[9];
+		uint16_t iPendingBend; // Bitfield of OPL channels waiting for a pitchbend to be written
+
+		uint32_t iCurrentTime; // Song position in milliseconds
+		uint64_t iSongTicks;   // Song position in CMF ticks (not rounded to milliseconds)
+		uint32_t iStartTime;   // Time to start producing output (0 == from start)
+		uint32_t iEndTime;     // Time to stop the song (0 == play to the end)
+		bool bSilent;          // true to update iCurrentRegs without producing output
+		bool bBaseState;       // true if the chip doesn't start out blank
+		uint8_t iBaseRegs[256]; // What is in the chip before init() (if bBaseState)
+
+		typename Policy::log log; // Where to write progress and warning messages
+
+		NOTEPLAN *pRecordPlan;    // Where to record each note's instrument (or NULL)
+		const NOTEPLAN *pPlan;    // Instruments of all the notes in the song (or NULL)
+		std::vector<uint32_t> planUses[128]; // Position of each instrument's notes in pPlan
+		uint32_t iPlanPos;        // Number of melodic notes played so far
+		unsigned int iInstrumentChanges; // Number of times an instrument was loaded
+		const PLAYERSTATE *pResume; // State to carry on from after init() (or NULL)
 
 	public:
-		player(std::istream& data, FN_SETREGISTER cbSetRegister, FN_DELAY cbDelay)
+		basic_player(std::istream& data, FN_SETREGISTER cbSetRegister, FN_DELAY cbDelay)
 			throw (std::ios::failure);
-		virtual ~player()
+
+		/// Play events that didn't come from a CMF file.
+		/**
+		 * @param events Song data, in the same format as the music block of a
+		 *   CMF file (e.g. from smf::reader.)
+		 * @param header Song details.  Only iTicksPerSecond, iChannelsInUse and
+		 *   iNumInstruments are used.
+		 * @param pBank Array of header.iNumInstruments instruments, copied by
+		 *   init().  The CMF default instruments are used for the rest, and for
+		 *   all of them if pBank is NULL.
+		 */
+		basic_player(std::istream& events, const CMFHEADER& header, const SBI *pBank,
+			FN_SETREGISTER cbSetRegister, FN_DELAY cbDelay)
+			throw ();
+
+		virtual ~basic_player()
 			throw ();
 
 		/// Preload instruments and seek to start of song.
 		void init()
 			throw (std::ios::failure);
 
+		/// Only produce output for part of the song.
+		/**
+		 * Everything before iStart is still processed so the instruments and
+		 * controllers are correct, but no registers are written.  Once iStart is
+		 * reached the chip state is written out in one go, and once iEnd is
+		 * reached all notes are switched off and the song ends.
+		 *
+		 * Must be called before init().
+		 *
+		 * @param iStart Start time in milliseconds, 0 to start at the beginning.
+		 * @param iEnd End time in milliseconds, 0 to play until the end.
+		 */
+		void setRange(uint32_t iStart, uint32_t iEnd)
+			throw ();
+
+		/// Send progress and warning messages somewhere other than stdout.
+		/// Has no effect if the log policy discards messages.
+		void setLog(std::ostream& log)
+			throw ();
+
+		/// Record the instrument used by each melodic note as the song plays.
+		/**
+		 * The result can be given to setPlan() on a new player for the same song.
+		 * Must be called before init().
+		 */
+		void recordPlan(NOTEPLAN *pPlan)
+			throw ();
+
+		/// Choose OPL channels using the instruments of upcoming notes.
+		/**
+		 * Normally a note goes on any free channel, preferably one that already
+		 * has the right instrument.  With a plan, when no free channel has the
+		 * right instrument the one replaced is the instrument that won't be
+		 * needed again for the longest time (Belady's algorithm), which cuts
+		 * down on instrument changes.
+		 *
+		 * Must be called before init().
+		 *
+		 * @param plan Plan recorded by recordPlan() for the same song.  Must
+		 *   remain valid while the song is playing.
+		 */
+		void setPlan(const NOTEPLAN& plan)
+			throw ();
+
+		/// Start from a chip that has already been set up, e.g. by a previous
+		/// song in a playlist.
+		/**
+		 * init() then only writes the registers that differ between iRegs and
+		 * the state a blank chip would be in once the song has been set up.
+		 * Must be called before init().
+		 *
+		 * @param iRegs Values of all 256 registers, copied.
+		 */
+		void setBaseState(const uint8_t *iRegs)
+			throw ();
+
+		/// Save everything needed to carry on playing from this point.
+		/**
+		 * Can be called after init() or between calls to tick().
+		 */
+		void getState(PLAYERSTATE& state)
+			throw ();
+
+		/// Carry on from where another player of the same song left off.
+		/**
+		 * init() loads the instruments as usual, but instead of setting up the
+		 * chip it picks up from the saved state without writing any registers.
+		 * Must be called before init().
+		 *
+		 * @param state State from getState() on a player of the same song with
+		 *   the same plan.  Must remain valid until init() returns.
+		 */
+		void setState(const PLAYERSTATE& state)
+			throw ();
+
+		/// Current value of every OPL register.
+		const uint8_t *getRegisters() const
+			throw ();
+
+		/// Switch off every note currently playing.
+		void allNotesOff()
+			throw ();
+
+		/// Exact song position, in CMF ticks since the start of the song.
+		/**
+		 * Delays are passed to FN_DELAY in whole milliseconds, so this is the
+		 * time every event should have happened at, without any rounding.
+		 */
+		uint64_t getSongTicks() const
+			throw ();
+
+		/// Number of CMF ticks in one second.
+		unsigned int getTicksPerSecond() const
+			throw ();
+
+		/// Offset of the next event (starting with its delay) in the song data.
+		std::streamoff getPosition()
+			throw ();
+
+		/// MIDI command of the event played by the last tick(), including the
+		/// channel.
+		uint8_t getLastCommand() const
+			throw ();
+
+		/// Number of times an instrument has been loaded into an OPL channel.
+		unsigned int getInstrumentChanges() const
+			throw ();
+
 		/// Send the next lot of data.
 		/**
 		 * @return true if more data to play, false if end of file/song reached.
@@ -107,6 +398,10 @@ class player {
 			throw (std::ios::failure);
 
 	protected:
+		/// Put all the channels and registers in their power-on state.
+		void resetState()
+			throw ();
+
 		uint32_t readMIDINumber();
 		void writeInstrumentSettings(uint8_t iChannel, uint8_t iOperatorSource, uint8_t iOperatorDest, uint8_t iInstrument);
 
@@ -114,12 +409,60 @@ class player {
 		void setReg(uint8_t iRegister, uint8_t iValue)
 			throw ();
 
+		/// Pass a delay on to cbDelay, in several calls if it's too long for one.
+		void delay(uint32_t iMS)
+			throw ();
+
+		/// Write out every register needed to bring a blank chip (or one in the
+		/// base state) up to the values in iCurrentRegs.
+		void writeState()
+			throw ();
+
+		/// Work out the OPL frequency of a MIDI note, including pitchbend.
+		/**
+		 * @param iChannel MIDI channel the note is playing on.
+		 * @param iNote MIDI note number.
+		 * @param iBlock Set to the OPL block (octave).
+		 * @return OPL frequency number.
+		 */
+		uint16_t getFNum(uint8_t iChannel, uint8_t iNote, uint8_t *iBlock);
+
+		/// Update the frequency of every note still playing on a MIDI channel
+		/// after a pitchbend.  The registers aren't written until
+		/// flushPitchbends() is called, so a run of pitchbend events only
+		/// produces one frequency change per voice.
+		void MIDIpitchbend(uint8_t iChannel, uint16_t iValue);
+
+		/// Write out the new frequencies of any notes that have been pitchbent.
+		void flushPitchbends();
+
+		/// Write out the new frequency of a note that has been pitchbent.
+		void writePitchbend(int iOPLChannel);
+
 		void cmfNoteOn(uint8_t iChannel, uint8_t iNote, uint8_t iVelocity);
 		void cmfNoteOff(uint8_t iChannel, uint8_t iNote, uint8_t iVelocity);
 
-		/// When a MIDI instrument is played on a percussive channel (e.g. 11), figure
-		/// out which OPL rhythm-mode channel it must be played on (e.g. 7)
-		uint8_t getPercChannel(uint8_t iChannel);
+		/// Pick a free OPL channel for a note, using the plan.
+		/**
+		 * @return OPL channel, or -1 if all channels are in use.
+		 */
+		int planChannel(int iNumChannels, int iPatch)
+			throw ();
+
+		/// How many notes until an instrument is needed again, if it is removed
+		/// from an OPL channel.
+		/**
+		 * @return Position in the plan, or PLAN_NEVER if it won't be needed (or
+		 *   another channel already has the same instrument.)
+		 */
+		uint32_t nextUse(int iOPLChannel, int iNumChannels)
+			throw ();
+
+		/// Is this MIDI channel currently playing rhythm-mode percussion?
+		bool isPercussion(uint8_t iChannel) const
+		{
+			return (Policy::percussion::bEnabled) && (iChannel > 10) && (this->bPercussive);
+		}
 
 		/// Change instrument
 		void MIDIchangeInstrument(uint8_t iOPLChannel, uint8_t iMIDIChannel, uint8_t iNewInstrument);
@@ -129,6 +472,12 @@ class player {
 
 };
 
+/// The player used by cmf2imf
+typedef basic_player<policy_creative> player;
+
+/// Player that doesn't print any messages
+typedef basic_player<policy_quiet> quiet_player;
+
 } // namespace cmf
 
 #endif // CMF_HPP_
@@ -0,0 +1,1121 @@
+/*
+ * CMF2IMF - convert CMF files into id Software IMF files
+ * Copyright (C) 2005-2010 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Implementation of cmf::basic_player.  Only include this file if you need to
+ * instantiate the player with your own policies, otherwise just use cmf.hpp.
+ */
+
+#ifndef CMF_IMPL_HPP_
+#define CMF_IMPL_HPP_
+
+#include <camoto/iostream_helpers.hpp>
+#include <algorithm>
+#include <assert.h>
+#include <string.h>
+#include <math.h>
+
+#include "cmf.hpp"
+#include "opl.hpp"
+
+namespace cmf {
+
+using namespace camoto;
+
+/// Default instruments, used for any the CMF file doesn't define itself
+extern const char cDefaultPatches[];
+
+template <class Policy>
+basic_player<Policy>::basic_player(std::istream& data, FN_SETREGISTER cbSetRegister, FN_DELAY cbDelay)
+	throw (std::ios::failure) :
+	data(data),
+	pBank(NULL),
+	bHeaderless(false),
+	cbSetRegister(cbSetRegister),
+	cbDelay(cbDelay),
+	pInstruments(NULL),
+	bPercussive(false),
+	iTranspose(0),
+	iPrevCommand(0),
+	iNoteCount(0),
+	iPendingBend(0),
+	iCurrentTime(0),
+	iSongTicks(0),
+	iStartTime(0),
+	iEndTime(0),
+	bSilent(false),
+	bBaseState(false),
+	pRecordPlan(NULL),
+	pPlan(NULL),
+	iPlanPos(0),
+	iInstrumentChanges(0),
+	pResume(NULL)
+{
+	this->resetState();
+
+	std::string sig;
+	this->data >> fixedLength(sig, 4);
+	if (sig.compare("CTMF")) {
+		throw std::ios::failure("Input file is not a CMF file! (CTMF header missing)");
+	}
+	uint16_t iVer;
+	this->data >> u16le(iVer);
+	if ((iVer != 0x0101) && (iVer != 0x0100)) {
+		throw std::ios::failure("CMF file is not v1.0 or v1.1");
+	}
+
+	this->data
+		>> u16le(this->cmfHeader.iInstrumentBlockOffset)
+		>> u16le(this->cmfHeader.iMusicOffset)
+		>> u16le(this->cmfHeader.iTicksPerQuarterNote)
+		>> u16le(this->cmfHeader.iTicksPerSecond)
+		>> u16le(this->cmfHeader.iTagOffsetTitle)
+		>> u16le(this->cmfHeader.iTagOffsetComposer)
+		>> u16le(this->cmfHeader.iTagOffsetRemarks)
+	;
+	this->data.read((char *)this->cmfHeader.iChannelsInUse, 16);
+	switch (iVer) {
+		case 0x0100: {
+			uint8_t temp;
+			this->data
+				>> u8(temp);
+			;
+			this->cmfHeader.iNumInstruments = temp;
+			break;
+		}
+		case 0x0101:
+			this->data
+				>> u16le(this->cmfHeader.iNumInstruments)
+				>> u16le(this->cmfHeader.iTempo)
+			;
+			break;
+	}
+}
+
+template <class Policy>
+basic_player<Policy>::basic_player(std::istream& events, const CMFHEADER& header,
+	const SBI *pBank, FN_SETREGISTER cbSetRegister, FN_DELAY cbDelay)
+	throw () :
+	data(events),
+	pBank(pBank),
+	bHeaderless(true),
+	cbSetRegister(cbSetRegister),
+	cbDelay(cbDelay),
+	cmfHeader(header),
+	pInstruments(NULL),
+	bPercussive(false),
+	iTranspose(0),
+	iPrevCommand(0),
+	iNoteCount(0),
+	iPendingBend(0),
+	iCurrentTime(0),
+	iSongTicks(0),
+	iStartTime(0),
+	iEndTime(0),
+	bSilent(false),
+	bBaseState(false),
+	pRecordPlan(NULL),
+	pPlan(NULL),
+	iPlanPos(0),
+	iInstrumentChanges(0),
+	pResume(NULL)
+{
+	if (!pBank) this->cmfHeader.iNumInstruments = 0;
+	if (this->cmfHeader.iNumInstruments > 128) this->cmfHeader.iNumInstruments = 128;
+	this->resetState();
+}
+
+template <class Policy>
+void basic_player<Policy>::resetState()
+	throw ()
+{
+	assert(OPLOFFSET(1-1) == 0x00);
+	assert(OPLOFFSET(5-1) == 0x09);
+	assert(OPLOFFSET(9-1) == 0x12);
+
+	for (int i = 0; i < 9; i++) {
+		this->chOPL[i].iNoteStart = 0; // no note playing atm
+		this->chOPL[i].iMIDINote = 0;
+		this->chOPL[i].iMIDIChannel = 0;
+		this->chOPL[i].iMIDIPatch = -1;
+
+		this->chMIDI[i].iPatch = 0;
+		this->chMIDI[i].iPitchbend = 8192;
+	}
+	for (int i = 9; i < 16; i++) {
+		this->chMIDI[i].iPatch = 0;
+		this->chMIDI[i].iPitchbend = 8192;
+	}
+
+	memset(this->iCurrentRegs, 0, 256);
+	memset(this->iBaseRegs, 0, 256);
+	return;
+}
+
+template <class Policy>
+basic_player<Policy>::~basic_player()
+	throw ()
+{
+	if (this->pInstruments) delete[] this->pInstruments;
+}
+
+template <class Policy>
+void basic_player<Policy>::setRange(uint32_t iStart, uint32_t iEnd)
+	throw ()
+{
+	this->iStartTime = iStart;
+	this->iEndTime = iEnd;
+	// Don't write anything (including the init() registers) until we reach the
+	// start time, at which point the whole chip state is written at once.
+	this->bSilent = (iStart > 0);
+	return;
+}
+
+template <class Policy>
+void basic_player<Policy>::setLog(std::ostream& log)
+	throw ()
+{
+	this->log.setStream(log);
+	return;
+}
+
+template <class Policy>
+void basic_player<Policy>::recordPlan(NOTEPLAN *pPlan)
+	throw ()
+{
+	this->pRecordPlan = pPlan;
+	return;
+}
+
+template <class Policy>
+void basic_player<Policy>::setPlan(const NOTEPLAN& plan)
+	throw ()
+{
+	this->pPlan = &plan;
+	for (int i = 0; i < 128; i++) this->planUses[i].clear();
+	for (uint32_t i = 0; i < plan.size(); i++) {
+		this->planUses[plan[i] & 0x7F].push_back(i);
+	}
+	return;
+}
+
+template <class Policy>
+void basic_player<Policy>::setBaseState(const uint8_t *iRegs)
+	throw ()
+{
+	memcpy(this->iBaseRegs, iRegs, 256);
+	this->bBaseState = true;
+	return;
+}
+
+template <class Policy>
+void basic_player<Policy>::getState(PLAYERSTATE& state)
+	throw ()
+{
+	state.iPos = this->data.tellg();
+	memcpy(state.iCurrentRegs, this->iCurrentRegs, 256);
+	memcpy(state.chMIDI, this->chMIDI, sizeof(this->chMIDI));
+	memcpy(state.chOPL, this->chOPL, sizeof(this->chOPL));
+	state.bPercussive = this->bPercussive;
+	state.iTranspose = this->iTranspose;
+	state.iPrevCommand = this->iPrevCommand;
+	state.iNoteCount = this->iNoteCount;
+	state.iPendingBend = this->iPendingBend;
+	state.iCurrentTime = this->iCurrentTime;
+	state.iSongTicks = this->iSongTicks;
+	state.iPlanPos = this->iPlanPos;
+	state.iInstrumentChanges = this->iInstrumentChanges;
+	return;
+}
+
+template <class Policy>
+void basic_player<Policy>::setState(const PLAYERSTATE& state)
+	throw ()
+{
+	this->pResume = &state;
+	return;
+}
+
+template <class Policy>
+const uint8_t *basic_player<Policy>::getRegisters() const
+	throw ()
+{
+	return this->iCurrentRegs;
+}
+
+template <class Policy>
+uint64_t basic_player<Policy>::getSongTicks() const
+	throw ()
+{
+	return this->iSongTicks;
+}
+
+template <class Policy>
+unsigned int basic_player<Policy>::getTicksPerSecond() const
+	throw ()
+{
+	return this->cmfHeader.iTicksPerSecond;
+}
+
+template <class Policy>
+std::streamoff basic_player<Policy>::getPosition()
+	throw ()
+{
+	return this->data.tellg();
+}
+
+template <class Policy>
+uint8_t basic_player<Policy>::getLastCommand() const
+	throw ()
+{
+	return this->iPrevCommand;
+}
+
+template <class Policy>
+unsigned int basic_player<Policy>::getInstrumentChanges() const
+	throw ()
+{
+	return this->iInstrumentChanges;
+}
+
+template <class Policy>
+void basic_player<Policy>::init(void)
+	throw (std::ios::failure)
+{
+	this->pInstruments = new SBI[128];
+
+	// Set the song up as if the chip was blank, then write the difference
+	// between that and what's really there once we're done.
+	bool bWasSilent = this->bSilent;
+	if ((this->bBaseState) || (this->pResume)) this->bSilent = true;
+
+	if (this->bHeaderless) {
+		for (int i = 0; i < this->cmfHeader.iNumInstruments; i++) {
+			this->pInstruments[i] = this->pBank[i];
+		}
+	} else this->data.seekg(this->cmfHeader.iInstrumentBlockOffset);
+
+	for (int i = 0; (!this->bHeaderless) && (i < this->cmfHeader.iNumInstruments); i++) {
+		this->data
+			>> u8(this->pInstruments[i].op[0].iCharMult)
+			>> u8(this->pInstruments[i].op[1].iCharMult)
+			>> u8(this->pInstruments[i].op[0].iScalingOutput)
+			>> u8(this->pInstruments[i].op[1].iScalingOutput)
+			>> u8(this->pInstruments[i].op[0].iAttackDecay)
+			>> u8(this->pInstruments[i].op[1].iAttackDecay)
+			>> u8(this->pInstruments[i].op[0].iSustainRelease)
+			>> u8(this->pInstruments[i].op[1].iSustainRelease)
+			>> u8(this->pInstruments[i].op[0].iWaveSel)
+			>> u8(this->pInstruments[i].op[1].iWaveSel)
+			>> u8(this->pInstruments[i].iConnection)
+		;
+		this->data.seekg(5, std::ios::cur); // skip over the padding bytes
+	}
+
+	// Set the rest of the instruments to the CMF defaults
+	for (int i = this->cmfHeader.iNumInstruments; i < 128; i++) {
+		this->pInstruments[i].op[0].iCharMult =       cDefaultPatches[(i % 16) * 11 + 0];
+		this->pInstruments[i].op[1].iCharMult =       cDefaultPatches[(i % 16) * 11 + 1];
+		this->pInstruments[i].op[0].iScalingOutput =  cDefaultPatches[(i % 16) * 11 + 2];
+		this->pInstruments[i].op[1].iScalingOutput =  cDefaultPatches[(i % 16) * 11 + 3];
+		this->pInstruments[i].op[0].iAttackDecay =    cDefaultPatches[(i % 16) * 11 + 4];
+		this->pInstruments[i].op[1].iAttackDecay =    cDefaultPatches[(i % 16) * 11 + 5];
+		this->pInstruments[i].op[0].iSustainRelease = cDefaultPatches[(i % 16) * 11 + 6];
+		this->pInstruments[i].op[1].iSustainRelease = cDefaultPatches[(i % 16) * 11 + 7];
+		this->pInstruments[i].op[0].iWaveSel =        cDefaultPatches[(i % 16) * 11 + 8];
+		this->pInstruments[i].op[1].iWaveSel =        cDefaultPatches[(i % 16) * 11 + 9];
+		this->pInstruments[i].iConnection =           cDefaultPatches[(i % 16) * 11 + 10];
+	}
+
+	this->log << "Found " << this->cmfHeader.iNumInstruments << " instrument definitions" << std::endl;
+
+	// MIDI files don't use rhythm mode, and there must be five instruments to
+	// preset (otherwise the patch numbers would be negative.)
+	if ((Policy::setup::bPresetPercussion) && (Policy::percussion::bEnabled) &&
+		(!this->bHeaderless) && (this->cmfHeader.iNumInstruments >= 5)
+	) {
+		// Testing.  Set the last five instruments to the percussive ones.
+		this->bPercussive = true;
+	//	this->pInstruments[6].op[0].iScalingOutput = 0x4F;
+		for (int i = this->cmfHeader.iNumInstruments - 5, j = 11; j < 16; i++, j++) {
+			this->chMIDI[j].iPatch = i;
+			this->log << "Presetting MIDI channel " << j << " to patch " << i << std::endl;
+			uint8_t iPercChannel = Policy::percussion::channel(j);
+			this->MIDIchangeInstrument(iPercChannel, j, i);
+		}
+		this->bPercussive = false;
+	}
+
+	if (!this->bHeaderless) this->data.seekg(this->cmfHeader.iMusicOffset, std::ios::beg);
+
+	// Initialise the chip
+	for (unsigned int i = 0; i < Policy::setup::iNumRegs; i++) {
+		this->setReg(Policy::setup::cRegs[i][0], Policy::setup::cRegs[i][1]);
+	}
+	if ((this->bBaseState) && (!bWasSilent)) {
+		this->writeState();
+		this->bSilent = false;
+	}
+
+	this->iPrevCommand = 0;
+
+	if (this->pResume) {
+		const PLAYERSTATE& state = *this->pResume;
+		this->data.seekg(state.iPos, std::ios::beg);
+		memcpy(this->iCurrentRegs, state.iCurrentRegs, 256);
+		memcpy(this->chMIDI, state.chMIDI, sizeof(this->chMIDI));
+		memcpy(this->chOPL, state.chOPL, sizeof(this->chOPL));
+		this->bPercussive = state.bPercussive;
+		this->iTranspose = state.iTranspose;
+		this->iPrevCommand = state.iPrevCommand;
+		this->iNoteCount = state.iNoteCount;
+		this->iPendingBend = state.iPendingBend;
+		this->iCurrentTime = state.iCurrentTime;
+		this->iSongTicks = state.iSongTicks;
+		this->iPlanPos = state.iPlanPos;
+		this->iInstrumentChanges = state.iInstrumentChanges;
+		this->bSilent = bWasSilent;
+		this->pResume = NULL;
+	}
+
+	return;
+}
+
+template <class Policy>
+bool basic_player<Policy>::tick()
+	throw (std::ios::failure)
+{
+	if (this->data.eof()) {
+		this->flushPitchbends();
+		return false;
+	}
+
+	// Read in the number of ticks until the next event
+	uint32_t iDelay = this->readMIDINumber();
+
+	// Wait for the required delay
+	//if (iDelay) this->pOPL->updateBlock((iDelay * AUD_FREQ) / this->cmfHeader.iTicksPerSecond);
+	if (iDelay) {
+		// Any pitchbends since the last delay happen now, before time moves on
+		this->flushPitchbends();
+		this->iSongTicks += iDelay;
+
+		uint32_t iDelayMS = ((uint64_t)iDelay * 1000) / this->cmfHeader.iTicksPerSecond;
+		if ((this->iEndTime) && (this->iCurrentTime + iDelayMS >= this->iEndTime)) {
+			// The next event is past the end of the range, so finish here
+			if (!this->bSilent) {
+				this->delay(this->iEndTime - this->iCurrentTime);
+				this->allNotesOff();
+			}
+			this->iCurrentTime = this->iEndTime;
+			return false;
+		}
+		this->iCurrentTime += iDelayMS;
+		if (this->bSilent) {
+			if (this->iCurrentTime >= this->iStartTime) {
+				// Reached the start of the range, bring the chip up to date
+				this->writeState();
+				this->bSilent = false;
+				if (this->iCurrentTime > this->iStartTime) {
+					this->delay(this->iCurrentTime - this->iStartTime);
+				}
+			}
+		} else {
+			this->delay(iDelayMS);
+		}
+	}
+
+	// Read in the next event
+	uint8_t iCommand;
+	this->data >> u8(iCommand);
+	if (iCommand & 0x80) {
+		this->iPrevCommand = iCommand;
+	} else {
+		// Running status, use previous command
+		this->data.seekg(-1, std::ios::cur); // dodgy, fix this
+		iCommand = this->iPrevCommand;
+	}
+
+		if (!(iCommand & 0x80)) {
+			this->log << "Corrupt CMF file or bug in MIDI parser - invalid MIDI event "
+				<< (int)iCommand << " at offset 0x" << std::hex << this->data.tellg()
+				<< std::endl;
+			return false;
+		}
+
+		uint8_t iChannel = iCommand & 0x0F;
+		switch (iCommand & 0xF0) {
+			case 0x80: { // Note off (two data bytes)
+				uint8_t iNote, iVelocity;
+				this->data
+					>> u8(iNote)
+					>> u8(iVelocity)  // release velocity
+				;
+				this->cmfNoteOff(iChannel, iNote, iVelocity);
+				break;
+			}
+			case 0x90: { // Note on (two data bytes)
+				uint8_t iNote, iVelocity;
+				this->data
+					>> u8(iNote)
+					>> u8(iVelocity)  // attack velocity
+				;
+				if (iVelocity) {
+					this->cmfNoteOn(iChannel, iNote, iVelocity);
+				} else {
+					// This is a note-off instead (velocity == 0)
+					this->cmfNoteOff(iChannel, iNote, iVelocity); // 64 is the MIDI default note-off velocity
+					break;
+				}
+				break;
+			}
+			case 0xA0: { // Polyphonic key pressure (two data bytes)
+				uint8_t iNote, iPressure;
+				this->data
+					>> u8(iNote)
+					>> u8(iPressure)
+				;
+				this->log << "Key pressure not yet implemented!" << std::endl;
+				break;
+			}
+			case 0xB0: { // Controller (two data bytes)
+				uint8_t iController, iValue;
+				this->data
+					>> u8(iController)
+					>> u8(iValue)
+				;
+				this->MIDIcontroller(iChannel, iController, iValue);
+				break;
+			}
+			case 0xC0: { // Instrument change (one data byte)
+				uint8_t iNewInstrument;
+				this->data
+					>> u8(iNewInstrument)
+				;
+				this->chMIDI[iChannel].iPatch = iNewInstrument;
+				this->log << "Remembering MIDI channel " << (int)iChannel << " now uses patch " << (int)iNewInstrument << std::endl;
+				//this->MIDIchangeInstrument(iChannel, iNewInstrument);
+				break;
+			}
+			case 0xD0: { // Channel pressure (one data byte)
+				uint8_t iPressure;
+				this->data
+					>> u8(iPressure)
+				;
+				this->log << "Channel pressure not yet implemented!" << std::endl;
+				break;
+			}
+			case 0xE0: { // Pitch bend (two data bytes)
+				uint8_t iLSB, iMSB;
+				this->data
+					>> u8(iLSB)
+					>> u8(iMSB)
+				;
+				// Only lower seven bits are used in each byte
+				uint16_t iValue = ((iMSB & 0x7F) << 7) | (iLSB & 0x7F);
+				// 8192 is middle, 0 is -2 semitones, 16384 is +2 semitones
+				this->MIDIpitchbend(iChannel, iValue);
+				break;
+			}
+			case 0xF0: // System message (arbitrary data bytes)
+				switch (iCommand) {
+					case 0xF0: { // Sysex
+						uint8_t iNextByte;
+						this->log << "Sysex message: ";
+						do {
+							this->data >> u8(iNextByte);
+							this->log << std::hex << (int)iNextByte;
+						} while ((iNextByte & 0x80) == 0);
+						this->log << std::endl;
+						// This will have read in the terminating EOX (0xF7) message too
+						break;
+					}
+					case 0xF1: // MIDI Time Code Quarter Frame
+						this->data.seekg(1, std::ios::cur); // message data (ignored)
+						break;
+					case 0xF2: // Song position pointer
+						this->data.seekg(2, std::ios::cur); // message data (ignored)
+						break;
+					case 0xF3: // Song select
+						this->data.seekg(1, std::ios::cur); // message data (ignored)
+						this->log << "Warning: MIDI Song Select is not implemented." << std::endl;
+						break;
+					case 0xF6: // Tune request
+						break;
+					case 0xF7: // End of System Exclusive (EOX) - should never be read, should be absorbed by Sysex handling code
+						break;
+
+					// These messages are "real time", meaning they can be sent between the bytes of other messages - but we're
+					// lazy and don't handle these here (hopefully they're not necessary in a MIDI file, and even less likely to
+					// occur in a CMF.)
+					case 0xF8: // Timing clock (sent 24 times per quarter note, only when playing)
+					case 0xFA: // Start
+					case 0xFB: // Continue
+					case 0xFE: // Active sensing (sent every 300ms or MIDI connection assumed lost)
+						break;
+					case 0xFC: // Stop
+						this->log << "Received Real Time Stop message (0xFC)" << std::endl;
+						return false;
+					case 0xFF: { // System reset, used as meta-events in a MIDI file
+						uint8_t iEvent;
+						this->data >> u8(iEvent);
+						switch (iEvent) {
+							case 0x2F: // end of track
+								this->log << "Reached MIDI end-of-track" << std::endl;
+								this->flushPitchbends();
+								return false;
+							default:
+								this->log << "Unknown MIDI meta-event 0xFF 0x" << std::hex << (int)iEvent << std::endl;
+								break;
+						}
+						break;
+					}
+					default:
+						this->log << "Unknown MIDI system command 0x" << std::hex << (int)iCommand << std::endl;
+						break;
+				}
+				break;
+			default:
+				this->log << "Unknown MIDI command 0x" << std::hex << (int)iCommand << std::endl;
+				break;
+		}
+
+	return true; // more data to play
+}
+
+// Read a variable-length integer from MIDI data
+template <class Policy>
+uint32_t basic_player<Policy>::readMIDINumber()
+{
+	uint32_t iValue = 0;
+	for (int i = 0; i < 4; i++) {
+		uint8_t iNext;
+		this->data >> u8(iNext);
+		iValue <<= 7;
+		iValue |= (iNext & 0x7F); // ignore the MSB
+		if ((iNext & 0x80) == 0) break; // last byte has the MSB unset
+	}
+	return iValue;
+}
+
+// iChannel: OPL channel (0-8)
+// iOperator: 0 == Modulator, 1 == Carrier
+//   Source - source operator to read from instrument definition
+//   Dest - destination operator on OPL chip
+// iInstrument: Index into this->pInstruments array of CMF instruments
+template <class Policy>
+void basic_player<Policy>::writeInstrumentSettings(uint8_t iChannel, uint8_t iOperatorSource, uint8_t iOperatorDest, uint8_t iInstrument)
+{
+	assert(iChannel <= 8);
+
+	uint8_t iOPLOffset = OPLOFFSET(iChannel);
+	if (iOperatorDest) iOPLOffset += 3; // Carrier if iOperator == 1 (else Modulator)
+
+	this->setReg(BASE_CHAR_MULT + iOPLOffset, this->pInstruments[iInstrument].op[iOperatorSource].iCharMult);
+	this->setReg(BASE_SCAL_LEVL + iOPLOffset, this->pInstruments[iInstrument].op[iOperatorSource].iScalingOutput);
+	this->setReg(BASE_ATCK_DCAY + iOPLOffset, this->pInstruments[iInstrument].op[iOperatorSource].iAttackDecay);
+	this->setReg(BASE_SUST_RLSE + iOPLOffset, this->pInstruments[iInstrument].op[iOperatorSource].iSustainRelease);
+	this->setReg(BASE_WAVE      + iOPLOffset, this->pInstruments[iInstrument].op[iOperatorSource].iWaveSel);
+
+	// TODO: Check to see whether we should only be loading this for one or both operators
+	this->setReg(BASE_FEED_CONN + iChannel, this->pInstruments[iInstrument].iConnection);
+	return;
+}
+
+// Write a byte to the OPL "chip" and update the current record of register states
+template <class Policy>
+void basic_player<Policy>::setReg(uint8_t iRegister, uint8_t iValue)
+	throw ()
+{
+	if (!this->bSilent) this->cbSetRegister(iRegister, iValue);
+	this->iCurrentRegs[iRegister] = iValue;
+	return;
+}
+
+template <class Policy>
+void basic_player<Policy>::delay(uint32_t iMS)
+	throw ()
+{
+	while (iMS > 0xFFFF) {
+		this->cbDelay(0xFFFF);
+		iMS -= 0xFFFF;
+	}
+	this->cbDelay(iMS);
+	return;
+}
+
+template <class Policy>
+void basic_player<Policy>::writeState()
+	throw ()
+{
+	// A blank chip has every register set to zero (iBaseRegs is all zeros
+	// unless setBaseState() was called), so only the registers that differ
+	// need to be written.  The key-on registers go last so the instruments and
+	// frequencies are in place before any notes start.
+	const uint8_t *iCur = this->iCurrentRegs, *iBase = this->iBaseRegs;
+	for (int i = 0; i < 256; i++) {
+		if ((i >= BASE_KEYON_FREQ) && (i <= BASE_KEYON_FREQ + 8)) continue;
+		if (i == BASE_RHYTHM) continue;
+		if (iCur[i] != iBase[i]) this->cbSetRegister(i, iCur[i]);
+	}
+	for (int i = BASE_KEYON_FREQ; i <= BASE_KEYON_FREQ + 8; i++) {
+		if (iCur[i] != iBase[i]) this->cbSetRegister(i, iCur[i]);
+	}
+	if (iCur[BASE_RHYTHM] != iBase[BASE_RHYTHM]) {
+		this->cbSetRegister(BASE_RHYTHM, iCur[BASE_RHYTHM]);
+	}
+	return;
+}
+
+template <class Policy>
+void basic_player<Policy>::allNotesOff()
+	throw ()
+{
+	for (int i = 0; i < 9; i++) {
+		if (this->iCurrentRegs[BASE_KEYON_FREQ + i] & OPLBIT_KEYON) {
+			this->setReg(BASE_KEYON_FREQ + i, this->iCurrentRegs[BASE_KEYON_FREQ + i] & ~OPLBIT_KEYON);
+		}
+		this->chOPL[i].iNoteStart = 0;
+	}
+	this->iPendingBend = 0;
+	// Percussion instruments
+	if (this->iCurrentRegs[BASE_RHYTHM] & 0x1F) {
+		this->setReg(BASE_RHYTHM, this->iCurrentRegs[BASE_RHYTHM] & ~0x1F);
+	}
+	return;
+}
+
+template <class Policy>
+uint16_t basic_player<Policy>::getFNum(uint8_t iChannel, uint8_t iNote, uint8_t *iBlock)
+{
+	// Note 42 ==> FNum 485 blk 2 ==> 92.50640Hz
+	// Get the OPL frequency of this MIDI note
+	*iBlock = iNote / 12;
+	if (*iBlock > 1) (*iBlock)--; // keep in the same range as the Creative player
+
+	double d = pow(2, (
+		(double)iNote + (
+			(this->chMIDI[iChannel].iPitchbend - 8192) / 8192.0
+		) + (
+			this->iTranspose / 128
+		) - 9) / 12.0 - (*iBlock - 20))
+		* 440.0 / 32.0 / 50000.0;
+	uint16_t iOPLFNum = (uint16_t)(d+0.5);
+	if (iOPLFNum > 1023) this->log << "This song plays a note that is out of range! (send this song to malvineous@shikadi.net!)" << std::endl;
+	return iOPLFNum;
+}
+
+template <class Policy>
+void basic_player<Policy>::MIDIpitchbend(uint8_t iChannel, uint16_t iValue)
+{
+	this->chMIDI[iChannel].iPitchbend = iValue;
+
+	// Percussion notes are too short to bother bending
+	if (this->isPercussion(iChannel)) return;
+
+	int iNumChannels = this->bPercussive ? 6 : 9;
+	for (int i = 0; i < iNumChannels; i++) {
+		if (
+			(this->chOPL[i].iMIDIChannel == iChannel) &&
+			(this->chOPL[i].iNoteStart != 0)
+		) {
+			this->iPendingBend |= 1 << i;
+		}
+	}
+	return;
+}
+
+template <class Policy>
+void basic_player<Policy>::flushPitchbends()
+{
+	if (!this->iPendingBend) return;
+	for (int i = 0; i < 9; i++) {
+		if (this->iPendingBend & (1 << i)) this->writePitchbend(i);
+	}
+	return;
+}
+
+template <class Policy>
+void basic_player<Policy>::writePitchbend(int iOPLChannel)
+{
+	this->iPendingBend &= ~(1 << iOPLChannel);
+	if (this->chOPL[iOPLChannel].iNoteStart == 0) return; // note has finished
+
+	uint8_t iBlock;
+	uint16_t iOPLFNum = this->getFNum(this->chOPL[iOPLChannel].iMIDIChannel,
+		this->chOPL[iOPLChannel].iMIDINote, &iBlock);
+
+	// Only the frequency changes, so leave the key-on bit as it is
+	uint8_t iFNumL = iOPLFNum & 0xFF;
+	uint8_t iKeyOnFreq = (this->iCurrentRegs[BASE_KEYON_FREQ + iOPLChannel] & OPLBIT_KEYON)
+		| (iBlock << 2) | ((iOPLFNum & 0x300) >> 8);
+	if (this->iCurrentRegs[BASE_FNUM_L + iOPLChannel] != iFNumL) {
+		this->setReg(BASE_FNUM_L + iOPLChannel, iFNumL);
+	}
+	if (this->iCurrentRegs[BASE_KEYON_FREQ + iOPLChannel] != iKeyOnFreq) {
+		this->setReg(BASE_KEYON_FREQ + iOPLChannel, iKeyOnFreq);
+	}
+	return;
+}
+
+template <class Policy>
+void basic_player<Policy>::cmfNoteOn(uint8_t iChannel, uint8_t iNote, uint8_t iVelocity)
+{
+	uint8_t iBlock;
+	uint16_t iOPLFNum = this->getFNum(iChannel, iNote, &iBlock);
+
+	// See if we're playing a rhythm mode percussive instrument
+	if (this->isPercussion(iChannel)) {
+		uint8_t iPercChannel = Policy::percussion::channel(iChannel);
+
+		// Will have to set every time (easier) than figuring out whether the mod
+		// or car needs to be changed.
+		//if (this->chOPL[iPercChannel].iMIDIPatch != this->chMIDI[iChannel].iPatch) {
+			this->MIDIchangeInstrument(iPercChannel, iChannel, this->chMIDI[iChannel].iPatch);
+		//}
+
+		// Set the volume from the note velocity
+		uint8_t iLevel = Policy::velocity::percLevel(iVelocity);
+
+		int iOPLOffset = BASE_SCAL_LEVL + OPLOFFSET(iPercChannel);
+		//if ((iChannel == 11) || (iChannel == 12) || (iChannel == 14)) {
+		if (iChannel == 11) iOPLOffset += 3; // only do bassdrum carrier for volume control
+			//iOPLOffset += 3; // carrier
+			this->setReg(iOPLOffset, (this->iCurrentRegs[iOPLOffset] & ~0x3F) | iLevel);//(iVelocity * 0x3F / 127));
+		//}
+		// Bass drum (ch11) uses both operators
+		//if (iChannel == 11) this->setReg(iOPLOffset + 3, (this->iCurrentRegs[iOPLOffset + 3] & ~0x3F) | iLevel);
+
+
+		// Apparently you can't set the frequency for the cymbal or hihat?
+		// Vinyl requires you don't set it, Kiloblaster requires you do!
+		this->setReg(BASE_FNUM_L + iPercChannel, iOPLFNum & 0xFF);
+		this->setReg(BASE_KEYON_FREQ + iPercChannel, (iBlock << 2) | ((iOPLFNum >> 8) & 0x03));
+
+		uint8_t iBit = 1 << (15 - iChannel);
+
+		// Turn the perc instrument off if it's already playing (OPL can't do
+		// polyphonic notes w/ percussion)
+		if (this->iCurrentRegs[BASE_RHYTHM] & iBit) this->setReg(BASE_RHYTHM, this->iCurrentRegs[BASE_RHYTHM] & ~iBit);
+
+		// I wonder whether we need to delay or anything here?
+
+		// Turn the note on
+		//if (iChannel == 15) {
+		this->setReg(BASE_RHYTHM, this->iCurrentRegs[BASE_RHYTHM] | iBit);
+		//logerror("CMF: Note %d on MIDI channel %d (mapped to OPL channel %d-1) - vel %02X, fnum %d/%d\n", iNote, iChannel, iPercChannel+1, iVelocity, iOPLFNum, iBlock);
+		//}
+
+		this->chOPL[iPercChannel].iNoteStart = ++this->iNoteCount;
+		this->chOPL[iPercChannel].iMIDIChannel = iChannel;
+		this->chOPL[iPercChannel].iMIDINote = iNote;
+
+	} else { // Non rhythm-mode or a normal instrument channel
+
+		if (this->pRecordPlan) this->pRecordPlan->push_back(this->chMIDI[iChannel].iPatch);
+
+		// Figure out which OPL channel to play this note on
+		int iOPLChannel = -1;
+		int iNumChannels = this->bPercussive ? 6 : 9;
+		if (this->pPlan) {
+			iOPLChannel = this->planChannel(iNumChannels, this->chMIDI[iChannel].iPatch);
+		} else {
+			for (int i = iNumChannels - 1; i >= 0; i--) {
+				// If there's no note playing on this OPL channel, use that
+				if (this->chOPL[i].iNoteStart == 0) {
+					iOPLChannel = i;
+					// See if this channel is already set to the instrument we want.
+					if (this->chOPL[i].iMIDIPatch == this->chMIDI[iChannel].iPatch) {
+						// It is, so stop searching
+						break;
+					} // else keep searching just in case there's a better match
+				}
+			}
+		}
+		this->iPlanPos++;
+		if (iOPLChannel == -1) {
+			// All channels were in use, find the one with the longest note
+			iOPLChannel = 0;
+			int iEarliest = this->chOPL[0].iNoteStart;
+			for (int i = 1; i < iNumChannels; i++) {
+				if (this->chOPL[i].iNoteStart < iEarliest) {
+					// Found a channel with a note being played for longer
+					iOPLChannel = i;
+					iEarliest = this->chOPL[i].iNoteStart;
+				}
+			}
+			this->log << "Warning: Too many polyphonic notes, cutting note on "
+				"channel " << iOPLChannel << std::endl;
+		}
+
+		// Run through all the channels with negative notestart values - these
+		// channels have had notes recently stop - and increment the counter
+		// to slowly move the channel closer to being reused for a future note.
+		//for (int i = 0; i < iNumChannels; i++) {
+		//	if (this->chOPL[i].iNoteStart < 0) this->chOPL[i].iNoteStart++;
+		//}
+
+		// Now the new note should be played on iOPLChannel, but see if the instrument
+		// is right first.
+		if (this->chOPL[iOPLChannel].iMIDIPatch != this->chMIDI[iChannel].iPatch) {
+			this->MIDIchangeInstrument(iOPLChannel, iChannel, this->chMIDI[iChannel].iPatch);
+		}
+
+		this->chOPL[iOPLChannel].iNoteStart = ++this->iNoteCount;
+		this->chOPL[iOPLChannel].iMIDIChannel = iChannel;
+		this->chOPL[iOPLChannel].iMIDINote = iNote;
+		this->iPendingBend &= ~(1 << iOPLChannel); // new note already uses the current pitchbend
+/*					-- This seems quite normal, a lot of songs don't always use noteoffs between notes
+          -- Actually, at least one song (xargon1\song_9.cmf) won't work unless noteoffs are sent before noteons,
+             because that song goes "note1on, note2on, note1off, note2off" so you have to switch the notes off
+             in order!
+*/
+//// if (this->iCurrentRegs[BASE_KEYON_FREQ + iChannel] & OPLBIT_KEYON) {
+//							fprintf(stderr, "CMF: Note-on when note is already on!\n");
+////				this->setReg(BASE_KEYON_FREQ + iOPLChannel, this->iCurrentRegs[BASE_KEYON_FREQ + iOPLChannel] & ~OPLBIT_KEYON);
+			//}
+
+			/*fprintf(stderr, "Chan %d freq %lf - %02X: %02X, %02X: %02X\n", iChannel, dbFreq,
+				BASE_FNUM_L + iChannel, iOPLFNum & 0xFF,
+				BASE_KEYON_FREQ + iChannel, OPLBIT_KEYON | (iBlock << 2) | ((iOPLFNum & 0x300) >> 8)
+			);*/
+
+			if (Policy::velocity::bMelodic) {
+				// Adjust the channel volume to match the note velocity
+				uint8_t iOPLOffset = BASE_SCAL_LEVL + OPLOFFSET(iOPLChannel) + 3; // +3 == Carrier
+				uint8_t iLevel = Policy::velocity::melodicLevel(iVelocity);
+				this->setReg(iOPLOffset, (this->iCurrentRegs[iOPLOffset] & ~0x3F) | iLevel);
+			}
+
+			// Set the frequency and play the note
+			this->setReg(BASE_FNUM_L + iOPLChannel, iOPLFNum & 0xFF);
+			//if (iChannel == 5)
+				this->setReg(BASE_KEYON_FREQ + iOPLChannel, OPLBIT_KEYON | (iBlock << 2) | ((iOPLFNum & 0x300) >> 8));
+			//	logerror("CMF: Note %d on MIDI channel %d (mapped to OPL channel %d)\n", iNote, iChannel, iOPLChannel);
+			//else
+			//	this->setReg(BASE_KEYON_FREQ + iOPLChannel, /* TEMP - no keyon */ (iBlock << 2) | ((iOPLFNum & 0x300) >> 8));
+		//}
+	}
+	return;
+}
+
+template <class Policy>
+int basic_player<Policy>::planChannel(int iNumChannels, int iPatch)
+	throw ()
+{
+	int iOPLChannel = -1;
+	uint32_t iFurthest = 0;
+	for (int i = iNumChannels - 1; i >= 0; i--) {
+		if (this->chOPL[i].iNoteStart != 0) continue; // channel in use
+		if (this->chOPL[i].iMIDIPatch == iPatch) return i; // already loaded
+
+		// Replace the instrument that will be needed again the furthest into
+		// the future
+		uint32_t iNext = this->nextUse(i, iNumChannels);
+		if ((iOPLChannel == -1) || (iNext > iFurthest)) {
+			iOPLChannel = i;
+			iFurthest = iNext;
+		}
+	}
+	return iOPLChannel;
+}
+
+template <class Policy>
+uint32_t basic_player<Policy>::nextUse(int iOPLChannel, int iNumChannels)
+	throw ()
+{
+	int iPatch = this->chOPL[iOPLChannel].iMIDIPatch;
+	if ((iPatch < 0) || (iPatch > 127)) return PLAN_NEVER; // nothing loaded
+
+	// Removing one copy of an instrument costs nothing if another channel has it
+	for (int i = 0; i < iNumChannels; i++) {
+		if ((i != iOPLChannel) && (this->chOPL[i].iMIDIPatch == iPatch)) return PLAN_NEVER;
+	}
+
+	// Find the next note (after the one being played now) using the instrument
+	const std::vector<uint32_t>& uses = this->planUses[iPatch];
+	std::vector<uint32_t>::const_iterator next =
+		std::upper_bound(uses.begin(), uses.end(), this->iPlanPos);
+	if (next == uses.end()) return PLAN_NEVER;
+	return *next;
+}
+
+template <class Policy>
+void basic_player<Policy>::cmfNoteOff(uint8_t iChannel, uint8_t iNote, uint8_t iVelocity)
+{
+	if (this->isPercussion(iChannel)) {
+		int iOPLChannel = Policy::percussion::channel(iChannel);
+		if (this->chOPL[iOPLChannel].iMIDINote != iNote) return; // there's a different note playing now
+		this->setReg(BASE_RHYTHM, this->iCurrentRegs[BASE_RHYTHM] & ~(1 << (15 - iChannel)));
+		/*switch (iChannel) {
+			case 11: // Bass drum (operator 13+16 == channel 7 modulator+carrier)
+				this->setReg(BASE_RHYTHM, this->iCurrentRegs[BASE_RHYTHM] & ~0x10);
+				break;
+			case 12: // Snare drum (operator 17 == channel 8 carrier)
+				this->setReg(BASE_RHYTHM, this->iCurrentRegs[BASE_RHYTHM] & ~0x08);
+				break;
+			case 13: // Tom tom (operator 15 == channel 9 modulator)
+				this->setReg(BASE_RHYTHM, this->iCurrentRegs[BASE_RHYTHM] & ~0x04);
+				break;
+			case 14: // Top cymbal (operator 18 == channel 9 carrier)
+				this->setReg(BASE_RHYTHM, this->iCurrentRegs[BASE_RHYTHM] & ~0x02);
+				break;
+			case 15: // Hi-hat (operator 14 == channel 8 modulator)
+				this->setReg(BASE_RHYTHM, this->iCurrentRegs[BASE_RHYTHM] & ~0x01);
+				break;
+		}*/
+		this->chOPL[iOPLChannel].iNoteStart = 0; // channel free
+	} else { // Non rhythm-mode or a normal instrument channel
+		int iOPLChannel = -1;
+		int iNumChannels = this->bPercussive ? 6 : 9;
+		for (int i = 0; i < iNumChannels; i++) {
+			if (
+				(this->chOPL[i].iMIDIChannel == iChannel) &&
+				(this->chOPL[i].iMIDINote == iNote) &&
+				(this->chOPL[i].iNoteStart != 0)
+			) {
+				// Found the note, switch it off
+				//logerror("CMF: Noteoff on note %d, chan %d\n", iNote, iChannel);
+				// Make sure the release is at the bent pitch
+				if (this->iPendingBend & (1 << i)) this->writePitchbend(i);
+				this->chOPL[i].iNoteStart = 0;
+				iOPLChannel = i;
+				break;
+			}
+		}
+
+		if (iOPLChannel == -1) {
+			//logerror("CMF: Tried to switch off note %d on chan %d but couldn't find it!\n", iNote, iChannel);
+			/*for (int i = 0; i < iNumChannels; i++) {
+				logerror("CMF: Notelist: OPLCH %d: Note %d, MIDICH %d\n", i, this->chOPL[i].iMIDINote, this->chOPL[i].iMIDIChannel);
+			}*/
+			return;
+		}
+
+		this->setReg(BASE_KEYON_FREQ + iOPLChannel, this->iCurrentRegs[BASE_KEYON_FREQ + iOPLChannel] & ~OPLBIT_KEYON);
+	}
+	return;
+}
+
+template <class Policy>
+void basic_player<Policy>::MIDIchangeInstrument(uint8_t iOPLChannel, uint8_t iMIDIChannel, uint8_t iNewInstrument)
+{
+	this->iInstrumentChanges++;
+	this->log << "OPL channel " << (int)(iOPLChannel + 1) << "-1 (MIDI channel "
+		<< (int)iMIDIChannel << ") -> MIDI instrument " << (int)iNewInstrument
+		<< std::endl;
+	if (this->isPercussion(iMIDIChannel)) {
+		switch (iMIDIChannel) {
+			case 11: // Bass drum (operator 13+16 == channel 7 modulator+carrier)
+				writeInstrumentSettings(7-1, 0, 0, iNewInstrument);
+				writeInstrumentSettings(7-1, 1, 1, iNewInstrument);
+				break;
+			case 12: // Snare drum (operator 17 == channel 8 carrier)
+			//case 15:
+				writeInstrumentSettings(8-1, 0, 1, iNewInstrument);
+
+				//
+				//writeInstrumentSettings(8-1, 0, 0, iNewInstrument);
+				break;
+			case 13: // Tom tom (operator 15 == channel 9 modulator)
+			//case 14:
+				writeInstrumentSettings(9-1, 0, 0, iNewInstrument);
+
+				//
+				//writeInstrumentSettings(9-1, 0, 1, iNewInstrument);
+				break;
+			case 14: // Top cymbal (operator 18 == channel 9 carrier)
+				writeInstrumentSettings(9-1, 0, 1, iNewInstrument);
+				break;
+			case 15: // Hi-hat (operator 14 == channel 8 modulator)
+				writeInstrumentSettings(8-1, 0, 0, iNewInstrument);
+				break;
+			default:
+				this->log << "Invalid MIDI channel " << (int)(iMIDIChannel + 1) << " (not melodic and not percussive!)" << std::endl;
+				break;
+		}
+		this->chOPL[iOPLChannel].iMIDIPatch = iNewInstrument;
+	} else {
+		// Standard nine OPL channels
+		writeInstrumentSettings(iOPLChannel, 0, 0, iNewInstrument);
+		writeInstrumentSettings(iOPLChannel, 1, 1, iNewInstrument);
+		this->chOPL[iOPLChannel].iMIDIPatch = iNewInstrument;
+	}
+	return;
+}
+
+template <class Policy>
+void basic_player<Policy>::MIDIcontroller(uint8_t iChannel, uint8_t iController, uint8_t iValue)
+{
+	switch (iController) {
+		case 0x63:
+			// Custom extension to allow CMF files to switch the AM+VIB depth on and
+			// off (officially both are on, and there's no way to switch them off.)
+			// Controller values:
+			//   0 == AM+VIB off
+			//   1 == VIB on
+			//   2 == AM on
+			//   3 == AM+VIB on
+			if (iValue) {
+				this->setReg(BASE_RHYTHM, (this->iCurrentRegs[BASE_RHYTHM] & ~0xC0) | (iValue << 6)); // switch AM+VIB extension on
+			} else {
+				this->setReg(BASE_RHYTHM, this->iCurrentRegs[BASE_RHYTHM] & ~0xC0); // switch AM+VIB extension off
+			}
+			this->log << "CMF: AM+VIB depth change - AM "
+				<< ((this->iCurrentRegs[BASE_RHYTHM] & 0x80) ? "on" : "off")
+				<< ", VIB " << ((this->iCurrentRegs[BASE_RHYTHM] & 0x40) ? "on" : "off")
+				<< std::endl;
+			break;
+		case 0x66:
+			this->log << "Song set marker to 0x" << std::hex << (int)iValue << std::endl;
+			break;
+		case 0x67:
+			if (!Policy::percussion::bEnabled) {
+				this->log << "Ignoring request for percussive/rhythm mode" << std::endl;
+				break;
+			}
+			this->bPercussive = (iValue != 0);
+			if (this->bPercussive) {
+				this->setReg(BASE_RHYTHM, this->iCurrentRegs[BASE_RHYTHM] | 0x20); // switch rhythm-mode on
+			} else {
+				this->setReg(BASE_RHYTHM, this->iCurrentRegs[BASE_RHYTHM] & ~0x20); // switch rhythm-mode off
+			}
+			this->log << "Percussive/rhythm mode " << (this->bPercussive ? "enabled" : "disabled") << std::endl;
+			break;
+		case 0x68:
+			// TODO: Shouldn't this just affect the one channel, not the whole song?  -- have pitchbends for that
+//						this->dbAFreq += pow(2, (iValue/128.0)/12.0);// * (double)iValue;// / 128;
+			//this->dbAFreq = 440.0 + pow(2, 1/12.0) * (double)iValue / 128.0;
+			this->iTranspose = iValue;
+			this->log << "Transposing all notes up by " << (int)iValue << " * 1/128ths of a semitone" << std::endl;
+			break;
+		case 0x69:
+//						this->dbAFreq -= pow(2, (iValue/128.0)/12.0);// * (double)iValue;// / 128;
+//						this->dbAFreq -= pow(2, 1/12.0) * (double)iValue;// / 128.0;
+			//this->dbAFreq = 440.0 - pow(2, 1/12.0) * (double)iValue / 128.0;
+			this->iTranspose = -iValue;
+			this->log << "Transposing all notes down by " << (int)iValue << " * 1/128ths of a semitone" << std::endl;
+			break;
+		default:
+			this->log << "Unsupported MIDI controller 0x" << std::hex << (int)iController << ", ignoring" << std::endl;;
+			break;
+	}
+	return;
+}
+
+} // namespace cmf
+
+#endif // CMF_IMPL_HPP_
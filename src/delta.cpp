@@ -0,0 +1,308 @@
+/*
+ * CMF2IMF - convert CMF files into id Software IMF files
+ * Copyright (C) 2010 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <string.h>
+
+#include "delta.hpp"
+#include "opl.hpp"
+
+namespace delta {
+
+#define TAG_DELAY         0x80
+#define TAG_VALUE_BYTE    0x00
+#define TAG_VALUE_KEYFLIP 0x20
+#define TAG_VALUE_LAST    0x40
+#define TAG_VALUE_SAME    0x60
+#define TAG_VALUE_MASK    0x60
+#define TAG_REGISTER_MASK 0x1F
+
+#define REG_PARTNER  8  // First code for the other operator's registers
+#define REG_LAST     13
+#define REG_BYTE     31
+
+/// Registers for codes 0-7 (and 8-12 with the other operator)
+static const uint8_t cClassBase[8] = {
+	BASE_CHAR_MULT, BASE_SCAL_LEVL, BASE_ATCK_DCAY, BASE_SUST_RLSE, BASE_WAVE,
+	BASE_FNUM_L, BASE_KEYON_FREQ, BASE_FEED_CONN
+};
+
+/// Length of the header at the start of the file
+#define FILE_HEADER_LEN 9
+
+/// Length of the header at the start of each block
+#define BLOCK_HEADER_LEN 6
+
+static void resetContext(CONTEXT& c)
+{
+	memset(&c, 0, sizeof(c));
+	return;
+}
+
+/// The other operator in the same channel as iOperator.
+static inline uint8_t partner(uint8_t iOperator)
+{
+	return (iOperator % 8 < 3) ? iOperator + 3 : iOperator - 3;
+}
+
+/// Register selected by a code in the tag byte (not REG_LAST or REG_BYTE.)
+static inline uint8_t codeRegister(const CONTEXT& c, unsigned int iCode)
+{
+	if (iCode < 5) return cClassBase[iCode] + c.iOperator;
+	if (iCode < REG_PARTNER) return cClassBase[iCode] + c.iChannel;
+	return cClassBase[iCode - REG_PARTNER] + partner(c.iOperator);
+}
+
+/// Bring the context up to date after a register write.
+static inline void update(CONTEXT& c, uint8_t iRegister, uint8_t iValue)
+{
+	if ((iRegister >= BASE_CHAR_MULT) && ((iRegister < BASE_FNUM_L) || (iRegister >= BASE_WAVE))) {
+		uint8_t iOffset = iRegister & 0x1F;
+		if ((iOffset % 8 < 6) && (iOffset < 22)) {
+			c.iOperator = iOffset;
+			c.iChannel = (iOffset / 8) * 3 + (iOffset % 8) % 3;
+		}
+	} else if ((iRegister >= BASE_FNUM_L) && (iRegister <= BASE_FEED_CONN + 8)
+		&& ((iRegister & 0x0F) < 9)
+	) {
+		c.iChannel = iRegister & 0x0F;
+		c.iOperator = (c.iChannel / 3) * 8 + c.iChannel % 3;
+	}
+	c.iRegs[iRegister] = iValue;
+	c.iLastRegister = iRegister;
+	c.iLastValue = iValue;
+	return;
+}
+
+static inline void putU16(std::string& out, uint16_t i)
+{
+	out += (char)(i & 0xFF);
+	out += (char)(i >> 8);
+	return;
+}
+
+static inline void putU32(std::string& out, uint32_t i)
+{
+	putU16(out, i & 0xFFFF);
+	putU16(out, i >> 16);
+	return;
+}
+
+static inline uint32_t getU32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/// Encode one record.
+static void putRecord(std::string& out, CONTEXT& c, const imf::RECORD& r)
+{
+	uint8_t iTag = r.iDelay ? TAG_DELAY : 0;
+
+	unsigned int iCode = REG_BYTE;
+	if (r.iRegister == c.iLastRegister) {
+		iCode = REG_LAST;
+	} else {
+		for (unsigned int i = 0; i < REG_LAST; i++) {
+			if (codeRegister(c, i) == r.iRegister) {
+				iCode = i;
+				break;
+			}
+		}
+	}
+	iTag |= iCode;
+
+	uint8_t iPrev = c.iRegs[r.iRegister];
+	if (r.iValue == (iPrev ^ OPLBIT_KEYON)) iTag |= TAG_VALUE_KEYFLIP;
+	else if (r.iValue == c.iLastValue) iTag |= TAG_VALUE_LAST;
+	else if (r.iValue == iPrev) iTag |= TAG_VALUE_SAME;
+
+	out += (char)iTag;
+	if (iCode == REG_BYTE) out += (char)r.iRegister;
+	if ((iTag & TAG_VALUE_MASK) == TAG_VALUE_BYTE) out += (char)r.iValue;
+	for (uint16_t iDelay = r.iDelay; iDelay; iDelay >>= 7) {
+		out += (char)((iDelay & 0x7F) | ((iDelay > 0x7F) ? 0x80 : 0));
+	}
+	update(c, r.iRegister, r.iValue);
+	return;
+}
+
+void compress(const imf::RECORDS& records, std::string& out)
+	throw ()
+{
+	out.assign(DELTA_MAGIC);
+	out += (char)DELTA_VERSION;
+	putU32(out, records.size());
+
+	CONTEXT c;
+	for (size_t iStart = 0; iStart < records.size(); iStart += DELTA_BLOCK_RECORDS) {
+		size_t iEnd = iStart + DELTA_BLOCK_RECORDS;
+		if (iEnd > records.size()) iEnd = records.size();
+
+		// Leave room for the header and fill it in once the length is known
+		size_t iHeader = out.length();
+		out.append(BLOCK_HEADER_LEN, '\0');
+		resetContext(c);
+		for (size_t i = iStart; i < iEnd; i++) putRecord(out, c, records[i]);
+
+		std::string strHeader;
+		putU16(strHeader, iEnd - iStart);
+		putU32(strHeader, out.length() - iHeader - BLOCK_HEADER_LEN);
+		out.replace(iHeader, BLOCK_HEADER_LEN, strHeader);
+	}
+	return;
+}
+
+bool isDelta(const char *pData, size_t iLength)
+	throw ()
+{
+	return (iLength >= FILE_HEADER_LEN) && (memcmp(pData, DELTA_MAGIC, 4) == 0);
+}
+
+decoder::decoder(const char *pData, size_t iLength)
+	throw (std::ios::failure) :
+	pData((const uint8_t *)pData),
+	pEnd((const uint8_t *)pData + iLength),
+	iBlockLeft(0)
+{
+	if (!isDelta(pData, iLength)) throw std::ios::failure("Not a delta-compressed file");
+	if (this->pData[4] != DELTA_VERSION) {
+		throw std::ios::failure("Unsupported delta-compressed file version");
+	}
+	this->iRecords = getU32(this->pData + 5);
+	this->pBlocks = this->pData + FILE_HEADER_LEN;
+	this->pNext = this->pBlockEnd = this->pBlocks;
+	resetContext(this->context);
+}
+
+uint32_t decoder::size() const
+	throw ()
+{
+	return this->iRecords;
+}
+
+void decoder::startBlock()
+	throw (std::ios::failure)
+{
+	if (this->pEnd - this->pNext < BLOCK_HEADER_LEN) {
+		throw std::ios::failure("Delta-compressed file is damaged");
+	}
+	this->iBlockLeft = this->pNext[0] | (this->pNext[1] << 8);
+	uint32_t iLength = getU32(this->pNext + 2);
+	this->pNext += BLOCK_HEADER_LEN;
+	if ((uint32_t)(this->pEnd - this->pNext) < iLength) {
+		throw std::ios::failure("Delta-compressed file is damaged");
+	}
+	this->pBlockEnd = this->pNext + iLength;
+	resetContext(this->context);
+	return;
+}
+
+bool decoder::next(imf::RECORD& r)
+	throw (std::ios::failure)
+{
+	while (!this->iBlockLeft) {
+		if (this->pNext != this->pBlockEnd) {
+			throw std::ios::failure("Delta-compressed file is damaged");
+		}
+		if (this->pNext == this->pEnd) return false;
+		this->startBlock();
+	}
+
+	CONTEXT& c = this->context;
+	const uint8_t *p = this->pNext;
+	const uint8_t *pLimit = this->pBlockEnd;
+	if (p == pLimit) throw std::ios::failure("Delta-compressed file is damaged");
+	uint8_t iTag = *p++;
+
+	uint8_t iRegister;
+	unsigned int iCode = iTag & TAG_REGISTER_MASK;
+	if (iCode == REG_BYTE) {
+		if (p == pLimit) throw std::ios::failure("Delta-compressed file is damaged");
+		iRegister = *p++;
+	} else if (iCode == REG_LAST) {
+		iRegister = c.iLastRegister;
+	} else if (iCode < REG_LAST) {
+		iRegister = codeRegister(c, iCode);
+	} else {
+		throw std::ios::failure("Delta-compressed file is damaged");
+	}
+
+	uint8_t iValue;
+	switch (iTag & TAG_VALUE_MASK) {
+		case TAG_VALUE_KEYFLIP: iValue = c.iRegs[iRegister] ^ OPLBIT_KEYON; break;
+		case TAG_VALUE_LAST:    iValue = c.iLastValue; break;
+		case TAG_VALUE_SAME:    iValue = c.iRegs[iRegister]; break;
+		default:
+			if (p == pLimit) throw std::ios::failure("Delta-compressed file is damaged");
+			iValue = *p++;
+			break;
+	}
+
+	uint32_t iDelay = 0;
+	if (iTag & TAG_DELAY) {
+		for (int iShift = 0; ; iShift += 7) {
+			if ((p == pLimit) || (iShift > 14)) {
+				throw std::ios::failure("Delta-compressed file is damaged");
+			}
+			uint8_t b = *p++;
+			iDelay |= (uint32_t)(b & 0x7F) << iShift;
+			if (!(b & 0x80)) break;
+		}
+		if (iDelay > 0xFFFF) throw std::ios::failure("Delta-compressed file is damaged");
+	}
+
+	update(c, iRegister, iValue);
+	this->pNext = p;
+	this->iBlockLeft--;
+	r.iRegister = iRegister;
+	r.iValue = iValue;
+	r.iDelay = iDelay;
+	return true;
+}
+
+void decoder::seekBlock(unsigned int iBlock)
+	throw (std::ios::failure)
+{
+	// Each block header gives the length, so the blocks can be skipped
+	// without decoding them
+	this->pNext = this->pBlocks;
+	for (unsigned int i = 0; i < iBlock; i++) {
+		if (this->pNext == this->pEnd) throw std::ios::failure("No such block");
+		this->startBlock();
+		this->pNext = this->pBlockEnd;
+	}
+	this->pBlockEnd = this->pNext;
+	this->iBlockLeft = 0;
+	return;
+}
+
+void decompress(const char *pData, size_t iLength, imf::RECORDS& records)
+	throw (std::ios::failure)
+{
+	decoder d(pData, iLength);
+	records.clear();
+	// The count could be anything if the file is damaged, so don't trust it
+	// too far
+	records.reserve(std::min<uint32_t>(d.size(), 0x100000));
+	imf::RECORD r;
+	while (d.next(r)) records.push_back(r);
+	if (records.size() != d.size()) throw std::ios::failure("Delta-compressed file is damaged");
+	return;
+}
+
+} // namespace delta
@@ -0,0 +1,147 @@
+/*
+ * CMF2IMF - convert CMF files into id Software IMF files
+ * Copyright (C) 2010 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * A compact alternative to IMF files, storing most register writes in one
+ * or two bytes.
+ */
+
+#ifndef DELTA_HPP_
+#define DELTA_HPP_
+
+#include <iostream>
+#include <string>
+#include <stdint.h>
+
+#include "imf.hpp"
+
+namespace delta {
+
+/// Start of a delta-compressed file
+#define DELTA_MAGIC "IMFD"
+
+/// Format version written after DELTA_MAGIC
+#define DELTA_VERSION 1
+
+/// Number of records in each block (except the last)
+#define DELTA_BLOCK_RECORDS 4096
+
+/// Store a song in the delta-compressed format.
+/**
+ * The file starts with DELTA_MAGIC, the uint8 version and the uint32le
+ * number of records.  The records are split into blocks, each starting with
+ * the uint16le number of records and the uint32le number of bytes that
+ * follow.  Every block starts from scratch, so it can be decoded without
+ * the ones before it.
+ *
+ * Each record starts with a tag byte:
+ *
+ *  - Bit 7: a delay follows the record (7 bits per byte, low bits first, top
+ *    bit set on all but the last byte.)  Otherwise the delay is zero.
+ *  - Bits 6-5: the value.  0: a value byte follows.  1: the register's
+ *    previous value with the key-on bit (0x20) flipped.  2: the same value
+ *    as the last record.  3: the register's previous value.
+ *  - Bits 4-0: the register.  0-7: the current operator's 0x20, 0x40, 0x60,
+ *    0x80 or 0xE0 register, or the current channel's 0xA0, 0xB0 or 0xC0
+ *    register.  8-12: the 0x20-0xE0 registers of the other operator in the
+ *    current channel.  13: the same register as the last record.  31: a
+ *    register byte follows (before any value byte.)
+ *
+ * The current operator and channel are the ones the last record wrote to.
+ * Writing to a channel register makes its first operator the current one.
+ * "Previous values" start at zero in each block.
+ *
+ * @param records Song to store.
+ * @param out Set to the delta-compressed file.
+ */
+void compress(const imf::RECORDS& records, std::string& out)
+	throw ();
+
+/// Is this a delta-compressed file?
+bool isDelta(const char *pData, size_t iLength)
+	throw ();
+
+/// What the encoding of each record depends on.  Reset at the start of
+/// every block.
+typedef struct {
+	uint8_t iRegs[256];     ///< Last value written to each register
+	uint8_t iLastRegister;
+	uint8_t iLastValue;
+	uint8_t iOperator;      ///< Current operator offset (0-21)
+	uint8_t iChannel;       ///< Current channel (0-8)
+} CONTEXT;
+
+/// Reads records out of a delta-compressed file one at a time.
+/**
+ * Nothing is allocated while decoding (unless the data is damaged, in which
+ * case an exception is thrown), so it is safe to use on an audio thread.
+ */
+class decoder {
+	private:
+		const uint8_t *pData;
+		const uint8_t *pEnd;
+		const uint8_t *pBlocks;     // First block
+		const uint8_t *pNext;       // Next byte to decode
+		const uint8_t *pBlockEnd;   // End of the current block
+		uint32_t iRecords;          // Records in the whole file
+		unsigned int iBlockLeft;    // Records left in the current block
+		CONTEXT context;
+
+	public:
+		/// Start decoding a file.
+		/**
+		 * @param pData Delta-compressed file.  Must remain valid while the
+		 *   decoder is in use.
+		 * @param iLength Length of pData.
+		 * @throw std::ios::failure if the file isn't delta-compressed.
+		 */
+		decoder(const char *pData, size_t iLength)
+			throw (std::ios::failure);
+
+		/// Number of records in the whole file.
+		uint32_t size() const
+			throw ();
+
+		/// Get the next record.
+		/**
+		 * @return false at the end of the file, leaving r unchanged.
+		 * @throw std::ios::failure if the data is damaged.
+		 */
+		bool next(imf::RECORD& r)
+			throw (std::ios::failure);
+
+		/// Carry on from the start of a block.
+		/**
+		 * @param iBlock Block number.  Records iBlock * DELTA_BLOCK_RECORDS
+		 *   onwards come next.
+		 * @throw std::ios::failure if there is no such block.
+		 */
+		void seekBlock(unsigned int iBlock)
+			throw (std::ios::failure);
+
+	private:
+		/// Start decoding the block at pNext.
+		void startBlock()
+			throw (std::ios::failure);
+};
+
+/// Decode a whole delta-compressed file.
+void decompress(const char *pData, size_t iLength, imf::RECORDS& records)
+	throw (std::ios::failure);
+
+} // namespace delta
+
+#endif // DELTA_HPP_
@@ -0,0 +1,662 @@
+/*
+ * CMF2IMF - convert CMF files into id Software IMF files
+ * Copyright (C) 2010 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <sstream>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "engine.hpp"
+#include "opl.hpp"
+
+namespace cmf {
+
+/// Default instruments, used for any the CMF file doesn't define itself
+extern const char cDefaultPatches[];
+
+static uint16_t readU16LE(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+tune::tune(const char *pData, size_t iLength)
+	throw (std::ios::failure)
+{
+	const uint8_t *p = (const uint8_t *)pData;
+	if ((iLength < 0x24) || (memcmp(pData, "CTMF", 4) != 0)) {
+		throw std::ios::failure("Input file is not a CMF file! (CTMF header missing)");
+	}
+	uint16_t iVer = readU16LE(p + 4);
+	if ((iVer != 0x0101) && (iVer != 0x0100)) {
+		throw std::ios::failure("CMF file is not v1.0 or v1.1");
+	}
+	this->cmfHeader.iInstrumentBlockOffset = readU16LE(p + 6);
+	this->cmfHeader.iMusicOffset = readU16LE(p + 8);
+	this->cmfHeader.iTicksPerQuarterNote = readU16LE(p + 10);
+	this->cmfHeader.iTicksPerSecond = readU16LE(p + 12);
+	this->cmfHeader.iTagOffsetTitle = readU16LE(p + 14);
+	this->cmfHeader.iTagOffsetComposer = readU16LE(p + 16);
+	this->cmfHeader.iTagOffsetRemarks = readU16LE(p + 18);
+	memcpy(this->cmfHeader.iChannelsInUse, p + 20, 16);
+	if (iVer == 0x0100) {
+		this->cmfHeader.iNumInstruments = p[36];
+		this->cmfHeader.iTempo = 0;
+	} else {
+		if (iLength < 40) throw std::ios::failure("CMF file is truncated");
+		this->cmfHeader.iNumInstruments = readU16LE(p + 36);
+		this->cmfHeader.iTempo = readU16LE(p + 38);
+	}
+	if (this->cmfHeader.iTicksPerSecond == 0) {
+		throw std::ios::failure("CMF file has an invalid tempo");
+	}
+	if (this->cmfHeader.iNumInstruments > 128) this->cmfHeader.iNumInstruments = 128;
+	if (this->cmfHeader.iInstrumentBlockOffset + this->cmfHeader.iNumInstruments * 16UL > iLength) {
+		throw std::ios::failure("CMF file is truncated");
+	}
+	if (this->cmfHeader.iMusicOffset > iLength) {
+		throw std::ios::failure("CMF file is truncated");
+	}
+
+	for (int i = 0; i < 128; i++) {
+		const uint8_t *pInst;
+		if (i < this->cmfHeader.iNumInstruments) {
+			pInst = p + this->cmfHeader.iInstrumentBlockOffset + i * 16;
+		} else {
+			pInst = (const uint8_t *)cDefaultPatches + (i % 16) * 11;
+		}
+		SBI& inst = this->instruments[i];
+		inst.op[0].iCharMult = pInst[0];
+		inst.op[1].iCharMult = pInst[1];
+		inst.op[0].iScalingOutput = pInst[2];
+		inst.op[1].iScalingOutput = pInst[3];
+		inst.op[0].iAttackDecay = pInst[4];
+		inst.op[1].iAttackDecay = pInst[5];
+		inst.op[0].iSustainRelease = pInst[6];
+		inst.op[1].iSustainRelease = pInst[7];
+		inst.op[0].iWaveSel = pInst[8];
+		inst.op[1].iWaveSel = pInst[9];
+		inst.iConnection = pInst[10];
+	}
+	this->pMusic = p + this->cmfHeader.iMusicOffset;
+	this->pEnd = p + iLength;
+}
+
+engine::engine(int iSpeed)
+	throw () :
+	iSpeed(iSpeed),
+	iMaxDelay(0x7FFFFFFF / iSpeed),
+	iCurrentSong(0)
+{
+	// Work out the frequency of every note once, so only pitchbent notes need
+	// the full calculation (same as basic_player::getFNum())
+	for (int i = 0; i < 128; i++) {
+		uint8_t iBlock = i / 12;
+		if (iBlock > 1) iBlock--;
+		double d = pow(2, ((double)i - 9) / 12.0 - (iBlock - 20)) * 440.0 / 32.0 / 50000.0;
+		this->iFNum[i] = (uint16_t)(d+0.5);
+		this->iBlock[i] = iBlock;
+	}
+}
+
+uint16_t engine::start(const tune& t)
+	throw (std::ios::failure)
+{
+	uint16_t iSong;
+	if (!this->freeSlots.empty()) {
+		iSong = this->freeSlots.back();
+		this->freeSlots.pop_back();
+	} else {
+		if (this->songs.size() > 0xFFFF) throw std::ios::failure("Too many songs playing");
+		iSong = this->songs.size();
+		this->songs.push_back(ENGINESONG());
+	}
+
+	ENGINESONG& s = this->songs[iSong];
+	memset(&s, 0, sizeof(s));
+	s.pTune = &t;
+	s.iFlags = ENGINE_STARTING;
+	for (int i = 0; i < 16; i++) s.iMIDIBend[i] = 8192;
+	memset(s.iOPLPatch, 0xFF, sizeof(s.iOPLPatch));
+	return iSong;
+}
+
+void engine::stop(uint16_t iSong)
+	throw ()
+{
+	if ((iSong >= this->songs.size()) || (!this->songs[iSong].pTune)) return;
+	this->songs[iSong].pTune = NULL;
+	this->freeSlots.push_back(iSong);
+	return;
+}
+
+bool engine::finished(uint16_t iSong) const
+	throw ()
+{
+	if (iSong >= this->songs.size()) return true;
+	return (this->songs[iSong].iFlags & ENGINE_FINISHED) != 0;
+}
+
+const std::vector<ENGINEWRITE>& engine::step()
+	throw ()
+{
+	this->writes.clear();
+	for (size_t i = 0; i < this->songs.size(); i++) {
+		ENGINESONG& s = this->songs[i];
+		if ((!s.pTune) || (s.iFlags & ENGINE_FINISHED)) continue;
+		this->iCurrentSong = i;
+		if (s.iFlags & ENGINE_STARTING) this->init(s);
+
+		// Play every event up to the end of this tick
+		while (s.iWait <= 0) {
+			if (!this->event(s)) {
+				this->flushPitchbends(s);
+				s.iFlags |= ENGINE_FINISHED;
+				break;
+			}
+			uint32_t iDelay = this->readNumber(s);
+			if (iDelay) {
+				// Any pitchbends since the last delay happen now, before time moves on
+				this->flushPitchbends(s);
+				if (iDelay > this->iMaxDelay) iDelay = this->iMaxDelay;
+				s.iWait += iDelay * this->iSpeed;
+			}
+		}
+		s.iWait -= s.pTune->cmfHeader.iTicksPerSecond;
+	}
+	return this->writes;
+}
+
+inline void engine::setReg(ENGINESONG& s, uint8_t iRegister, uint8_t iValue)
+	throw ()
+{
+	ENGINEWRITE w = {this->iCurrentSong, iRegister, iValue};
+	this->writes.push_back(w);
+
+	// Only keep the registers that are read back
+	if ((iRegister >= BASE_SCAL_LEVL) && (iRegister < BASE_SCAL_LEVL + 22)) {
+		s.iRegLevel[iRegister - BASE_SCAL_LEVL] = iValue;
+	} else if ((iRegister >= BASE_FNUM_L) && (iRegister <= BASE_FNUM_L + 8)) {
+		s.iRegFNum[iRegister - BASE_FNUM_L] = iValue;
+	} else if ((iRegister >= BASE_KEYON_FREQ) && (iRegister <= BASE_KEYON_FREQ + 8)) {
+		s.iRegKeyOn[iRegister - BASE_KEYON_FREQ] = iValue;
+	} else if (iRegister == BASE_RHYTHM) {
+		s.iRegRhythm = iValue;
+	}
+	return;
+}
+
+void engine::init(ENGINESONG& s)
+	throw ()
+{
+	const CMFHEADER& header = s.pTune->cmfHeader;
+	if (header.iNumInstruments >= 5) {
+		// Set the last five instruments to the percussive ones
+		s.iFlags |= ENGINE_PERCUSSIVE;
+		for (int i = header.iNumInstruments - 5, j = 11; j < 16; i++, j++) {
+			s.iMIDIPatch[j] = i;
+			this->changeInstrument(s, percussion_creative::channel(j), j, i);
+		}
+		s.iFlags &= ~ENGINE_PERCUSSIVE;
+	}
+	for (unsigned int i = 0; i < setup_creative::iNumRegs; i++) {
+		this->setReg(s, setup_creative::cRegs[i][0], setup_creative::cRegs[i][1]);
+	}
+	s.iFlags &= ~ENGINE_STARTING;
+
+	uint32_t iDelay = this->readNumber(s);
+	if (iDelay > this->iMaxDelay) iDelay = this->iMaxDelay;
+	s.iWait = iDelay * this->iSpeed;
+	return;
+}
+
+uint32_t engine::readNumber(ENGINESONG& s)
+	throw ()
+{
+	const uint8_t *p = s.pTune->pMusic + s.iPos;
+	uint32_t iValue = 0;
+	for (int i = 0; (i < 4) && (p < s.pTune->pEnd); i++) {
+		uint8_t iNext = *p++;
+		iValue = (iValue << 7) | (iNext & 0x7F);
+		if ((iNext & 0x80) == 0) break;
+	}
+	s.iPos = p - s.pTune->pMusic;
+	return iValue;
+}
+
+bool engine::event(ENGINESONG& s)
+	throw ()
+{
+	const uint8_t *p = s.pTune->pMusic + s.iPos;
+	const uint8_t *pEnd = s.pTune->pEnd;
+	if (p >= pEnd) return false;
+
+	uint8_t iCommand = *p;
+	if (iCommand & 0x80) {
+		s.iPrevCommand = iCommand;
+		p++;
+	} else {
+		iCommand = s.iPrevCommand; // running status
+		if (!(iCommand & 0x80)) return false; // corrupt
+	}
+
+	// Number of data bytes following the command
+	int iLength;
+	switch (iCommand & 0xF0) {
+		case 0xC0:
+		case 0xD0: iLength = 1; break;
+		case 0xF0:
+			switch (iCommand) {
+				case 0xF1: case 0xF3: case 0xFF: iLength = 1; break;
+				case 0xF2: iLength = 2; break;
+				default: iLength = 0; break;
+			}
+			break;
+		default: iLength = 2; break;
+	}
+	if (pEnd - p < iLength) return false;
+	s.iPos = (p + iLength) - s.pTune->pMusic;
+
+	uint8_t iChannel = iCommand & 0x0F;
+	switch (iCommand & 0xF0) {
+		case 0x80: // Note off
+			this->noteOff(s, iChannel, p[0]);
+			break;
+		case 0x90: // Note on
+			if (p[1]) this->noteOn(s, iChannel, p[0], p[1]);
+			else this->noteOff(s, iChannel, p[0]);
+			break;
+		case 0xB0: // Controller
+			this->controller(s, p[0], p[1]);
+			break;
+		case 0xC0: // Instrument change
+			s.iMIDIPatch[iChannel] = p[0];
+			break;
+		case 0xE0: // Pitch bend
+			this->pitchbend(s, iChannel, ((p[1] & 0x7F) << 7) | (p[0] & 0x7F));
+			break;
+		case 0xF0:
+			switch (iCommand) {
+				case 0xF0: // Sysex, skip up to and including the EOX
+					while ((p < pEnd) && (!(*p++ & 0x80))) { }
+					s.iPos = p - s.pTune->pMusic;
+					break;
+				case 0xFC: // Stop
+					return false;
+				case 0xFF: // Meta event
+					if (p[0] == 0x2F) return false; // end of track
+					break;
+			}
+			break;
+	}
+	return true;
+}
+
+uint16_t engine::getFNum(const ENGINESONG& s, uint8_t iChannel, uint8_t iNote,
+	uint8_t *iBlock) const
+	throw ()
+{
+	iNote &= 0x7F;
+	*iBlock = this->iBlock[iNote];
+	if (s.iMIDIBend[iChannel] == 8192) return this->iFNum[iNote];
+
+	// Transposing (controllers 0x68 and 0x69) has no effect in basic_player
+	// (it's divided by 128 as an integer) so it isn't done here either.
+	double d = pow(2, (
+		(double)iNote + (
+			(s.iMIDIBend[iChannel] - 8192) / 8192.0
+		) - 9) / 12.0 - (*iBlock - 20))
+		* 440.0 / 32.0 / 50000.0;
+	return (uint16_t)(d+0.5);
+}
+
+void engine::writeInstrument(ENGINESONG& s, uint8_t iChannel,
+	uint8_t iOperatorSource, uint8_t iOperatorDest, uint8_t iInstrument)
+	throw ()
+{
+	const SBI& inst = s.pTune->instruments[iInstrument & 0x7F];
+	uint8_t iOPLOffset = OPLOFFSET(iChannel);
+	if (iOperatorDest) iOPLOffset += 3;
+
+	this->setReg(s, BASE_CHAR_MULT + iOPLOffset, inst.op[iOperatorSource].iCharMult);
+	this->setReg(s, BASE_SCAL_LEVL + iOPLOffset, inst.op[iOperatorSource].iScalingOutput);
+	this->setReg(s, BASE_ATCK_DCAY + iOPLOffset, inst.op[iOperatorSource].iAttackDecay);
+	this->setReg(s, BASE_SUST_RLSE + iOPLOffset, inst.op[iOperatorSource].iSustainRelease);
+	this->setReg(s, BASE_WAVE      + iOPLOffset, inst.op[iOperatorSource].iWaveSel);
+	this->setReg(s, BASE_FEED_CONN + iChannel, inst.iConnection);
+	return;
+}
+
+void engine::changeInstrument(ENGINESONG& s, uint8_t iOPLChannel,
+	uint8_t iMIDIChannel, uint8_t iNewInstrument)
+	throw ()
+{
+	if ((iMIDIChannel > 10) && (s.iFlags & ENGINE_PERCUSSIVE)) {
+		switch (iMIDIChannel) {
+			case 11: // Bass drum
+				this->writeInstrument(s, 7-1, 0, 0, iNewInstrument);
+				this->writeInstrument(s, 7-1, 1, 1, iNewInstrument);
+				break;
+			case 12: // Snare drum
+				this->writeInstrument(s, 8-1, 0, 1, iNewInstrument);
+				break;
+			case 13: // Tom tom
+				this->writeInstrument(s, 9-1, 0, 0, iNewInstrument);
+				break;
+			case 14: // Top cymbal
+				this->writeInstrument(s, 9-1, 0, 1, iNewInstrument);
+				break;
+			case 15: // Hi-hat
+				this->writeInstrument(s, 8-1, 0, 0, iNewInstrument);
+				break;
+		}
+	} else {
+		this->writeInstrument(s, iOPLChannel, 0, 0, iNewInstrument);
+		this->writeInstrument(s, iOPLChannel, 1, 1, iNewInstrument);
+	}
+	s.iOPLPatch[iOPLChannel] = iNewInstrument;
+	return;
+}
+
+uint16_t engine::nextNote(ENGINESONG& s)
+	throw ()
+{
+	if (s.iNoteCount == 0xFFFF) {
+		// The counter is about to wrap, so renumber the notes still playing,
+		// keeping them in the same order.
+		uint32_t iOrder[9];
+		int iPlaying = 0;
+		for (int i = 0; i < 9; i++) {
+			if (s.iNoteStart[i]) iOrder[iPlaying++] = (s.iNoteStart[i] << 8) | i;
+		}
+		for (int i = 1; i < iPlaying; i++) {
+			for (int j = i; (j > 0) && (iOrder[j - 1] > iOrder[j]); j--) {
+				std::swap(iOrder[j - 1], iOrder[j]);
+			}
+		}
+		for (int i = 0; i < iPlaying; i++) s.iNoteStart[iOrder[i] & 0xFF] = i + 1;
+		s.iNoteCount = iPlaying;
+	}
+	return ++s.iNoteCount;
+}
+
+void engine::noteOn(ENGINESONG& s, uint8_t iChannel, uint8_t iNote, uint8_t iVelocity)
+	throw ()
+{
+	uint8_t iBlock;
+	uint16_t iOPLFNum = this->getFNum(s, iChannel, iNote, &iBlock);
+
+	if ((iChannel > 10) && (s.iFlags & ENGINE_PERCUSSIVE)) {
+		uint8_t iPercChannel = percussion_creative::channel(iChannel);
+		this->changeInstrument(s, iPercChannel, iChannel, s.iMIDIPatch[iChannel]);
+
+		// Set the volume from the note velocity (only the bass drum carrier)
+		uint8_t iLevel = velocity_creative::percLevel(iVelocity);
+		int iOffset = OPLOFFSET(iPercChannel);
+		if (iChannel == 11) iOffset += 3;
+		this->setReg(s, BASE_SCAL_LEVL + iOffset, (s.iRegLevel[iOffset] & ~0x3F) | iLevel);
+
+		this->setReg(s, BASE_FNUM_L + iPercChannel, iOPLFNum & 0xFF);
+		this->setReg(s, BASE_KEYON_FREQ + iPercChannel, (iBlock << 2) | ((iOPLFNum >> 8) & 0x03));
+
+		// Restart the instrument if it's already playing
+		uint8_t iBit = 1 << (15 - iChannel);
+		if (s.iRegRhythm & iBit) this->setReg(s, BASE_RHYTHM, s.iRegRhythm & ~iBit);
+		this->setReg(s, BASE_RHYTHM, s.iRegRhythm | iBit);
+
+		s.iNoteStart[iPercChannel] = this->nextNote(s);
+		s.iNoteChannel[iPercChannel] = iChannel;
+		s.iNote[iPercChannel] = iNote;
+		return;
+	}
+
+	// Use a free channel, preferably one that already has the right instrument
+	int iOPLChannel = -1;
+	int iNumChannels = (s.iFlags & ENGINE_PERCUSSIVE) ? 6 : 9;
+	for (int i = iNumChannels - 1; i >= 0; i--) {
+		if (s.iNoteStart[i] == 0) {
+			iOPLChannel = i;
+			if (s.iOPLPatch[i] == s.iMIDIPatch[iChannel]) break;
+		}
+	}
+	if (iOPLChannel == -1) {
+		// All channels were in use, cut the longest note
+		iOPLChannel = 0;
+		for (int i = 1; i < iNumChannels; i++) {
+			if (s.iNoteStart[i] < s.iNoteStart[iOPLChannel]) iOPLChannel = i;
+		}
+	}
+	if (s.iOPLPatch[iOPLChannel] != s.iMIDIPatch[iChannel]) {
+		this->changeInstrument(s, iOPLChannel, iChannel, s.iMIDIPatch[iChannel]);
+	}
+	s.iNoteStart[iOPLChannel] = this->nextNote(s);
+	s.iNoteChannel[iOPLChannel] = iChannel;
+	s.iNote[iOPLChannel] = iNote;
+	s.iPendingBend &= ~(1 << iOPLChannel);
+
+	this->setReg(s, BASE_FNUM_L + iOPLChannel, iOPLFNum & 0xFF);
+	this->setReg(s, BASE_KEYON_FREQ + iOPLChannel,
+		OPLBIT_KEYON | (iBlock << 2) | ((iOPLFNum & 0x300) >> 8));
+	return;
+}
+
+void engine::noteOff(ENGINESONG& s, uint8_t iChannel, uint8_t iNote)
+	throw ()
+{
+	if ((iChannel > 10) && (s.iFlags & ENGINE_PERCUSSIVE)) {
+		uint8_t iPercChannel = percussion_creative::channel(iChannel);
+		if (s.iNote[iPercChannel] != iNote) return; // a different note is playing now
+		this->setReg(s, BASE_RHYTHM, s.iRegRhythm & ~(1 << (15 - iChannel)));
+		s.iNoteStart[iPercChannel] = 0;
+		return;
+	}
+
+	int iNumChannels = (s.iFlags & ENGINE_PERCUSSIVE) ? 6 : 9;
+	for (int i = 0; i < iNumChannels; i++) {
+		if ((s.iNoteChannel[i] == iChannel) && (s.iNote[i] == iNote) && (s.iNoteStart[i])) {
+			// Make sure the release is at the bent pitch
+			if (s.iPendingBend & (1 << i)) this->writePitchbend(s, i);
+			s.iNoteStart[i] = 0;
+			this->setReg(s, BASE_KEYON_FREQ + i, s.iRegKeyOn[i] & ~OPLBIT_KEYON);
+			return;
+		}
+	}
+	return;
+}
+
+void engine::pitchbend(ENGINESONG& s, uint8_t iChannel, uint16_t iValue)
+	throw ()
+{
+	s.iMIDIBend[iChannel] = iValue;
+	if ((iChannel > 10) && (s.iFlags & ENGINE_PERCUSSIVE)) return;
+
+	int iNumChannels = (s.iFlags & ENGINE_PERCUSSIVE) ? 6 : 9;
+	for (int i = 0; i < iNumChannels; i++) {
+		if ((s.iNoteChannel[i] == iChannel) && (s.iNoteStart[i])) {
+			s.iPendingBend |= 1 << i;
+		}
+	}
+	return;
+}
+
+void engine::writePitchbend(ENGINESONG& s, int iOPLChannel)
+	throw ()
+{
+	s.iPendingBend &= ~(1 << iOPLChannel);
+	if (s.iNoteStart[iOPLChannel] == 0) return; // note has finished
+
+	uint8_t iBlock;
+	uint16_t iOPLFNum = this->getFNum(s, s.iNoteChannel[iOPLChannel],
+		s.iNote[iOPLChannel], &iBlock);
+	uint8_t iFNumL = iOPLFNum & 0xFF;
+	uint8_t iKeyOnFreq = (s.iRegKeyOn[iOPLChannel] & OPLBIT_KEYON)
+		| (iBlock << 2) | ((iOPLFNum & 0x300) >> 8);
+	if (s.iRegFNum[iOPLChannel] != iFNumL) {
+		this->setReg(s, BASE_FNUM_L + iOPLChannel, iFNumL);
+	}
+	if (s.iRegKeyOn[iOPLChannel] != iKeyOnFreq) {
+		this->setReg(s, BASE_KEYON_FREQ + iOPLChannel, iKeyOnFreq);
+	}
+	return;
+}
+
+void engine::flushPitchbends(ENGINESONG& s)
+	throw ()
+{
+	if (!s.iPendingBend) return;
+	for (int i = 0; i < 9; i++) {
+		if (s.iPendingBend & (1 << i)) this->writePitchbend(s, i);
+	}
+	return;
+}
+
+void engine::controller(ENGINESONG& s, uint8_t iController, uint8_t iValue)
+	throw ()
+{
+	switch (iController) {
+		case 0x63: // AM+VIB depth (see basic_player::MIDIcontroller())
+			if (iValue) {
+				this->setReg(s, BASE_RHYTHM, (s.iRegRhythm & ~0xC0) | (iValue << 6));
+			} else {
+				this->setReg(s, BASE_RHYTHM, s.iRegRhythm & ~0xC0);
+			}
+			break;
+		case 0x67: // Rhythm mode
+			if (iValue) {
+				s.iFlags |= ENGINE_PERCUSSIVE;
+				this->setReg(s, BASE_RHYTHM, s.iRegRhythm | 0x20);
+			} else {
+				s.iFlags &= ~ENGINE_PERCUSSIVE;
+				this->setReg(s, BASE_RHYTHM, s.iRegRhythm & ~0x20);
+			}
+			break;
+	}
+	return;
+}
+
+/// Collects the register writes made by cmf::player, with the exact song
+/// time of each one.
+class playerWrites {
+	public:
+		const quiet_player *p;
+		std::vector<ENGINEWRITE> writes;
+		std::vector<uint64_t> ticks;  // Song time of each write, in CMF ticks
+
+		playerWrites()
+			throw () :
+			p(NULL)
+		{
+		}
+
+		void setRegister(uint8_t iRegister, uint8_t iValue)
+			throw ()
+		{
+			ENGINEWRITE w = {0, iRegister, iValue};
+			this->writes.push_back(w);
+			this->ticks.push_back(this->p->getSongTicks());
+			return;
+		}
+
+		void setDelay(uint16_t)
+			throw ()
+		{
+		}
+};
+
+/// Current time in seconds, from a clock that never jumps.
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void checkEngine(const char *pData, size_t iLength, int iSpeed,
+	unsigned int iSongs, ENGINECHECK& result)
+	throw (std::ios::failure)
+{
+	memset(&result, 0, sizeof(result));
+	result.iSpeed = iSpeed;
+	result.iSongs = iSongs;
+
+	// What the normal player does
+	playerWrites rec;
+	std::istringstream data(std::string(pData, iLength));
+	quiet_player p(data,
+		boost::bind(&playerWrites::setRegister, &rec, _1, _2),
+		boost::bind(&playerWrites::setDelay, &rec, _1));
+	rec.p = &p;
+	p.init();
+	while (p.tick()) { } ;
+	unsigned int iTicksPerSecond = p.getTicksPerSecond();
+	result.iWrites = rec.writes.size();
+
+	// The same song through the engine.  Events are played on the first step
+	// at or after their song time.
+	tune t(pData, iLength);
+	engine e(iSpeed);
+	uint16_t iSong = e.start(t);
+	bool bSame = true;
+	for (uint64_t iStep = 0; !e.finished(iSong); iStep++) {
+		const std::vector<ENGINEWRITE>& writes = e.step();
+		for (std::vector<ENGINEWRITE>::const_iterator i = writes.begin(); i != writes.end(); i++) {
+			unsigned long n = result.iEngineWrites++;
+			if ((!bSame) || (n >= rec.writes.size())
+				|| (i->iRegister != rec.writes[n].iRegister)
+				|| (i->iValue != rec.writes[n].iValue)
+			) {
+				bSame = false;
+				continue;
+			}
+			result.iSame++;
+			uint64_t iExact = (rec.ticks[n] * iSpeed + iTicksPerSecond - 1) / iTicksPerSecond;
+			if (iStep != iExact) result.iMistimed++;
+		}
+	}
+
+	// Time lots of copies at once
+	engine many(iSpeed);
+	for (unsigned int i = 0; i < iSongs; i++) many.start(t);
+	double dStart = now();
+	for (result.iSteps = 0; result.iSteps < (unsigned long)iSpeed * 60; result.iSteps++) {
+		many.step();
+		if (many.finished(0)) break;
+	}
+	if (result.iSteps) result.dStepUS = (now() - dStart) * 1e6 / result.iSteps;
+	return;
+}
+
+bool printEngineCheck(std::ostream& out, const ENGINECHECK& result)
+	throw ()
+{
+	bool bOK = (result.iSame == result.iWrites)
+		&& (result.iEngineWrites == result.iWrites) && (result.iMistimed == 0);
+	out << std::dec << "Engine at " << result.iSpeed << "Hz:\n"
+		<< "  Player writes:     " << result.iWrites << "\n"
+		<< "  Engine writes:     " << result.iEngineWrites << "\n"
+		<< "  Same until:        " << result.iSame << "\n"
+		<< "  Wrong tick:        " << result.iMistimed << "\n"
+		<< "  Time per step:     " << result.dStepUS << " us for " << result.iSongs
+		<< " songs (" << sizeof(ENGINESONG) << " bytes each)\n";
+	if (bOK) out << "  OK: the engine plays the song the same as the player\n";
+	else out << "  FAIL: the engine plays the song differently to the player\n";
+	out << std::flush;
+	return bOK;
+}
+
+} // namespace cmf
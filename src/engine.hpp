@@ -0,0 +1,206 @@
+/*
+ * CMF2IMF - convert CMF files into id Software IMF files
+ * Copyright (C) 2010 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Engine for playing thousands of CMF songs at the same time (e.g. one per
+ * game session on a server.)  It plays songs the same way as cmf::player
+ * with policy_creative, but the state of every song is kept small and in one
+ * array so each output tick is a single pass through memory.
+ */
+
+#ifndef ENGINE_HPP_
+#define ENGINE_HPP_
+
+#include <iostream>
+#include <vector>
+#include <stdint.h>
+
+#include "cmf.hpp"
+
+namespace cmf {
+
+/// A CMF file, read once and shared by every song playing it.
+class tune {
+	public:
+		CMFHEADER cmfHeader;
+		SBI instruments[128];   ///< Song instruments followed by the defaults
+		const uint8_t *pMusic;  ///< Start of the music data
+		const uint8_t *pEnd;    ///< End of the file
+
+		/// Read a CMF file.
+		/**
+		 * @param pData Complete CMF file.  Must remain valid while the tune is
+		 *   in use.
+		 * @param iLength Length of pData.
+		 */
+		tune(const char *pData, size_t iLength)
+			throw (std::ios::failure);
+};
+
+/// One register write made during engine::step()
+typedef struct {
+	uint16_t iSong;     // Song that made the write (as returned by engine::start())
+	uint8_t iRegister;
+	uint8_t iValue;
+} ENGINEWRITE;
+
+/// State of one song playing in an engine.  Everything is as narrow as it
+/// can be, as there may be thousands of these.
+typedef struct {
+	const tune *pTune;         // NULL if this slot is free
+	uint32_t iPos;             // Offset of the next byte in pTune->pMusic
+	int32_t iWait;             // Time until the next event, in 1/speed CMF ticks
+	uint16_t iNoteCount;       // Counter used to find the oldest note
+	uint16_t iPendingBend;     // OPL channels waiting for a pitchbend to be written
+	uint8_t iPrevCommand;      // For MIDI running status
+	uint8_t iFlags;            // ENGINE_* flags
+	uint8_t iMIDIPatch[16];
+	uint16_t iMIDIBend[16];
+	uint16_t iNoteStart[9];    // When each OPL channel's note started (0 == free)
+	uint8_t iNote[9];          // MIDI note playing on each OPL channel
+	uint8_t iNoteChannel[9];   // MIDI channel the note came from
+	uint8_t iOPLPatch[9];      // Instrument loaded in each OPL channel (0xFF == none)
+	uint8_t iRegFNum[9];       // Shadow of registers 0xA0-0xA8
+	uint8_t iRegKeyOn[9];      // Shadow of registers 0xB0-0xB8
+	uint8_t iRegLevel[22];     // Shadow of registers 0x40-0x55
+	uint8_t iRegRhythm;        // Shadow of register 0xBD
+} ENGINESONG;
+
+#define ENGINE_STARTING   0x01 // Chip setup not written yet
+#define ENGINE_PERCUSSIVE 0x02 // Rhythm mode is on
+#define ENGINE_FINISHED   0x04 // Reached the end of the song
+
+/// Plays many songs at once, one output tick at a time.
+class engine {
+	private:
+		int iSpeed;                         // Output ticks per second
+		uint32_t iMaxDelay;                 // Longest delay that won't overflow ENGINESONG.iWait
+		uint16_t iFNum[128];                // OPL frequency of each note with no pitchbend
+		uint8_t iBlock[128];                // OPL block (octave) of each note
+		std::vector<ENGINESONG> songs;
+		std::vector<uint16_t> freeSlots;    // Slots in songs that can be reused
+		std::vector<ENGINEWRITE> writes;    // Writes made during the last step()
+		uint16_t iCurrentSong;              // Song being processed by step()
+
+	public:
+		/// Create an engine.
+		/**
+		 * @param iSpeed Number of times step() will be called per second of
+		 *   song time, e.g. 560 for Commander Keen IMF timing.
+		 */
+		engine(int iSpeed)
+			throw ();
+
+		/// Start playing a song.
+		/**
+		 * The chip setup is written on the next call to step().
+		 *
+		 * @param t Song to play.  Must remain valid while the song is playing.
+		 * @return Song number, used in ENGINEWRITE.iSong.  Numbers of stopped
+		 *   songs are reused.
+		 */
+		uint16_t start(const tune& t)
+			throw (std::ios::failure);
+
+		/// Stop a song and free its slot.  Any notes are left playing.
+		void stop(uint16_t iSong)
+			throw ();
+
+		/// Has the song reached its end?  The slot isn't freed until stop().
+		bool finished(uint16_t iSong) const
+			throw ();
+
+		/// Advance every song by one output tick.
+		/**
+		 * @return Register writes made by all songs, in song order.  Valid until
+		 *   the next call to step().
+		 */
+		const std::vector<ENGINEWRITE>& step()
+			throw ();
+
+	private:
+		inline void setReg(ENGINESONG& s, uint8_t iRegister, uint8_t iValue)
+			throw ();
+		void init(ENGINESONG& s)
+			throw ();
+		bool event(ENGINESONG& s)
+			throw ();
+		uint32_t readNumber(ENGINESONG& s)
+			throw ();
+		uint16_t getFNum(const ENGINESONG& s, uint8_t iChannel, uint8_t iNote,
+			uint8_t *iBlock) const
+			throw ();
+		void writeInstrument(ENGINESONG& s, uint8_t iChannel, uint8_t iOperatorSource,
+			uint8_t iOperatorDest, uint8_t iInstrument)
+			throw ();
+		void changeInstrument(ENGINESONG& s, uint8_t iOPLChannel,
+			uint8_t iMIDIChannel, uint8_t iNewInstrument)
+			throw ();
+		void noteOn(ENGINESONG& s, uint8_t iChannel, uint8_t iNote, uint8_t iVelocity)
+			throw ();
+		void noteOff(ENGINESONG& s, uint8_t iChannel, uint8_t iNote)
+			throw ();
+		void pitchbend(ENGINESONG& s, uint8_t iChannel, uint16_t iValue)
+			throw ();
+		void writePitchbend(ENGINESONG& s, int iOPLChannel)
+			throw ();
+		void flushPitchbends(ENGINESONG& s)
+			throw ();
+		void controller(ENGINESONG& s, uint8_t iController, uint8_t iValue)
+			throw ();
+		uint16_t nextNote(ENGINESONG& s)
+			throw ();
+};
+
+/// Result of checkEngine().
+typedef struct {
+	int iSpeed;                  ///< Output ticks per second
+	unsigned long iWrites;       ///< Register writes made by cmf::player
+	unsigned long iEngineWrites; ///< Register writes made by the engine
+	unsigned long iSame;         ///< Writes the same in both, before the first difference
+	unsigned long iMistimed;     ///< Matching writes the engine made in the wrong output tick
+	unsigned int iSongs;         ///< Number of copies of the song timed at once
+	unsigned long iSteps;        ///< Number of step() calls timed
+	double dStepUS;              ///< Average time per step(), in microseconds
+} ENGINECHECK;
+
+/// Play a song through an engine and through cmf::player, and compare them.
+/**
+ * Every register write must be the same and in the same order, and the
+ * engine must make each one in the output tick that the song time of the
+ * write falls in (rounded up.)  The engine is then timed playing iSongs
+ * copies of the song at once, for up to a minute of song time.
+ *
+ * @param pData CMF file.
+ * @param iLength Length of pData.
+ * @param iSpeed Output ticks per second.
+ * @param iSongs Number of songs to time at once.
+ * @param result Set to the results.
+ */
+void checkEngine(const char *pData, size_t iLength, int iSpeed,
+	unsigned int iSongs, ENGINECHECK& result)
+	throw (std::ios::failure);
+
+/// Print the result of checkEngine() in a readable form.
+/**
+ * @return true if the engine matched cmf::player.
+ */
+bool printEngineCheck(std::ostream& out, const ENGINECHECK& result)
+	throw ();
+
+} // namespace cmf
+
+#endif // ENGINE_HPP_
@@ -0,0 +1,1171 @@
+/*
+ * CMF2IMF - convert CMF files into id Software IMF files
+ * Copyright (C) 2010 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
+#include <algorithm>
+#include <string.h>
+#include <time.h>
+#include <camoto/iostream_helpers.hpp>
+
+#include "cmf.hpp"
+#include "imf.hpp"
+#include "opl.hpp"
+#include "pack.hpp"
+#include "schedule.hpp"
+#include "smf.hpp"
+
+namespace imf {
+
+using namespace camoto;
+
+writer::writer(RECORDS& records, int iSpeed, uint32_t iDelay)
+	throw () :
+	records(records),
+	iSpeed(iSpeed),
+	iPendingDelay(iDelay)
+{
+	// Initial bytes (a dummy write to register 0 carrying the first delay)
+	RECORD first = {0, 0, 0};
+	this->records.clear();
+	this->records.push_back(first);
+}
+
+void writer::setDelay(uint16_t iDelay)
+	throw ()
+{
+	// Events that don't write any registers (common in MIDI files) can produce
+	// several delays in a row, so they all add up.
+	this->iPendingDelay += iDelay;
+	return;
+}
+
+void writer::setRegister(uint8_t iRegister, uint8_t iValue)
+	throw ()
+{
+	this->finish();
+	RECORD next = {iRegister, iValue, 0};
+	this->records.push_back(next);
+	this->iPendingDelay = 0;
+	return;
+}
+
+/// Convert a delay in milliseconds into IMF ticks.
+static inline uint32_t toTicks(uint32_t iDelay, int iSpeed)
+{
+	// delay == milliseconds, 1000 == one second
+	// if speed == 560, then 560 == one second
+	// Convert delay ticks -> speed ticks
+	return (uint64_t)iDelay * iSpeed / 1000;
+}
+
+/// Set the delay after the last record.
+/**
+ * A record can only hold a delay of up to 0xFFFF ticks (about two minutes at
+ * 560Hz), so anything longer is made up with extra writes to register 0,
+ * the same as retime() does.
+ */
+static void setLastDelay(RECORDS& records, uint32_t iTicks)
+{
+	if (iTicks <= 0xFFFF) {
+		records.back().iDelay = iTicks;
+		return;
+	}
+	records.back().iDelay = 0xFFFF;
+	for (iTicks -= 0xFFFF; iTicks; ) {
+		uint16_t iNext = (iTicks > 0xFFFF) ? 0xFFFF : iTicks;
+		RECORD pad = {0, 0, iNext};
+		records.push_back(pad);
+		iTicks -= iNext;
+	}
+	return;
+}
+
+void writer::finish()
+	throw ()
+{
+	setLastDelay(this->records, toTicks(this->iPendingDelay, this->iSpeed));
+	return;
+}
+
+uint32_t writer::getPendingDelay() const
+	throw ()
+{
+	return this->iPendingDelay;
+}
+
+/// A CMF file, which can be played more than once.
+class cmfSong {
+	private:
+		std::istream& cmf;
+
+	public:
+		cmfSong(std::istream& cmf)
+			throw () :
+			cmf(cmf)
+		{
+		}
+
+		template <class Player>
+		Player *open(cmf::FN_SETREGISTER fnSetReg, cmf::FN_DELAY fnDelay)
+			throw (std::ios::failure)
+		{
+			this->cmf.clear();
+			this->cmf.seekg(0, std::ios::beg);
+			return new Player(this->cmf, fnSetReg, fnDelay);
+		}
+};
+
+/// A MIDI file, which can be played more than once.
+class smfSong {
+	private:
+		const char *pData;
+		size_t iLength;
+		const cmf::SBI *pBank;
+		int iNumInstruments;
+		std::ostream *pLog; // Where to warn about problems with the file (or NULL)
+		boost::scoped_ptr<smf::reader> midi;
+
+	public:
+		smfSong(const char *pData, size_t iLength, const BANK *pBank,
+			std::ostream *pLog)
+			throw () :
+			pData(pData),
+			iLength(iLength),
+			pBank(NULL),
+			iNumInstruments(0),
+			pLog(pLog)
+		{
+			if ((pBank) && (!pBank->empty())) {
+				this->pBank = &pBank->front();
+				this->iNumInstruments = pBank->size();
+			}
+		}
+
+		template <class Player>
+		Player *open(cmf::FN_SETREGISTER fnSetReg, cmf::FN_DELAY fnDelay)
+			throw (std::ios::failure)
+		{
+			// Only warn the first time, not every time the song is played
+			std::ostream *pWarn = this->midi ? NULL : this->pLog;
+			this->midi.reset(new smf::reader(this->pData, this->iLength,
+				this->iNumInstruments, pWarn));
+			return new Player(this->midi->events(), this->midi->header(),
+				this->pBank, fnSetReg, fnDelay);
+		}
+};
+
+/// Play a song once, from start to finish.
+/**
+ * @param pRecordPlan Record the instrument of every note here, or NULL.
+ * @param pPlan Plan the voice allocation with this, or NULL.
+ * @param pBaseRegs Chip state left by the previous song, or NULL for a blank
+ *   chip.
+ * @param pFinalRegs If not NULL, all notes are switched off at the end and the
+ *   final chip state is stored here (256 bytes.)
+ * @param iLeadIn Delay in milliseconds before the song starts, carried over
+ *   from the previous song.
+ * @param pTail If not NULL, the delay after the last write is stored here in
+ *   milliseconds instead of being added to the last record, so it can be
+ *   carried over to the next song.
+ * @return Number of instrument changes.
+ */
+template <class Player, class Song>
+static unsigned int play(Song& song, RECORDS& records, const OPTIONS& opt,
+	std::ostream *pLog, cmf::NOTEPLAN *pRecordPlan, const cmf::NOTEPLAN *pPlan,
+	const uint8_t *pBaseRegs, uint8_t *pFinalRegs, uint32_t iLeadIn = 0,
+	uint32_t *pTail = NULL)
+	throw (std::ios::failure)
+{
+	writer w(records, opt.iSpeed, iLeadIn);
+	cmf::FN_SETREGISTER fnSetReg = boost::bind(&writer::setRegister, &w, _1, _2);
+	cmf::FN_DELAY fnDelay = boost::bind(&writer::setDelay, &w, _1);
+
+	boost::scoped_ptr<Player> p(song.template open<Player>(fnSetReg, fnDelay));
+	if (pLog) p->setLog(*pLog);
+	if (pRecordPlan) p->recordPlan(pRecordPlan);
+	if (pPlan) p->setPlan(*pPlan);
+	if (pBaseRegs) p->setBaseState(pBaseRegs);
+	p->setRange(opt.iStart, opt.iEnd);
+	p->init();
+	while (p->tick()) { } ;
+
+	if (pFinalRegs) {
+		p->allNotesOff();
+		memcpy(pFinalRegs, p->getRegisters(), 256);
+	}
+
+	// Last delay in the file
+	if (pTail) *pTail = w.getPendingDelay();
+	else w.finish();
+	return p->getInstrumentChanges();
+}
+
+template <class Player, class Song>
+static void convertLookahead(Song& song, RECORDS& records, const OPTIONS& opt,
+	std::ostream *pLog, const uint8_t *pBaseRegs, uint8_t *pFinalRegs,
+	uint32_t iLeadIn, uint32_t *pTail)
+	throw (std::ios::failure)
+{
+	// Play the song through once with the normal voice allocation to find out
+	// which instruments the notes use, then again planning ahead with that.
+	// The first run is also what the savings are measured against.
+	cmf::NOTEPLAN plan;
+	RECORDS greedy;
+	unsigned int iGreedyChanges =
+		play<cmf::quiet_player>(song, greedy, opt, NULL, &plan, NULL, pBaseRegs, NULL);
+	unsigned int iChanges = play<Player>(song, records, opt, pLog, NULL, &plan,
+		pBaseRegs, pFinalRegs, iLeadIn, pTail);
+
+	if (pLog) {
+		long iSaved = (long)greedy.size() - (long)records.size();
+		*pLog << std::dec << "Lookahead voice allocation: " << records.size()
+			<< " register writes instead of " << greedy.size() << " (saved "
+			<< iSaved << "), " << iChanges << " instrument changes instead of "
+			<< iGreedyChanges << std::endl;
+	}
+	return;
+}
+
+/// Move instrument changes earlier, reporting how much it helped.
+static void prefetch(RECORDS& records, std::ostream *pLog)
+	throw ()
+{
+	unsigned int iPeak = schedule::peakWrites(records);
+	unsigned int iMoved = schedule::prefetch(records);
+	if (pLog) {
+		*pLog << std::dec << "Instrument prefetch: moved " << iMoved
+			<< " register writes, busiest moment now has "
+			<< schedule::peakWrites(records) << " writes instead of " << iPeak
+			<< std::endl;
+	}
+	return;
+}
+
+/// Spread out the busiest moments, reporting how much it helped.
+static void spread(RECORDS& records, const OPTIONS& opt, std::ostream *pLog)
+	throw ()
+{
+	unsigned int iMaxWrites = (unsigned long)opt.iBusBudget * 1000 / BUS_WRITE_NS;
+	if (iMaxWrites < 1) iMaxWrites = 1;
+	uint32_t iTolerance = (unsigned long)opt.iBusTolerance * opt.iSpeed / 1000;
+	unsigned int iPeak = schedule::peakWrites(records);
+	unsigned int iMoved = schedule::spread(records, iMaxWrites, iTolerance);
+	if (pLog) {
+		*pLog << std::dec << "Bus spreading: moved " << iMoved
+			<< " register writes, busiest moment now has "
+			<< schedule::peakWrites(records) << " writes instead of " << iPeak
+			<< " (aiming for " << iMaxWrites << ")" << std::endl;
+	}
+	return;
+}
+
+template <class Player, class Song>
+static void convertSong(Song& song, RECORDS& records, const OPTIONS& opt,
+	std::ostream *pLog, const uint8_t *pBaseRegs, uint8_t *pFinalRegs,
+	uint32_t iLeadIn, uint32_t *pTail)
+	throw (std::ios::failure)
+{
+	if (!opt.bLookahead) {
+		play<Player>(song, records, opt, pLog, NULL, NULL, pBaseRegs, pFinalRegs,
+			iLeadIn, pTail);
+	} else {
+		convertLookahead<Player>(song, records, opt, pLog, pBaseRegs, pFinalRegs,
+			iLeadIn, pTail);
+	}
+
+	if (opt.bPrefetch) prefetch(records, pLog);
+	if (opt.iBusBudget) spread(records, opt, pLog);
+	return;
+}
+
+/// Convert a song with the player matching whether messages are wanted.
+template <class Song>
+static void playSong(Song& song, RECORDS& records, const OPTIONS& opt,
+	std::ostream *pLog, const uint8_t *pBaseRegs, uint8_t *pFinalRegs,
+	uint32_t iLeadIn, uint32_t *pTail)
+	throw (std::ios::failure)
+{
+	if (pLog) {
+		convertSong<cmf::player>(song, records, opt, pLog, pBaseRegs, pFinalRegs,
+			iLeadIn, pTail);
+	} else {
+		convertSong<cmf::quiet_player>(song, records, opt, NULL, pBaseRegs,
+			pFinalRegs, iLeadIn, pTail);
+	}
+	return;
+}
+
+/// Convert a CMF or MIDI file held in memory.
+/**
+ * See play() for the last four parameters, which are only needed to join
+ * songs together.
+ */
+static void convertData(const char *pData, size_t iLength, RECORDS& records,
+	const OPTIONS& opt, std::ostream *pLog, const uint8_t *pBaseRegs,
+	uint8_t *pFinalRegs, uint32_t iLeadIn, uint32_t *pTail)
+	throw (std::ios::failure)
+{
+	if (smf::isSMF(pData, iLength)) {
+		smfSong song(pData, iLength, opt.pBank, pLog);
+		playSong(song, records, opt, pLog, pBaseRegs, pFinalRegs, iLeadIn, pTail);
+	} else {
+		pack::membuf buf(pData, iLength);
+		std::istream cmf(&buf);
+		cmfSong song(cmf);
+		playSong(song, records, opt, pLog, pBaseRegs, pFinalRegs, iLeadIn, pTail);
+	}
+	return;
+}
+
+void convert(std::istream& cmf, RECORDS& records, const OPTIONS& opt,
+	std::ostream *pLog)
+	throw (std::ios::failure)
+{
+	cmfSong song(cmf);
+	playSong(song, records, opt, pLog, NULL, NULL, 0, NULL);
+	return;
+}
+
+void convert(const char *pData, size_t iLength, RECORDS& records,
+	const OPTIONS& opt, std::ostream *pLog)
+	throw (std::ios::failure)
+{
+	convertData(pData, iLength, records, opt, pLog, NULL, NULL, 0, NULL);
+	return;
+}
+
+/// Writer that also notes the delay before its first register write.
+class segmentWriter: public writer {
+	public:
+		bool bStarted;        // Has anything been written yet?
+		uint32_t iLeadDelay;  // Delay in milliseconds before the first write
+
+		segmentWriter(RECORDS& records, int iSpeed)
+			throw () :
+			writer(records, iSpeed),
+			bStarted(false),
+			iLeadDelay(0)
+		{
+		}
+
+		void setRegister(uint8_t iRegister, uint8_t iValue)
+			throw ()
+		{
+			if (!this->bStarted) {
+				this->iLeadDelay = this->getPendingDelay();
+				this->bStarted = true;
+			}
+			this->writer::setRegister(iRegister, iValue);
+			return;
+		}
+};
+
+/// Part of a song being converted by convertParallel().
+typedef struct {
+	cmf::PLAYERSTATE state;  // Player state at the start of the segment
+	std::streamoff iStart;   // Where the segment starts in the song data (0 == start of song)
+	std::streamoff iEnd;     // Where the segment ends in the song data (0 == end of song)
+	RECORDS records;         // Converted segment
+	bool bWritten;           // Did the segment write any registers?
+	uint32_t iLeadDelay;     // Delay in milliseconds before the first write
+	uint32_t iTailDelay;     // Delay in milliseconds after the last write
+	std::string strError;    // Set if the conversion failed
+} SEGMENT;
+
+/// Play the song through without producing any output, saving the player
+/// state where each segment starts.
+template <class Player>
+static void findSegments(const char *pData, size_t iLength, std::ostream *pLog,
+	std::vector<SEGMENT>& segments)
+	throw (std::ios::failure)
+{
+	pack::membuf buf(pData, iLength);
+	std::istream cmf(&buf);
+	cmfSong song(cmf);
+	cmf::FN_SETREGISTER fnSetReg; // never called
+	cmf::FN_DELAY fnDelay;
+
+	boost::scoped_ptr<Player> p(song.template open<Player>(fnSetReg, fnDelay));
+	if (pLog) p->setLog(*pLog);
+	// A start time that is never reached, so nothing is written at all and only
+	// the player state is kept up to date.
+	p->setRange(0xFFFFFFFF, 0);
+	p->init();
+
+	// Split the rest of the file into equal-sized pieces.  Events are small, so
+	// each segment starts at the first event past its share of the file.
+	unsigned int iCount = segments.size();
+	std::streamoff iStart = cmf.tellg();
+	std::streamoff iSize = iLength - iStart;
+	std::streamoff iNextPos = iStart;
+	unsigned int iNext = 0;
+	do {
+		std::streamoff iPos = buf.pubseekoff(0, std::ios::cur, std::ios::in);
+		if (iPos >= iNextPos) {
+			if (iNext) segments[iNext - 1].iEnd = iPos;
+			p->getState(segments[iNext].state);
+			segments[iNext].iStart = iNext ? iPos : 0;
+			iNext++;
+			if (iNext == iCount) break;
+			iNextPos = iStart + iSize * iNext / iCount;
+		}
+	} while (p->tick());
+
+	// Very short files may have fewer events than segments
+	segments.resize(iNext);
+	segments.back().iEnd = 0;
+	return;
+}
+
+/// Convert one segment, from its saved state up to where the next one starts.
+static void convertSegment(const char *pData, size_t iLength, const OPTIONS& opt,
+	SEGMENT *pSegment)
+	throw ()
+{
+	typedef cmf::quiet_player Player;
+	try {
+		pack::membuf buf(pData, iLength);
+		std::istream cmf(&buf);
+		cmfSong song(cmf);
+		segmentWriter w(pSegment->records, opt.iSpeed);
+		cmf::FN_SETREGISTER fnSetReg = boost::bind(&segmentWriter::setRegister, &w, _1, _2);
+		cmf::FN_DELAY fnDelay = boost::bind(&writer::setDelay, &w, _1);
+
+		boost::scoped_ptr<Player> p(song.template open<Player>(fnSetReg, fnDelay));
+		// The first segment sets up the chip as usual
+		if (pSegment->iStart) p->setState(pSegment->state);
+		p->init();
+		if (pSegment->iEnd) {
+			while ((buf.pubseekoff(0, std::ios::cur, std::ios::in) < pSegment->iEnd)
+				&& (p->tick())) { } ;
+		} else {
+			while (p->tick()) { } ;
+		}
+		pSegment->bWritten = w.bStarted;
+		pSegment->iLeadDelay = w.iLeadDelay;
+		pSegment->iTailDelay = w.getPendingDelay();
+	} catch (std::ios::failure& e) {
+		pSegment->strError = e.what();
+	}
+	return;
+}
+
+void convertParallel(const char *pData, size_t iLength, RECORDS& records,
+	const OPTIONS& opt, unsigned int iJobs, std::ostream *pLog)
+	throw (std::ios::failure)
+{
+	if ((iJobs < 2) || (opt.bLookahead) || (opt.iStart) || (opt.iEnd) ||
+		(smf::isSMF(pData, iLength)) || (iLength / iJobs < PARALLEL_MIN_SEGMENT)
+	) {
+		convert(pData, iLength, records, opt, pLog);
+		return;
+	}
+
+	std::vector<SEGMENT> segments(iJobs);
+	if (pLog) findSegments<cmf::player>(pData, iLength, pLog, segments);
+	else findSegments<cmf::quiet_player>(pData, iLength, NULL, segments);
+
+	boost::thread_group threads;
+	for (unsigned int i = 0; i < segments.size(); i++) {
+		threads.create_thread(boost::bind(&convertSegment, pData, iLength,
+			boost::cref(opt), &segments[i]));
+	}
+	threads.join_all();
+
+	// Join the segments.  A record's delay is worked out from the total time
+	// in milliseconds until the next write, which may cross several segments,
+	// so the time is carried over in milliseconds and only converted once the
+	// next write is reached (the same as the writer does.)
+	records.clear();
+	RECORD first = {0, 0, 0};
+	records.push_back(first);
+	uint32_t iCarry = 0;
+	for (unsigned int i = 0; i < segments.size(); i++) {
+		const SEGMENT& seg = segments[i];
+		if (!seg.strError.empty()) throw std::ios::failure(seg.strError);
+		if (!seg.bWritten) {
+			iCarry += seg.iTailDelay;
+			continue;
+		}
+		setLastDelay(records, toTicks(iCarry + seg.iLeadDelay, opt.iSpeed));
+		records.insert(records.end(), seg.records.begin() + 1, seg.records.end());
+		iCarry = seg.iTailDelay;
+	}
+	setLastDelay(records, toTicks(iCarry, opt.iSpeed));
+	if (pLog) *pLog << std::dec << "Converted in " << segments.size()
+		<< " segments at once" << std::endl;
+
+	if (opt.bPrefetch) prefetch(records, pLog);
+	if (opt.iBusBudget) spread(records, opt, pLog);
+	return;
+}
+
+void convertPlaylist(const std::vector<SONGDATA>& songs, RECORDS& records,
+	const OPTIONS& opt, std::ostream *pLog)
+	throw (std::ios::failure)
+{
+	records.clear();
+	uint8_t iRegs[256];
+	uint32_t iTail = 0;
+	RECORDS next;
+	for (unsigned int i = 0; i < songs.size(); i++) {
+		bool bFirst = (i == 0), bLast = (i + 1 == songs.size());
+		if (pLog) *pLog << std::dec << "Playlist song " << (i + 1) << " of "
+			<< songs.size() << std::endl;
+
+		// Each song starts from the state the last one left the chip in, with
+		// all its notes switched off.  The time after the last song's final
+		// write is carried over in milliseconds and only converted to ticks
+		// along with this song's lead-in, the same as within a song, so no
+		// rounding error builds up at the joins.
+		convertData(songs[i].pData, songs[i].iLength, bFirst ? records : next, opt,
+			pLog, bFirst ? NULL : iRegs, bLast ? NULL : iRegs, iTail,
+			bLast ? NULL : &iTail);
+		if (bFirst) continue;
+
+		// The first record is the dummy write holding the delay before the
+		// song's first register write, which goes on the previous song's last
+		// write instead (which has no delay of its own yet.)
+		size_t iTransition = 0;
+		for (size_t j = 1; (j < next.size()) && (next[j - 1].iDelay == 0); j++) iTransition++;
+		records.back().iDelay = next[0].iDelay;
+		records.insert(records.end(), next.begin() + 1, next.end());
+		if (pLog) *pLog << std::dec << "Song " << (i + 1) << " starts with "
+			<< iTransition << " register writes" << std::endl;
+	}
+	return;
+}
+
+/// A CMF file in memory, which can be played more than once.
+class cmfMemorySong {
+	private:
+		pack::membuf buf;
+		std::istream data;
+		cmfSong song;
+
+	public:
+		cmfMemorySong(const char *pData, size_t iLength)
+			throw () :
+			buf(pData, iLength),
+			data(&this->buf),
+			song(this->data)
+		{
+		}
+
+		template <class Player>
+		Player *open(cmf::FN_SETREGISTER fnSetReg, cmf::FN_DELAY fnDelay)
+			throw (std::ios::failure)
+		{
+			return this->song.template open<Player>(fnSetReg, fnDelay);
+		}
+};
+
+/// The player behind a source, whatever kind of song and player it is.
+class sourcePlayer {
+	public:
+		virtual ~sourcePlayer()
+			throw ()
+		{
+		}
+
+		virtual bool tick()
+			throw (std::ios::failure) = 0;
+};
+
+template <class Player, class Song>
+class songSourcePlayer: public sourcePlayer {
+	private:
+		boost::scoped_ptr<Song> song;
+		cmf::NOTEPLAN plan;
+		boost::scoped_ptr<Player> p;
+
+	public:
+		/// Start playing a song.
+		/**
+		 * @param pSong Song to play.  It belongs to this object from now on.
+		 */
+		songSourcePlayer(Song *pSong, const OPTIONS& opt, std::ostream *pLog,
+			cmf::FN_SETREGISTER fnSetReg, cmf::FN_DELAY fnDelay)
+			throw (std::ios::failure) :
+			song(pSong)
+		{
+			// Lookahead needs a run through the song first to find out which
+			// instruments the notes use
+			if (opt.bLookahead) {
+				RECORDS scratch;
+				play<cmf::quiet_player>(*this->song, scratch, opt, NULL, &this->plan,
+					NULL, NULL, NULL);
+			}
+
+			this->p.reset(this->song->template open<Player>(fnSetReg, fnDelay));
+			if (pLog) this->p->setLog(*pLog);
+			if (opt.bLookahead) this->p->setPlan(this->plan);
+			this->p->setRange(opt.iStart, opt.iEnd);
+			this->p->init();
+		}
+
+		virtual ~songSourcePlayer()
+			throw ()
+		{
+		}
+
+		virtual bool tick()
+			throw (std::ios::failure)
+		{
+			return this->p->tick();
+		}
+};
+
+/// Open a song with the player matching whether messages are wanted.
+/**
+ * @param pSong Song to play, which is taken over by the returned player.
+ */
+template <class Song>
+static sourcePlayer *openSource(Song *pSong, const OPTIONS& opt,
+	std::ostream *pLog, cmf::FN_SETREGISTER fnSetReg, cmf::FN_DELAY fnDelay)
+	throw (std::ios::failure)
+{
+	if (pLog) {
+		return new songSourcePlayer<cmf::player, Song>(pSong, opt, pLog,
+			fnSetReg, fnDelay);
+	}
+	return new songSourcePlayer<cmf::quiet_player, Song>(pSong, opt, NULL,
+		fnSetReg, fnDelay);
+}
+
+source::source(const char *pData, size_t iLength, const OPTIONS& opt,
+	std::ostream *pLog)
+	throw (std::ios::failure) :
+	iNext(0),
+	bFinished(false)
+{
+	this->events.reserve(SOURCE_BUFFER);
+
+	// The chip setup goes straight into the buffer as the player opens
+	cmf::FN_SETREGISTER fnSetReg = boost::bind(&source::setRegister, this, _1, _2);
+	cmf::FN_DELAY fnDelay = boost::bind(&source::setDelay, this, _1);
+	if (smf::isSMF(pData, iLength)) {
+		this->player.reset(openSource(new smfSong(pData, iLength, opt.pBank,
+			pLog), opt, pLog, fnSetReg, fnDelay));
+	} else {
+		this->player.reset(openSource(new cmfMemorySong(pData, iLength),
+			opt, pLog, fnSetReg, fnDelay));
+	}
+}
+
+source::~source()
+	throw ()
+{
+}
+
+bool source::next(EVENT& ev, uint16_t iMaxDelay)
+	throw (std::ios::failure)
+{
+	// Run the player until it has something to say.  Only once the buffer is
+	// empty, so it never has to wrap around and keeps its size.
+	while (this->iNext == this->events.size()) {
+		if (this->bFinished) return false;
+		this->events.clear();
+		this->iNext = 0;
+		this->bFinished = !this->player->tick();
+	}
+
+	EVENT& front = this->events[this->iNext];
+	if (front.iDelay > iMaxDelay) {
+		// Hand out part of the delay, leaving the rest for next time
+		ev.iDelay = iMaxDelay;
+		ev.iRegister = ev.iValue = 0;
+		front.iDelay -= iMaxDelay;
+		return true;
+	}
+	ev = front;
+	this->iNext++;
+	return true;
+}
+
+source::iterator::iterator(source *pSource)
+	throw (std::ios::failure) :
+	pSource(pSource)
+{
+	if ((this->pSource) && (!this->pSource->next(this->ev))) this->pSource = NULL;
+}
+
+source::iterator& source::iterator::operator ++ ()
+	throw (std::ios::failure)
+{
+	if (!this->pSource->next(this->ev)) this->pSource = NULL;
+	return *this;
+}
+
+source::iterator source::begin()
+	throw (std::ios::failure)
+{
+	return iterator(this);
+}
+
+source::iterator source::end()
+	throw ()
+{
+	return iterator(NULL);
+}
+
+void source::setRegister(uint8_t iRegister, uint8_t iValue)
+	throw ()
+{
+	EVENT ev = {0, iRegister, iValue};
+	this->events.push_back(ev);
+	return;
+}
+
+void source::setDelay(uint16_t iDelay)
+	throw ()
+{
+	if (!iDelay) return;
+	EVENT ev = {iDelay, 0, 0};
+	this->events.push_back(ev);
+	return;
+}
+
+void stream(const char *pData, size_t iLength, const OPTIONS& opt,
+	cmf::FN_SETREGISTER fnSetReg, cmf::FN_DELAY fnDelay, std::ostream *pLog)
+	throw (std::ios::failure)
+{
+	source src(pData, iLength, opt, pLog);
+	EVENT ev;
+	while (src.next(ev)) {
+		if (ev.iDelay) fnDelay(ev.iDelay);
+		else fnSetReg(ev.iRegister, ev.iValue);
+	}
+	return;
+}
+
+/// Passes register writes on to a writer, noting when each note starts.
+template <class Player>
+class keyonRecorder {
+	private:
+		writer& w;
+		RECORDS& records;
+		KEYONS& keyons;
+		Player *pPlayer;
+		uint8_t iRegs[256];
+
+	public:
+		keyonRecorder(writer& w, RECORDS& records, KEYONS& keyons)
+			throw () :
+			w(w),
+			records(records),
+			keyons(keyons),
+			pPlayer(NULL)
+		{
+			memset(this->iRegs, 0, sizeof(this->iRegs));
+		}
+
+		void setPlayer(Player *pPlayer)
+			throw ()
+		{
+			this->pPlayer = pPlayer;
+			return;
+		}
+
+		void setRegister(uint8_t iRegister, uint8_t iValue)
+			throw ()
+		{
+			this->w.setRegister(iRegister, iValue);
+			uint8_t iOld = this->iRegs[iRegister];
+			this->iRegs[iRegister] = iValue;
+
+			bool bKeyOn = false;
+			if ((iRegister >= BASE_KEYON_FREQ) && (iRegister <= BASE_KEYON_FREQ + 8)) {
+				bKeyOn = (iValue & OPLBIT_KEYON) && !(iOld & OPLBIT_KEYON);
+			} else if (iRegister == BASE_RHYTHM) {
+				bKeyOn = (iValue & 0x20) && (iValue & 0x1F & ~iOld);
+			}
+			if ((bKeyOn) && (this->pPlayer)) {
+				KEYON k = {(uint32_t)(this->records.size() - 1), this->pPlayer->getSongTicks()};
+				this->keyons.push_back(k);
+			}
+			return;
+		}
+};
+
+template <class Song>
+static void timelineSong(Song& song, RECORDS& records, const OPTIONS& opt,
+	KEYONS& keyons, uint64_t *iSongTicks, unsigned int *iTicksPerSecond)
+	throw (std::ios::failure)
+{
+	typedef cmf::quiet_player Player;
+	writer w(records, opt.iSpeed);
+	keyons.clear();
+	keyonRecorder<Player> rec(w, records, keyons);
+	cmf::FN_SETREGISTER fnSetReg = boost::bind(&keyonRecorder<Player>::setRegister, &rec, _1, _2);
+	cmf::FN_DELAY fnDelay = boost::bind(&writer::setDelay, &w, _1);
+
+	boost::scoped_ptr<Player> p(song.template open<Player>(fnSetReg, fnDelay));
+	rec.setPlayer(p.get());
+	p->init();
+	while (p->tick()) { } ;
+	w.finish();
+
+	*iSongTicks = p->getSongTicks();
+	*iTicksPerSecond = p->getTicksPerSecond();
+	return;
+}
+
+void timeline(const char *pData, size_t iLength, RECORDS& records,
+	const OPTIONS& opt, KEYONS& keyons, uint64_t *iSongTicks,
+	unsigned int *iTicksPerSecond)
+	throw (std::ios::failure)
+{
+	if (smf::isSMF(pData, iLength)) {
+		smfSong song(pData, iLength, opt.pBank, NULL);
+		timelineSong(song, records, opt, keyons, iSongTicks, iTicksPerSecond);
+	} else {
+		pack::membuf buf(pData, iLength);
+		std::istream cmf(&buf);
+		cmfSong song(cmf);
+		timelineSong(song, records, opt, keyons, iSongTicks, iTicksPerSecond);
+	}
+	return;
+}
+
+/// Stands in for a chip while profiling, without allocating anything.
+class chipSink {
+	private:
+		uint8_t iRegs[256];
+		uint32_t iTime;
+
+	public:
+		chipSink()
+			throw () :
+			iTime(0)
+		{
+			memset(this->iRegs, 0, sizeof(this->iRegs));
+		}
+
+		void setRegister(uint8_t iRegister, uint8_t iValue)
+			throw ()
+		{
+			this->iRegs[iRegister] = iValue;
+			return;
+		}
+
+		void setDelay(uint16_t iDelay)
+			throw ()
+		{
+			this->iTime += iDelay;
+			return;
+		}
+};
+
+/// Current time in nanoseconds, from a clock that never jumps.
+static inline uint64_t nanoseconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+template <class Song>
+static void profileSong(Song& song, size_t iLength, const OPTIONS& opt,
+	TICKTIMES& ticks, uint32_t *iInitNS)
+	throw (std::ios::failure)
+{
+	cmf::NOTEPLAN plan;
+	if (opt.bLookahead) {
+		RECORDS scratch;
+		play<cmf::quiet_player>(song, scratch, opt, NULL, &plan, NULL, NULL, NULL);
+	}
+
+	chipSink chip;
+	cmf::FN_SETREGISTER fnSetReg = boost::bind(&chipSink::setRegister, &chip, _1, _2);
+	cmf::FN_DELAY fnDelay = boost::bind(&chipSink::setDelay, &chip, _1);
+	boost::scoped_ptr<cmf::quiet_player> p(
+		song.template open<cmf::quiet_player>(fnSetReg, fnDelay));
+	if (opt.bLookahead) p->setPlan(plan);
+	p->setRange(opt.iStart, opt.iEnd);
+
+	uint64_t iStart = nanoseconds();
+	p->init();
+	*iInitNS = nanoseconds() - iStart;
+
+	// Roughly one event per two bytes, so the list rarely has to grow while
+	// the clock is running
+	ticks.clear();
+	ticks.reserve(iLength / 2);
+	bool bMore;
+	do {
+		TICKTIME t;
+		t.iOffset = p->getPosition();
+		iStart = nanoseconds();
+		bMore = p->tick();
+		t.iNS = nanoseconds() - iStart;
+		t.iCommand = p->getLastCommand();
+		ticks.push_back(t);
+	} while (bMore);
+	return;
+}
+
+void profile(const char *pData, size_t iLength, const OPTIONS& opt,
+	TICKTIMES& ticks, uint32_t *iInitNS)
+	throw (std::ios::failure)
+{
+	if (smf::isSMF(pData, iLength)) {
+		smfSong song(pData, iLength, opt.pBank, NULL);
+		profileSong(song, iLength, opt, ticks, iInitNS);
+	} else {
+		pack::membuf buf(pData, iLength);
+		std::istream cmf(&buf);
+		cmfSong song(cmf);
+		profileSong(song, iLength, opt, ticks, iInitNS);
+	}
+	return;
+}
+
+unsigned int headerLength(int iType)
+	throw ()
+{
+	switch (iType) {
+		case 1: return 2;
+		case 2: return 4;
+	}
+	return 0;
+}
+
+bool fits(const RECORDS& records, int iType)
+	throw ()
+{
+	if (iType != 1) return true;
+	return records.size() * 4 <= IMF_TYPE1_MAX_SIZE;
+}
+
+/// Is any note playing on the chip?
+static bool notesPlaying(const uint8_t *iRegs)
+{
+	for (int i = 0; i < 9; i++) {
+		if (iRegs[BASE_KEYON_FREQ + i] & OPLBIT_KEYON) return true;
+	}
+	return (iRegs[BASE_RHYTHM] & 0x20) && (iRegs[BASE_RHYTHM] & 0x1F);
+}
+
+/// Add records to set a blank chip to the given state, in the same order as
+/// cmf::basic_player::writeState().
+static void writeState(const uint8_t *iRegs, RECORDS& records)
+{
+	for (int i = 0; i < 256; i++) {
+		if ((i >= BASE_KEYON_FREQ) && (i <= BASE_KEYON_FREQ + 8)) continue;
+		if (i == BASE_RHYTHM) continue;
+		if (iRegs[i]) {
+			RECORD r = {(uint8_t)i, iRegs[i], 0};
+			records.push_back(r);
+		}
+	}
+	for (int i = BASE_KEYON_FREQ; i <= BASE_KEYON_FREQ + 8; i++) {
+		if (iRegs[i]) {
+			RECORD r = {(uint8_t)i, iRegs[i], 0};
+			records.push_back(r);
+		}
+	}
+	if (iRegs[BASE_RHYTHM]) {
+		RECORD r = {BASE_RHYTHM, iRegs[BASE_RHYTHM], 0};
+		records.push_back(r);
+	}
+	return;
+}
+
+void split(const RECORDS& records, unsigned long iMaxSize, int iType,
+	std::vector<RECORDS>& chunks)
+	throw (std::ios::failure)
+{
+	unsigned long iMaxRecords = 0;
+	if (iMaxSize > headerLength(iType)) iMaxRecords = (iMaxSize - headerLength(iType)) / 4;
+	if (iType == 1) iMaxRecords = std::min(iMaxRecords, (unsigned long)IMF_TYPE1_MAX_SIZE / 4);
+
+	chunks.clear();
+	uint8_t iRegs[256];      // Chip state at iPos
+	uint8_t iStartRegs[256]; // Chip state at the start of the current piece
+	memset(iRegs, 0, sizeof(iRegs));
+	size_t iStart = 0;       // First record in the current piece
+	bool bNeedState = false; // Does the current piece start with the chip state?
+	size_t iSafe = 0, iCut = 0; // Last silent split point, last split point of any kind
+	size_t iPrefix = 0;      // Number of records needed to write the chip state
+	uint8_t iSafeRegs[256], iCutRegs[256];
+
+	for (size_t iPos = 0; iPos <= records.size(); iPos++) {
+		// Only split between moments, never between two writes at the same time
+		bool bBoundary = (iPos == records.size()) || ((iPos > iStart) && (records[iPos - 1].iDelay));
+		if (bBoundary) {
+			if (iPos - iStart + iPrefix <= iMaxRecords) {
+				// Everything so far still fits
+				iCut = iPos;
+				memcpy(iCutRegs, iRegs, sizeof(iRegs));
+				if (!notesPlaying(iRegs)) {
+					iSafe = iPos;
+					memcpy(iSafeRegs, iRegs, sizeof(iRegs));
+				}
+			} else {
+				// Too big, end the piece at the last split point
+				if (iCut <= iStart) {
+					throw std::ios::failure("Too many register writes at the same "
+						"time to split the song into pieces this small");
+				}
+				bool bSilent = (iSafe > iStart);
+				size_t iEnd = bSilent ? iSafe : iCut;
+				chunks.push_back(RECORDS());
+				RECORDS& chunk = chunks.back();
+				if (bNeedState) writeState(iStartRegs, chunk);
+				chunk.insert(chunk.end(), records.begin() + iStart, records.begin() + iEnd);
+
+				iStart = iEnd;
+				bNeedState = !bSilent;
+				memcpy(iStartRegs, bSilent ? iSafeRegs : iCutRegs, sizeof(iRegs));
+				iPrefix = 0;
+				if (bNeedState) {
+					for (int i = 0; i < 256; i++) if (iStartRegs[i]) iPrefix++;
+				}
+				// Replay the records since the split so the state matches iPos again
+				memcpy(iRegs, iStartRegs, sizeof(iRegs));
+				iPos = iStart - 1;
+				iSafe = iCut = iStart;
+				continue;
+			}
+		}
+		if (iPos < records.size()) iRegs[records[iPos].iRegister] = records[iPos].iValue;
+	}
+	if (iStart < records.size()) {
+		chunks.push_back(RECORDS());
+		RECORDS& chunk = chunks.back();
+		if (bNeedState) writeState(iStartRegs, chunk);
+		chunk.insert(chunk.end(), records.begin() + iStart, records.end());
+	}
+	return;
+}
+
+int detectType(const char *pData, size_t iLength)
+	throw ()
+{
+	if (iLength < 2) return 0;
+	unsigned long iSize = (uint8_t)pData[0] | ((uint8_t)pData[1] << 8);
+	if ((iSize) && (iSize % 4 == 0) && (iSize + 2 <= iLength)) return 1;
+	return 0;
+}
+
+/// Write one record into a buffer, growing it if needed.
+static inline void putRecord(std::string& out, size_t& iPos, uint8_t iRegister,
+	uint8_t iValue, uint16_t iDelay)
+{
+	if (iPos + 4 > out.length()) out.resize(out.length() * 2 + 4);
+	char *p = &out[iPos];
+	p[0] = iRegister;
+	p[1] = iValue;
+	p[2] = iDelay & 0xFF;
+	p[3] = iDelay >> 8;
+	iPos += 4;
+	return;
+}
+
+void retime(const char *pData, size_t iLength, int iInType, int iFromSpeed,
+	int iToSpeed, int iOutType, std::string& out)
+	throw (std::ios::failure)
+{
+	if ((iFromSpeed <= 0) || (iToSpeed <= 0)) throw std::ios::failure("Invalid IMF speed");
+	if (iInType < 0) iInType = detectType(pData, iLength);
+
+	// Find the song data, ignoring anything after it (e.g. tags in type-1 files)
+	const uint8_t *p = (const uint8_t *)pData;
+	size_t iSize = iLength;
+	unsigned int iHeader = headerLength(iInType);
+	if (iLength < iHeader) throw std::ios::failure("IMF file is truncated");
+	if (iInType == 1) {
+		iSize = p[0] | (p[1] << 8);
+	} else if (iInType == 2) {
+		iSize = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+	}
+	p += iHeader;
+	if (iSize > iLength - iHeader) iSize = iLength - iHeader;
+	const uint8_t *pEnd = p + (iSize & ~3);
+
+	size_t iPos = headerLength(iOutType);
+	out.resize(iPos + (pEnd - p));
+
+	// Time is carried over as a fraction of an output tick (in 1/iFromSpeed
+	// units) and starts at a half, so each event is rounded to the nearest tick
+	uint64_t iCarry = iFromSpeed / 2;
+	for (; p < pEnd; p += 4) {
+		iCarry += (uint64_t)(p[2] | (p[3] << 8)) * iToSpeed;
+		uint64_t iDelay = iCarry / iFromSpeed;
+		iCarry -= iDelay * iFromSpeed;
+		if (iDelay <= 0xFFFF) {
+			putRecord(out, iPos, p[0], p[1], iDelay);
+		} else {
+			putRecord(out, iPos, p[0], p[1], 0xFFFF);
+			for (iDelay -= 0xFFFF; iDelay; ) {
+				uint16_t iNext = (iDelay > 0xFFFF) ? 0xFFFF : iDelay;
+				putRecord(out, iPos, 0, 0, iNext);
+				iDelay -= iNext;
+			}
+		}
+	}
+	out.resize(iPos);
+
+	size_t iOutSize = iPos - headerLength(iOutType);
+	if (iOutType == 1) {
+		if (iOutSize > IMF_TYPE1_MAX_SIZE) {
+			throw std::ios::failure("Song is too long for a type-1 IMF file "
+				"(try --type 2)");
+		}
+		out[0] = iOutSize & 0xFF;
+		out[1] = iOutSize >> 8;
+	} else if (iOutType == 2) {
+		out[0] = iOutSize & 0xFF;
+		out[1] = (iOutSize >> 8) & 0xFF;
+		out[2] = (iOutSize >> 16) & 0xFF;
+		out[3] = (iOutSize >> 24) & 0xFF;
+	}
+	return;
+}
+
+void write(std::ostream& out, const RECORDS& records, int iType)
+	throw (std::ios::failure)
+{
+	// Type-1 and type-2 files start with the length of the data, not counting
+	// the length field itself
+	if (iType == 1) {
+		if (!fits(records, iType)) {
+			throw std::ios::failure("Song is too long for a type-1 IMF file "
+				"(try --split or --type 2)");
+		}
+		uint16_t iSize = records.size() * 4;
+		out << u16le(iSize);
+	} else if (iType == 2) {
+		uint32_t iSize = records.size() * 4;
+		out << u32le(iSize);
+	}
+
+	for (RECORDS::const_iterator i = records.begin(); i != records.end(); i++) {
+		out
+			<< u8(i->iRegister)
+			<< u8(i->iValue)
+			<< u16le(i->iDelay)
+		;
+	}
+	return;
+}
+
+} // namespace imf
@@ -0,0 +1,439 @@
+/*
+ * CMF2IMF - convert CMF files into id Software IMF files
+ * Copyright (C) 2010 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IMF_HPP_
+#define IMF_HPP_
+
+#include <boost/scoped_ptr.hpp>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "cmf.hpp"
+
+namespace imf {
+
+/// Version of the conversion code.  Change this whenever the output for a
+/// given CMF file changes, so old cached conversions aren't reused.
+#define IMF_CONVERTER_VERSION "cmf2imf-1.1"
+
+/// Largest amount of data a type-1 file's length field can describe
+#define IMF_TYPE1_MAX_SIZE 0xFFFF
+
+/// A single IMF record: write iValue to iRegister, then wait iDelay ticks
+typedef struct {
+	uint8_t iRegister;
+	uint8_t iValue;
+	uint16_t iDelay;
+} RECORD;
+
+/// All the records making up one IMF song
+typedef std::vector<RECORD> RECORDS;
+
+/// Instruments to use for songs that don't have their own (MIDI files)
+typedef std::vector<cmf::SBI> BANK;
+
+/// Options controlling how a CMF file is converted
+typedef struct {
+	int iSpeed;        // IMF playback rate in Hertz (280, 560, 700)
+	int iType;         // 0, 1 or 2 for a type-0, type-1 or type-2 IMF file
+	uint32_t iStart;   // Start time in milliseconds (0 == start of song)
+	uint32_t iEnd;     // End time in milliseconds (0 == end of song)
+	const BANK *pBank; // Instruments for MIDI files (NULL == CMF defaults)
+	bool bLookahead;   // Plan voice allocation ahead (see cmf::basic_player::setPlan)
+	bool bPrefetch;    // Load instruments before the notes (see schedule::prefetch)
+	uint32_t iBusBudget;    // Most OPL2 bus time at one moment in microseconds, 0 == no limit (see schedule::spread)
+	uint32_t iBusTolerance; // Furthest a write may move to meet iBusBudget, in milliseconds
+} OPTIONS;
+
+/// Receives the register writes from a cmf::player and turns them into
+/// IMF records.
+class writer {
+	private:
+		RECORDS& records;
+		int iSpeed;
+		uint32_t iPendingDelay; // Delay in milliseconds before the next write
+
+	public:
+		/// Start a new song.
+		/**
+		 * @param records Record list to fill.  It is emptied first.
+		 * @param iSpeed IMF playback rate in Hertz.
+		 * @param iDelay Delay in milliseconds before the first write, e.g. left
+		 *   over from the end of a previous song.
+		 */
+		writer(RECORDS& records, int iSpeed, uint32_t iDelay = 0)
+			throw ();
+
+		/// cmf::FN_DELAY callback.
+		void setDelay(uint16_t iDelay)
+			throw ();
+
+		/// cmf::FN_SETREGISTER callback.
+		void setRegister(uint8_t iRegister, uint8_t iValue)
+			throw ();
+
+		/// Write out the final delay after the last register write.
+		void finish()
+			throw ();
+
+		/// Delay (in milliseconds) waiting to be added to the last record.
+		uint32_t getPendingDelay() const
+			throw ();
+};
+
+/// Convert a CMF song into IMF records.
+/**
+ * @param cmf Input CMF data.
+ * @param records Output records.
+ * @param opt Conversion options.
+ * @param pLog Where to write progress and warning messages, or NULL to
+ *   use a player without any messages at all.
+ */
+void convert(std::istream& cmf, RECORDS& records, const OPTIONS& opt,
+	std::ostream *pLog = &std::cout)
+	throw (std::ios::failure);
+
+/// Convert a CMF or MIDI song in memory into IMF records.
+/**
+ * @param pData Input song, either a CMF file or a type-0/1 MIDI file.
+ * @param iLength Length of pData.
+ * @param records Output records.
+ * @param opt Conversion options.
+ * @param pLog Where to write progress and warning messages, or NULL to
+ *   use a player without any messages at all.
+ */
+void convert(const char *pData, size_t iLength, RECORDS& records,
+	const OPTIONS& opt, std::ostream *pLog = &std::cout)
+	throw (std::ios::failure);
+
+/// Smallest song (in bytes) worth splitting up for convertParallel()
+#define PARALLEL_MIN_SEGMENT 16384
+
+/// Convert one CMF song using several threads.
+/**
+ * The song is played through once without producing any output, saving the
+ * player state at iJobs points along the way.  Each part of the song is then
+ * converted in its own thread starting from the saved state, and the parts
+ * are joined together.  The result is exactly the same as convert().
+ *
+ * MIDI files, lookahead voice allocation, opt.iStart/opt.iEnd and songs
+ * smaller than PARALLEL_MIN_SEGMENT bytes per job are converted normally.
+ *
+ * @param pData Input song, either a CMF file or a type-0/1 MIDI file.
+ * @param iLength Length of pData.
+ * @param records Output records.
+ * @param opt Conversion options.
+ * @param iJobs Number of threads to use.
+ * @param pLog Where to write progress and warning messages, or NULL.
+ */
+void convertParallel(const char *pData, size_t iLength, RECORDS& records,
+	const OPTIONS& opt, unsigned int iJobs, std::ostream *pLog = &std::cout)
+	throw (std::ios::failure);
+
+/// One song in a playlist.
+typedef struct {
+	const char *pData;  ///< CMF or MIDI file
+	size_t iLength;     ///< Length of pData
+} SONGDATA;
+
+/// Convert several songs into one stream of IMF records, one after the other.
+/**
+ * The chip is only set up in full for the first song.  At the end of each
+ * song all the notes are switched off, and the next song only writes the
+ * registers that differ from what the previous song left behind.
+ *
+ * @param songs Songs to play, in order.
+ * @param records Output records.
+ * @param opt Conversion options, used for every song.
+ * @param pLog Where to write progress and warning messages, or NULL.
+ */
+void convertPlaylist(const std::vector<SONGDATA>& songs, RECORDS& records,
+	const OPTIONS& opt, std::ostream *pLog = &std::cout)
+	throw (std::ios::failure);
+
+/// One thing that happens while a song plays: a register write or a delay.
+typedef struct {
+	uint16_t iDelay;    ///< Milliseconds to wait, or 0 if this is a register write
+	uint8_t iRegister;  ///< Register to write (only if iDelay == 0)
+	uint8_t iValue;     ///< Value to write (only if iDelay == 0)
+} EVENT;
+
+/// Number of events a source can hold before it has to grow.  A tick
+/// rarely makes more than a handful, only the chip setup makes a lot.
+#define SOURCE_BUFFER 512
+
+class sourcePlayer;
+
+/// Plays a CMF or MIDI song one event at a time, as the caller asks for them.
+/**
+ * The player only runs when the events it produced last time have all been
+ * taken, so the caller can stop at any point (e.g. the end of an audio
+ * buffer), go and do something else, and carry on later.  The events are
+ * kept in a buffer that is reused, so nothing is allocated per event.
+ *
+ * Delays are in milliseconds and are never zero.  opt.iSpeed, opt.iType,
+ * opt.bPrefetch and opt.iBusBudget aren't used.
+ */
+class source {
+	private:
+		boost::scoped_ptr<sourcePlayer> player;
+		std::vector<EVENT> events;  // Events from the last tick
+		size_t iNext;               // Next event in events to hand out
+		bool bFinished;             // Player has reached the end of the song
+
+	public:
+		/// Open a song, ready for the first event.
+		/**
+		 * @param pData Input song, either a CMF file or a type-0/1 MIDI file.
+		 *   Must remain valid while the source is in use.
+		 * @param iLength Length of pData.
+		 * @param opt Conversion options.
+		 * @param pLog Where to write progress and warning messages, or NULL.
+		 */
+		source(const char *pData, size_t iLength, const OPTIONS& opt,
+			std::ostream *pLog = &std::cout)
+			throw (std::ios::failure);
+
+		~source()
+			throw ();
+
+		/// Get the next event.
+		/**
+		 * @param ev Set to the event.
+		 * @param iMaxDelay Longest delay to return, in milliseconds (must not
+		 *   be zero.)  A longer delay is split, and the rest is returned by the
+		 *   next call.
+		 * @return false once the song has finished, in which case ev is
+		 *   unchanged.
+		 */
+		bool next(EVENT& ev, uint16_t iMaxDelay = 0xFFFF)
+			throw (std::ios::failure);
+
+		/// Input iterator over the remaining events, for use with begin()/end().
+		class iterator {
+			private:
+				source *pSource; // NULL at the end
+				EVENT ev;
+
+			public:
+				typedef std::input_iterator_tag iterator_category;
+				typedef EVENT value_type;
+				typedef std::ptrdiff_t difference_type;
+				typedef const EVENT *pointer;
+				typedef const EVENT& reference;
+
+				iterator(source *pSource)
+					throw (std::ios::failure);
+
+				const EVENT& operator * () const
+					throw ()
+				{
+					return this->ev;
+				}
+
+				const EVENT *operator -> () const
+					throw ()
+				{
+					return &this->ev;
+				}
+
+				iterator& operator ++ ()
+					throw (std::ios::failure);
+
+				bool operator == (const iterator& b) const
+					throw ()
+				{
+					return this->pSource == b.pSource;
+				}
+
+				bool operator != (const iterator& b) const
+					throw ()
+				{
+					return this->pSource != b.pSource;
+				}
+		};
+
+		/// Iterator at the next event.  Like any input iterator, only one
+		/// should be used at a time.
+		iterator begin()
+			throw (std::ios::failure);
+
+		/// Iterator marking the end of the song.
+		iterator end()
+			throw ();
+
+	private:
+		void setRegister(uint8_t iRegister, uint8_t iValue)
+			throw ();
+
+		void setDelay(uint16_t iDelay)
+			throw ();
+};
+
+/// Play a CMF or MIDI song straight to a pair of callbacks.
+/**
+ * The song isn't converted first, so the callbacks see each register write as
+ * soon as the player makes it (e.g. to pass it on to another process.)  This
+ * is the same as taking every event from a source.  opt.iSpeed, opt.iType,
+ * opt.bPrefetch and opt.iBusBudget aren't used, as the delays are passed on
+ * in milliseconds.
+ *
+ * @param pData Input song, either a CMF file or a type-0/1 MIDI file.
+ * @param iLength Length of pData.
+ * @param opt Conversion options.
+ * @param fnSetReg Called for every register write.
+ * @param fnDelay Called for every delay, in milliseconds.
+ * @param pLog Where to write progress and warning messages, or NULL.
+ */
+void stream(const char *pData, size_t iLength, const OPTIONS& opt,
+	cmf::FN_SETREGISTER fnSetReg, cmf::FN_DELAY fnDelay,
+	std::ostream *pLog = &std::cout)
+	throw (std::ios::failure);
+
+/// Where a note starts, in both the output and the input song.
+typedef struct {
+	uint32_t iRecord;     ///< Index of the record that keys the note on
+	uint64_t iSongTicks;  ///< Exact song position, in the input's own ticks
+} KEYON;
+
+typedef std::vector<KEYON> KEYONS;
+
+/// Convert a song, noting where each note should start.
+/**
+ * Used to measure how far the output timing drifts from the song's own.  The
+ * whole song is converted with the normal voice allocation, ignoring
+ * opt.iStart, opt.iEnd, opt.bLookahead, opt.bPrefetch and opt.iBusBudget.
+ *
+ * @param pData Input song, either a CMF file or a type-0/1 MIDI file.
+ * @param iLength Length of pData.
+ * @param records Output records.
+ * @param opt Conversion options.
+ * @param keyons Set to every note (and percussion) key-on in records.
+ * @param iSongTicks Set to the exact length of the song, in song ticks.
+ * @param iTicksPerSecond Set to the number of song ticks in one second.
+ */
+void timeline(const char *pData, size_t iLength, RECORDS& records,
+	const OPTIONS& opt, KEYONS& keyons, uint64_t *iSongTicks,
+	unsigned int *iTicksPerSecond)
+	throw (std::ios::failure);
+
+/// How long one call to cmf::player::tick() took.
+typedef struct {
+	uint32_t iNS;        ///< Time taken, in nanoseconds
+	uint32_t iOffset;    ///< Where the event starts in the song data
+	uint8_t iCommand;    ///< MIDI command of the event, including the channel
+} TICKTIME;
+
+typedef std::vector<TICKTIME> TICKTIMES;
+
+/// Play a song, timing every call to the player's tick().
+/**
+ * The register writes go nowhere, so only the player itself is measured.
+ * For MIDI files, iOffset is in the player's merged copy of the tracks
+ * rather than the file itself.  opt.iSpeed, opt.iType, opt.bPrefetch and
+ * opt.iBusBudget aren't used.
+ *
+ * @param pData Input song, either a CMF file or a type-0/1 MIDI file.
+ * @param iLength Length of pData.
+ * @param opt Conversion options.
+ * @param ticks Set to the time taken by every tick, in order.
+ * @param iInitNS Set to the time taken by the player's init(), in
+ *   nanoseconds.
+ */
+void profile(const char *pData, size_t iLength, const OPTIONS& opt,
+	TICKTIMES& ticks, uint32_t *iInitNS)
+	throw (std::ios::failure);
+
+/// Size of the header at the start of an IMF file.
+/**
+ * Type-0 files have no header, type-1 files start with a uint16le length and
+ * type-2 files (our own extension, for songs too long for type-1) start with
+ * a uint32le length.  The length doesn't include the header itself.
+ */
+unsigned int headerLength(int iType)
+	throw ();
+
+/// Will the records fit in a file of the given type?
+bool fits(const RECORDS& records, int iType)
+	throw ();
+
+/// Split a song into pieces that can be played one after the other.
+/**
+ * Where possible the song is split at a moment when no notes are playing.
+ * If there's no such moment close enough, the next piece starts by writing
+ * the whole chip state, so it plays correctly even if the chip was reset
+ * (although any notes held over the split will restart.)
+ *
+ * @param records Song to split.
+ * @param iMaxSize Largest size of each piece, in bytes, including the header.
+ * @param iType IMF type the pieces will be written as.
+ * @param chunks Set to the pieces.
+ * @throw std::ios::failure if some moment in the song has too many register
+ *   writes to fit in a piece.
+ */
+void split(const RECORDS& records, unsigned long iMaxSize, int iType,
+	std::vector<RECORDS>& chunks)
+	throw (std::ios::failure);
+
+/// Guess the type of an existing IMF file.
+/**
+ * A file is taken to be type-1 if it starts with a non-zero length that is a
+ * multiple of four and fits in the file.  (Type-0 files normally start with
+ * an empty record, so their first two bytes are zero.)
+ *
+ * @return 0 or 1.
+ */
+int detectType(const char *pData, size_t iLength)
+	throw ();
+
+/// Change the speed (and optionally the type) of an existing IMF file.
+/**
+ * The delays are rescaled with exact integer arithmetic, carrying the
+ * rounding error over to the next delay, so every event stays within half a
+ * tick of its exact time no matter how long the song is.  Delays too long
+ * for 16 bits are split up with extra writes to register 0.
+ *
+ * @param pData Input IMF file.
+ * @param iLength Length of pData.
+ * @param iInType Type of the input file (0, 1 or 2), or -1 to detect it.
+ * @param iFromSpeed Speed of the input file, in Hertz.
+ * @param iToSpeed Speed of the output file, in Hertz.
+ * @param iOutType Type of the output file (0, 1 or 2).
+ * @param out Set to the new IMF file.
+ * @throw std::ios::failure if the result is too long for a type-1 file.
+ */
+void retime(const char *pData, size_t iLength, int iInType, int iFromSpeed,
+	int iToSpeed, int iOutType, std::string& out)
+	throw (std::ios::failure);
+
+/// Write a list of records out as an IMF file.
+/**
+ * @param out Output stream.
+ * @param records Records to write.
+ * @param iType 0, 1 or 2 for a type-0, type-1 or type-2 file.
+ * @throw std::ios::failure if the song is too long for a type-1 file.
+ */
+void write(std::ostream& out, const RECORDS& records, int iType)
+	throw (std::ios::failure);
+
+} // namespace imf
+
+#endif // IMF_HPP_
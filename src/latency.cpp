@@ -0,0 +1,150 @@
+/*
+ * CMF2IMF - convert CMF files into id Software IMF files
+ * Copyright (C) 2010 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <iomanip>
+#include <vector>
+
+#include "latency.hpp"
+
+namespace latency {
+
+/// Time taken by the slowest tick out of the quickest dPercent percent.
+static uint32_t percentile(std::vector<uint32_t>& times, double dPercent)
+{
+	if (times.empty()) return 0;
+	size_t iRank = (size_t)(times.size() * dPercent / 100.0 + 0.999999);
+	if (iRank < 1) iRank = 1;
+	if (iRank > times.size()) iRank = times.size();
+	std::nth_element(times.begin(), times.begin() + iRank - 1, times.end());
+	return times[iRank - 1];
+}
+
+static bool slower(const imf::TICKTIME& a, const imf::TICKTIME& b)
+{
+	return a.iNS > b.iNS;
+}
+
+void analyse(const char *pData, size_t iLength, const imf::OPTIONS& opt,
+	REPORT& report)
+	throw (std::ios::failure)
+{
+	imf::TICKTIMES ticks;
+	imf::profile(pData, iLength, opt, ticks, &report.iInitNS);
+
+	report.iTicks = ticks.size();
+	report.iTotalNS = 0;
+	report.iMaxNS = 0;
+	for (int i = 0; i < LATENCY_BUCKETS; i++) report.iHistogram[i] = 0;
+
+	std::vector<uint32_t> times;
+	times.reserve(ticks.size());
+	for (imf::TICKTIMES::const_iterator t = ticks.begin(); t != ticks.end(); t++) {
+		report.iTotalNS += t->iNS;
+		if (t->iNS > report.iMaxNS) report.iMaxNS = t->iNS;
+		int iBucket = 0;
+		while ((iBucket < LATENCY_BUCKETS - 1) && (t->iNS >> (iBucket + 1))) iBucket++;
+		report.iHistogram[iBucket]++;
+		times.push_back(t->iNS);
+	}
+	report.iMedianNS = percentile(times, 50);
+	report.iP99NS = percentile(times, 99);
+	report.iP999NS = percentile(times, 99.9);
+
+	report.iNumSlowest = std::min<size_t>(ticks.size(), LATENCY_TOP);
+	std::partial_sort(ticks.begin(), ticks.begin() + report.iNumSlowest,
+		ticks.end(), slower);
+	std::copy(ticks.begin(), ticks.begin() + report.iNumSlowest, report.slowest);
+	return;
+}
+
+/// Describe a MIDI command.
+static const char *commandName(uint8_t iCommand)
+{
+	switch (iCommand & 0xF0) {
+		case 0x80: return "note off";
+		case 0x90: return "note on";
+		case 0xA0: return "key pressure";
+		case 0xB0: return "controller";
+		case 0xC0: return "instrument change";
+		case 0xD0: return "channel pressure";
+		case 0xE0: return "pitchbend";
+	}
+	switch (iCommand) {
+		case 0xF0: return "sysex";
+		case 0xFF: return "meta event";
+	}
+	return "system message";
+}
+
+void print(std::ostream& out, const REPORT& report)
+	throw ()
+{
+	double dMean = report.iTicks ? (double)report.iTotalNS / report.iTicks : 0;
+	out << std::dec << std::fixed << std::setprecision(0)
+		<< "Player latency: " << report.iTicks << " ticks\n"
+		<< "  init():  " << report.iInitNS << " ns\n"
+		<< "  Mean:    " << dMean << " ns\n"
+		<< "  Median:  " << report.iMedianNS << " ns\n"
+		<< "  p99:     " << report.iP99NS << " ns\n"
+		<< "  p99.9:   " << report.iP999NS << " ns\n"
+		<< "  Slowest: " << report.iMaxNS << " ns\n";
+	for (int i = 0; i < LATENCY_BUCKETS; i++) {
+		if (!report.iHistogram[i]) continue;
+		double dPercent = report.iHistogram[i] * 100.0 / report.iTicks;
+		out << "  " << std::setw(10) << (i ? (1UL << i) : 0) << " - "
+			<< std::setw(10) << (1UL << (i + 1)) << " ns: " << std::setw(8)
+			<< report.iHistogram[i] << " (" << std::setprecision(2) << std::setw(6)
+			<< dPercent << "%)\n" << std::setprecision(0);
+	}
+	out << "  Slowest ticks:\n";
+	for (unsigned int i = 0; i < report.iNumSlowest; i++) {
+		const imf::TICKTIME& t = report.slowest[i];
+		out << "  " << std::setw(10) << t.iNS << " ns at offset 0x" << std::hex
+			<< t.iOffset << ": " << commandName(t.iCommand) << " (0x"
+			<< (int)t.iCommand << ")\n" << std::dec;
+	}
+	out.unsetf(std::ios::floatfield);
+	out << std::flush;
+	return;
+}
+
+void write(std::ostream& out, const REPORT& report)
+	throw ()
+{
+	out << std::dec << "summary\tticks\t" << report.iTicks << "\n"
+		<< "summary\tinit_ns\t" << report.iInitNS << "\n"
+		<< "summary\ttotal_ns\t" << report.iTotalNS << "\n"
+		<< "summary\tmedian_ns\t" << report.iMedianNS << "\n"
+		<< "summary\tp99_ns\t" << report.iP99NS << "\n"
+		<< "summary\tp99.9_ns\t" << report.iP999NS << "\n"
+		<< "summary\tmax_ns\t" << report.iMaxNS << "\n";
+	for (int i = 0; i < LATENCY_BUCKETS; i++) {
+		out << "bucket\t" << (i ? (1UL << i) : 0) << "\t" << (1UL << (i + 1))
+			<< "\t" << report.iHistogram[i] << "\n";
+	}
+	for (unsigned int i = 0; i < report.iNumSlowest; i++) {
+		const imf::TICKTIME& t = report.slowest[i];
+		out << "slow\t" << t.iNS << "\t" << t.iOffset << "\t" << (int)t.iCommand
+			<< "\n";
+	}
+	out << std::flush;
+	return;
+}
+
+} // namespace latency
@@ -0,0 +1,79 @@
+/*
+ * CMF2IMF - convert CMF files into id Software IMF files
+ * Copyright (C) 2010 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Measuring the worst-case time the player takes to play one event, for
+ * running it on an audio thread.
+ */
+
+#ifndef LATENCY_HPP_
+#define LATENCY_HPP_
+
+#include <iostream>
+#include <stdint.h>
+
+#include "imf.hpp"
+
+namespace latency {
+
+/// Number of bars in REPORT::iHistogram.  Bar n counts ticks taking from
+/// 2^n up to 2^(n+1) nanoseconds (bar 0 includes 0.)
+#define LATENCY_BUCKETS 32
+
+/// Number of slowest ticks kept in REPORT::slowest
+#define LATENCY_TOP 10
+
+/// How long the player took to play each event of a song.
+typedef struct {
+	unsigned long iTicks;      ///< Number of calls to tick()
+	uint32_t iInitNS;          ///< Time taken by init()
+	uint64_t iTotalNS;         ///< Time taken by all the calls to tick()
+	uint32_t iMedianNS;        ///< Half the ticks took this long or less
+	uint32_t iP99NS;           ///< 99% of the ticks took this long or less
+	uint32_t iP999NS;          ///< 99.9% of the ticks took this long or less
+	uint32_t iMaxNS;           ///< Slowest tick
+	unsigned long iHistogram[LATENCY_BUCKETS];
+	imf::TICKTIME slowest[LATENCY_TOP]; ///< Slowest ticks, slowest first
+	unsigned int iNumSlowest;  ///< Number of entries used in slowest
+} REPORT;
+
+/// Play a song, timing each event.
+/**
+ * @param pData Input song, either a CMF file or a type-0/1 MIDI file.
+ * @param iLength Length of pData.
+ * @param opt Conversion options.
+ * @param report Set to the results.
+ */
+void analyse(const char *pData, size_t iLength, const imf::OPTIONS& opt,
+	REPORT& report)
+	throw (std::ios::failure);
+
+/// Print a report in a readable form.
+void print(std::ostream& out, const REPORT& report)
+	throw ();
+
+/// Write a report as tab-separated values, for other programs to read.
+/**
+ * Each line starts with what it holds: "summary", "bucket" (a histogram
+ * bar, from and to in nanoseconds, and the count) or "slow" (one of the
+ * slowest ticks: nanoseconds, offset and MIDI command.)
+ */
+void write(std::ostream& out, const REPORT& report)
+	throw ();
+
+} // namespace latency
+
+#endif // LATENCY_HPP_
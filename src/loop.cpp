@@ -0,0 +1,234 @@
+/*
+ * CMF2IMF - convert CMF files into id Software IMF files
+ * Copyright (C) 2010 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <string.h>
+#include <vector>
+
+#include "loop.hpp"
+
+namespace loop {
+
+#define BLOCK_RECORDS 0x00
+#define BLOCK_REPEAT  0x01
+
+/// Largest number of records in one BLOCK_RECORDS block
+#define BLOCK_MAX_RECORDS 0xFFFF
+
+/// Scramble a number so every bit affects every other (splitmix64)
+static inline uint64_t mix(uint64_t x)
+{
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+static inline bool same(const imf::RECORD& a, const imf::RECORD& b)
+{
+	return (a.iRegister == b.iRegister) && (a.iValue == b.iValue)
+		&& (a.iDelay == b.iDelay);
+}
+
+static inline uint64_t recordHash(const imf::RECORD& r)
+{
+	return mix(r.iRegister | (r.iValue << 8) | ((uint32_t)r.iDelay << 16));
+}
+
+static inline void putU16(std::string& out, uint16_t i)
+{
+	out += (char)(i & 0xFF);
+	out += (char)(i >> 8);
+	return;
+}
+
+static inline void putU32(std::string& out, uint32_t i)
+{
+	putU16(out, i & 0xFFFF);
+	putU16(out, i >> 16);
+	return;
+}
+
+static inline uint32_t getU32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/// Write out records that aren't part of a repeat.
+static void putRecords(std::string& out, const imf::RECORDS& records,
+	size_t iStart, size_t iEnd)
+{
+	while (iStart < iEnd) {
+		size_t iCount = iEnd - iStart;
+		if (iCount > BLOCK_MAX_RECORDS) iCount = BLOCK_MAX_RECORDS;
+		out += (char)BLOCK_RECORDS;
+		putU16(out, iCount);
+		for (size_t i = iStart; i < iStart + iCount; i++) {
+			out += (char)records[i].iRegister;
+			out += (char)records[i].iValue;
+			putU16(out, records[i].iDelay);
+		}
+		iStart += iCount;
+	}
+	return;
+}
+
+void compress(const imf::RECORDS& records, std::string& out, STATS *pStats)
+	throw ()
+{
+	size_t iCount = records.size();
+	STATS stats = {iCount, 0, 0, 0};
+
+	// Chip state before each record.  The hash of the whole state is the XOR
+	// of a hash of each register's value, so it can be updated one write at
+	// a time.
+	std::vector<uint64_t> state(iCount);
+	uint8_t iRegs[256];
+	memset(iRegs, 0, sizeof(iRegs));
+	uint64_t iState = 0;
+	for (int r = 0; r < 256; r++) iState ^= mix(r << 8);
+	for (size_t i = 0; i < iCount; i++) {
+		state[i] = iState;
+		const imf::RECORD& rec = records[i];
+		iState ^= mix((rec.iRegister << 8) | iRegs[rec.iRegister])
+			^ mix((rec.iRegister << 8) | rec.iValue);
+		iRegs[rec.iRegister] = rec.iValue;
+	}
+
+	// Earlier places with the same chip state and the same next few records
+	// are found through a hash table of chains, as in LZ77
+	size_t iTableSize = 1024;
+	while (iTableSize < iCount) iTableSize <<= 1;
+	size_t iMask = iTableSize - 1;
+	std::vector<int32_t> head(iTableSize, -1);
+	std::vector<int32_t> prev(iCount, -1);
+	uint64_t iKey = 0;
+
+	out.assign(LOOP_MAGIC);
+	out += (char)LOOP_VERSION;
+	putU32(out, iCount);
+
+	size_t iLiteral = 0; // Start of the records not written out yet
+	size_t i = 0;
+	while (i < iCount) {
+		size_t iBest = 0, iFrom = 0;
+		bool bKey = (i + LOOP_MIN_RECORDS <= iCount);
+		if (bKey) {
+			iKey = state[i];
+			for (size_t k = i; k < i + LOOP_MIN_RECORDS; k++) {
+				iKey = mix(iKey ^ recordHash(records[k]));
+			}
+			int iChain = 0;
+			for (int32_t j = head[iKey & iMask]; (j >= 0) && (iChain < LOOP_MAX_CHAIN);
+				j = prev[j], iChain++
+			) {
+				if (state[j] != state[i]) continue;
+				size_t iLen = 0;
+				while ((i + iLen < iCount) && (same(records[j + iLen], records[i + iLen]))) iLen++;
+				if (iLen > iBest) {
+					iBest = iLen;
+					iFrom = j;
+				}
+			}
+		}
+
+		size_t iStep = 1;
+		if (iBest >= LOOP_MIN_RECORDS) {
+			putRecords(out, records, iLiteral, i);
+			out += (char)BLOCK_REPEAT;
+			putU32(out, iFrom);
+			putU32(out, iBest);
+			stats.iRepeats++;
+			stats.iRepeated += iBest;
+			if (iBest > stats.iLongest) stats.iLongest = iBest;
+			iStep = iBest;
+			iLiteral = i + iBest;
+		}
+
+		// Remember where we've been, so later records can repeat it
+		for (size_t k = i; k < i + iStep; k++) {
+			if (k + LOOP_MIN_RECORDS > iCount) break;
+			if (k != i) {
+				iKey = state[k];
+				for (size_t r = k; r < k + LOOP_MIN_RECORDS; r++) {
+					iKey = mix(iKey ^ recordHash(records[r]));
+				}
+			}
+			prev[k] = head[iKey & iMask];
+			head[iKey & iMask] = k;
+		}
+		i += iStep;
+	}
+	putRecords(out, records, iLiteral, iCount);
+
+	if (pStats) *pStats = stats;
+	return;
+}
+
+bool isLoop(const char *pData, size_t iLength)
+	throw ()
+{
+	return (iLength >= 9) && (memcmp(pData, LOOP_MAGIC, 4) == 0);
+}
+
+void decompress(const char *pData, size_t iLength, imf::RECORDS& records)
+	throw (std::ios::failure)
+{
+	if (!isLoop(pData, iLength)) throw std::ios::failure("Not a loop-compressed file");
+	const uint8_t *p = (const uint8_t *)pData;
+	const uint8_t *pEnd = p + iLength;
+	if (p[4] != LOOP_VERSION) throw std::ios::failure("Unsupported loop-compressed file version");
+	uint32_t iCount = getU32(p + 5);
+	p += 9;
+
+	records.clear();
+	// The count could be anything if the file is damaged, so don't trust it
+	// too far
+	records.reserve(std::min<uint32_t>(iCount, 0x100000));
+	while (p < pEnd) {
+		if (*p == BLOCK_RECORDS) {
+			if (pEnd - p < 3) break;
+			uint32_t iNum = p[1] | (p[2] << 8);
+			p += 3;
+			if (((size_t)(pEnd - p) < iNum * 4) || (records.size() + iNum > iCount)) break;
+			for (uint32_t i = 0; i < iNum; i++, p += 4) {
+				imf::RECORD r = {p[0], p[1], (uint16_t)(p[2] | (p[3] << 8))};
+				records.push_back(r);
+			}
+		} else if (*p == BLOCK_REPEAT) {
+			if (pEnd - p < 9) break;
+			uint32_t iFrom = getU32(p + 1);
+			uint32_t iNum = getU32(p + 5);
+			p += 9;
+			if ((iFrom >= records.size()) || (iNum > iCount - records.size())) break;
+			// One at a time, as the copy may run into its own output
+			for (uint32_t i = 0; i < iNum; i++) {
+				imf::RECORD r = records[iFrom + i];
+				records.push_back(r);
+			}
+		} else {
+			break;
+		}
+	}
+	if ((p != pEnd) || (records.size() != iCount)) {
+		throw std::ios::failure("Loop-compressed file is damaged");
+	}
+	return;
+}
+
+} // namespace loop
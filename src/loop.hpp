@@ -0,0 +1,85 @@
+/*
+ * CMF2IMF - convert CMF files into id Software IMF files
+ * Copyright (C) 2010 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Storing songs with each repeated section written out only once.
+ */
+
+#ifndef LOOP_HPP_
+#define LOOP_HPP_
+
+#include <iostream>
+#include <string>
+
+#include "imf.hpp"
+
+namespace loop {
+
+/// Shortest run of records worth replacing with a repeat
+#define LOOP_MIN_RECORDS 8
+
+/// Most earlier places checked for a repeat of each record
+#define LOOP_MAX_CHAIN 64
+
+/// Start of a loop-compressed file
+#define LOOP_MAGIC "IMFL"
+
+/// Format version written after LOOP_MAGIC
+#define LOOP_VERSION 1
+
+/// What compress() found.
+typedef struct {
+	unsigned long iRecords;   ///< Number of records in the song
+	unsigned long iRepeats;   ///< Number of repeated sections
+	unsigned long iRepeated;  ///< Number of records in those sections
+	unsigned long iLongest;   ///< Longest repeated section, in records
+} STATS;
+
+/// Store a song with its repeated sections replaced by references back.
+/**
+ * A section only counts as a repeat if the chip is in exactly the same state
+ * when it starts as it was at the start of the earlier copy, so each repeat
+ * is also a place a player could loop back to.
+ *
+ * The file starts with LOOP_MAGIC, the uint8 version and the uint32le number
+ * of records.  Then come any number of blocks, each starting with a byte:
+ *
+ *  - 0x00: uint16le count, followed by that many IMF records (4 bytes each.)
+ *  - 0x01: uint32le first record, uint32le count.  Repeat that many records
+ *    from the given place earlier in the song.  The copy can run into the
+ *    records it is producing, repeating a short section several times.
+ *
+ * @param records Song to store.
+ * @param out Set to the loop-compressed file.
+ * @param pStats If not NULL, set to what was found.
+ */
+void compress(const imf::RECORDS& records, std::string& out, STATS *pStats)
+	throw ();
+
+/// Is this a loop-compressed file?
+bool isLoop(const char *pData, size_t iLength)
+	throw ();
+
+/// Turn a loop-compressed file back into the original records.
+/**
+ * @throw std::ios::failure if the file is damaged.
+ */
+void decompress(const char *pData, size_t iLength, imf::RECORDS& records)
+	throw (std::ios::failure);
+
+} // namespace loop
+
+#endif // LOOP_HPP_
@@ -16,39 +16,640 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <boost/program_options.hpp>
 #include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/program_options.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/thread.hpp>
 #include <iostream>
 #include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <map>
+#include <math.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
 #include <camoto/iostream_helpers.hpp>
 
 #include "cmf.hpp"
+#include "cache.hpp"
+#include "delta.hpp"
+#include "engine.hpp"
+#include "imf.hpp"
+#include "latency.hpp"
+#include "loop.hpp"
+#include "pack.hpp"
+#include "schedule.hpp"
+#include "server.hpp"
+#include "shm.hpp"
+#include "smf.hpp"
+#include "timing.hpp"
 
 namespace po = boost::program_options;
 using namespace camoto;
 
-void setDelay(uint16_t delay, uint16_t *keep)
+/// Turn "song.cmf" into "song.imf"
+std::string imfName(const std::string& strCMFName)
 {
-	*keep = delay;
+	std::string::size_type iDot = strCMFName.rfind('.');
+	if (iDot == std::string::npos) return strCMFName + ".imf";
+	return strCMFName.substr(0, iDot) + ".imf";
+}
+
+/// Write a song out in the format chosen with --format.
+void encodeSong(const imf::RECORDS& records, int iType,
+	const std::string& strFormat, std::string& strOut)
+	throw (std::ios::failure)
+{
+	if (strFormat.compare("delta") == 0) {
+		delta::compress(records, strOut);
+		std::cout << std::dec << "Delta compression: " << strOut.length()
+			<< " bytes instead of " << (records.size() * 4 + imf::headerLength(iType))
+			<< std::endl;
+		return;
+	}
+	if (strFormat.compare("loop") == 0) {
+		loop::STATS stats;
+		loop::compress(records, strOut, &stats);
+		std::cout << std::dec << "Loop compression: " << stats.iRepeats
+			<< " repeated sections, covering " << stats.iRepeated << " of "
+			<< stats.iRecords << " records (longest " << stats.iLongest << "), "
+			<< strOut.length() << " bytes instead of "
+			<< (records.size() * 4 + imf::headerLength(iType)) << std::endl;
+		return;
+	}
+	std::ostringstream imfData;
+	imf::write(imfData, records, iType);
+	strOut = imfData.str();
 	return;
 }
 
-void setRegister(uint8_t reg, uint8_t val, uint16_t *preDelay, std::ostream& out, int speed)
+/// Convert a CMF or MIDI file in memory into an IMF file in memory.
+void convertData(const char *pData, size_t iLength, std::string& strIMF,
+	const imf::OPTIONS& opt, unsigned int iJobs = 1, bool bBusReport = false,
+	const std::string& strFormat = "imf")
+	throw (std::ios::failure)
 {
-	// delay == milliseconds, 1000 == one second
-	// if speed == 560, then 560 == one second
-	// Convert delay ticks -> speed ticks
-	unsigned long delay = (unsigned long)*preDelay * speed / 1000;
+	imf::RECORDS records;
+	imf::convertParallel(pData, iLength, records, opt, iJobs);
 
-	out
-		<< u16le(delay)
-		<< u8(reg)
-		<< u8(val)
-	;
-	*preDelay = 0;
+	if (bBusReport) {
+		schedule::BUSREPORT report;
+		schedule::busCost(records, opt.iSpeed, (unsigned long)opt.iBusBudget * 1000,
+			report);
+		schedule::printBusCost(std::cout, report);
+	}
+
+	encodeSong(records, opt.iType, strFormat, strIMF);
+	if (strFormat.compare("imf") != 0) return;
+
+	if (opt.iType == 1) {
+		std::cout << "Updating type-1 header to file size "
+			<< (records.size() * 4) << std::endl;
+	} else if ((opt.iType == 0) && (!imf::fits(records, 1))) {
+		std::cout << "Warning: Song is longer than 64kB, some games won't be able "
+			"to play it (try --split)" << std::endl;
+	}
 	return;
 }
 
+/// Name of one piece of a split song: song.imf -> song-1.imf
+std::string splitName(const std::string& strIMF, unsigned int iPiece)
+{
+	std::ostringstream ss;
+	ss << "-" << iPiece;
+	std::string::size_type iDot = strIMF.rfind('.');
+	std::string::size_type iSlash = strIMF.rfind('/');
+	if ((iDot == std::string::npos) || ((iSlash != std::string::npos) && (iDot < iSlash))) {
+		return strIMF + ss.str();
+	}
+	return strIMF.substr(0, iDot) + ss.str() + strIMF.substr(iDot);
+}
+
+/// Convert a CMF or MIDI file and write it out as several IMF files, none
+/// bigger than iMaxSize bytes.
+void convertSplit(const char *pData, size_t iLength, const std::string& strIMF,
+	const imf::OPTIONS& opt, unsigned long iMaxSize)
+	throw (std::ios::failure)
+{
+	imf::RECORDS records;
+	imf::convert(pData, iLength, records, opt);
+	std::vector<imf::RECORDS> chunks;
+	imf::split(records, iMaxSize, opt.iType, chunks);
+
+	for (unsigned int i = 0; i < chunks.size(); i++) {
+		std::string strName = splitName(strIMF, i + 1);
+		std::ofstream outfile(strName.c_str(), std::ios::out | std::ios::trunc | std::ios::binary);
+		if (!outfile.is_open()) throw std::ios::failure("Unable to create " + strName);
+		imf::write(outfile, chunks[i], opt.iType);
+		outfile.close();
+		if (outfile.fail()) throw std::ios::failure("Unable to write " + strName);
+		std::cout << "Wrote " << strName << " (" << std::dec << (chunks[i].size() * 4
+			+ imf::headerLength(opt.iType)) << " bytes)" << std::endl;
+	}
+	return;
+}
+
+/// Convert several CMF or MIDI files into one IMF file, played one after the
+/// other.  The last filename is the output file.
+void convertPlaylist(const std::vector<std::string>& files, const imf::OPTIONS& opt,
+	const std::string& strFormat)
+	throw (std::ios::failure)
+{
+	boost::ptr_vector<pack::mapping> inputs;
+	std::vector<imf::SONGDATA> songs;
+	for (unsigned int i = 0; i + 1 < files.size(); i++) {
+		std::cout << "Opening " << files[i] << std::endl;
+		inputs.push_back(new pack::mapping(files[i]));
+		imf::SONGDATA song = {inputs.back().data(), inputs.back().size()};
+		songs.push_back(song);
+	}
+
+	imf::RECORDS records;
+	imf::convertPlaylist(songs, records, opt);
+	std::string strData;
+	encodeSong(records, opt.iType, strFormat, strData);
+
+	const std::string& strIMF = files.back();
+	std::ofstream outfile(strIMF.c_str(), std::ios::out | std::ios::trunc | std::ios::binary);
+	if (!outfile.is_open()) throw std::ios::failure("Unable to create " + strIMF);
+	outfile.write(strData.data(), strData.length());
+	outfile.close();
+	if (outfile.fail()) throw std::ios::failure("Unable to write " + strIMF);
+	std::cout << "Wrote " << strIMF << std::endl;
+	return;
+}
+
+/// Turn a file written with --format back into an ordinary IMF file.
+void decodeFile(const std::string& strIn, const std::string& strIMF, int iType)
+	throw (std::ios::failure)
+{
+	pack::mapping in(strIn);
+	imf::RECORDS records;
+	if (loop::isLoop(in.data(), in.size())) {
+		loop::decompress(in.data(), in.size(), records);
+	} else if (delta::isDelta(in.data(), in.size())) {
+		delta::decompress(in.data(), in.size(), records);
+	} else {
+		throw std::ios::failure(strIn + " is not in any format known to --decode");
+	}
+
+	std::ofstream outfile(strIMF.c_str(), std::ios::out | std::ios::trunc | std::ios::binary);
+	if (!outfile.is_open()) throw std::ios::failure("Unable to create " + strIMF);
+	imf::write(outfile, records, iType);
+	outfile.close();
+	if (outfile.fail()) throw std::ios::failure("Unable to write " + strIMF);
+	std::cout << "Wrote " << strIMF << std::endl;
+	return;
+}
+
+/// Current time in seconds, from a clock that never jumps.
+double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/// Minimum time to spend decoding each format in benchFormats()
+#define BENCH_SECONDS 0.25
+
+/// Decode a song in one format over and over, returning the speed in MB/s
+/// of IMF data produced.  fnDecode returns the number of records decoded.
+double benchDecode(boost::function<size_t ()> fnDecode)
+{
+	size_t iRecords = 0;
+	double dStart = now(), dElapsed;
+	do {
+		iRecords += fnDecode();
+		dElapsed = now() - dStart;
+	} while (dElapsed < BENCH_SECONDS);
+	return iRecords * 4 / dElapsed / 1e6;
+}
+
+size_t decodeIMF(const std::string& strIMF, unsigned int iHeader,
+	imf::RECORDS& records)
+{
+	records.clear();
+	const uint8_t *p = (const uint8_t *)strIMF.data() + iHeader;
+	const uint8_t *pEnd = (const uint8_t *)strIMF.data() + strIMF.length();
+	for (; p + 4 <= pEnd; p += 4) {
+		imf::RECORD r = {p[0], p[1], (uint16_t)(p[2] | (p[3] << 8))};
+		records.push_back(r);
+	}
+	return records.size();
+}
+
+size_t decodeLoop(const std::string& strData, imf::RECORDS& records)
+{
+	loop::decompress(strData.data(), strData.length(), records);
+	return records.size();
+}
+
+size_t decodeDelta(const std::string& strData, imf::RECORDS& records)
+{
+	// Streaming, as a player would, into a list that is already big enough
+	delta::decoder d(strData.data(), strData.length());
+	records.resize(d.size());
+	size_t i = 0;
+	imf::RECORD r;
+	while ((d.next(r)) && (i < records.size())) records[i++] = r;
+	return i;
+}
+
+bool sameRecords(const imf::RECORDS& a, const imf::RECORDS& b)
+{
+	if (a.size() != b.size()) return false;
+	for (size_t i = 0; i < a.size(); i++) {
+		if ((a[i].iRegister != b[i].iRegister) || (a[i].iValue != b[i].iValue)
+			|| (a[i].iDelay != b[i].iDelay)
+		) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/// Compare the size of a song in each --format, and how quickly each one can
+/// be turned back into IMF records.
+/**
+ * @return 0 if every format decodes back to the same records, 2 otherwise.
+ */
+int benchFormats(const std::string& strFile, const imf::OPTIONS& opt)
+	throw (std::ios::failure)
+{
+	pack::mapping in(strFile);
+	imf::RECORDS records;
+	imf::convert(in.data(), in.size(), records, opt, NULL);
+
+	std::ostringstream imfData;
+	imf::write(imfData, records, opt.iType);
+	std::string strIMF = imfData.str(), strLoop, strDelta;
+	loop::compress(records, strLoop, NULL);
+	delta::compress(records, strDelta);
+
+	imf::RECORDS decoded;
+	const char *cNames[3] = {"imf", "loop", "delta"};
+	const std::string *pData[3] = {&strIMF, &strLoop, &strDelta};
+	boost::function<size_t ()> fnDecode[3] = {
+		boost::bind(decodeIMF, boost::cref(strIMF), imf::headerLength(opt.iType),
+			boost::ref(decoded)),
+		boost::bind(decodeLoop, boost::cref(strLoop), boost::ref(decoded)),
+		boost::bind(decodeDelta, boost::cref(strDelta), boost::ref(decoded))
+	};
+
+	int ret = 0;
+	std::cout << std::dec << std::fixed << std::setprecision(2) << strFile
+		<< ": " << records.size() << " records\n";
+	for (int i = 0; i < 3; i++) {
+		fnDecode[i]();
+		bool bExact = sameRecords(records, decoded);
+		if (!bExact) ret = 2;
+		double dSpeed = benchDecode(fnDecode[i]);
+		std::cout << "  " << std::setw(5) << cNames[i] << ": " << std::setw(9)
+			<< pData[i]->length() << " bytes, ratio " << std::setw(7)
+			<< (double)strIMF.length() / pData[i]->length() << ", decodes at "
+			<< std::setw(8) << dSpeed << " MB/s"
+			<< (bExact ? "" : " (DOES NOT MATCH)") << "\n";
+	}
+	std::cout.unsetf(std::ios::floatfield);
+	std::cout << std::flush;
+	return ret;
+}
+
+/// Report how accurately a song's timing is kept at each of the given speeds.
+/**
+ * @return 0 if every worst drift is within dMaxDrift (or dMaxDrift is 0),
+ *   3 otherwise.
+ */
+int reportTiming(const std::string& strFile, const std::string& strSpeeds,
+	imf::OPTIONS opt, double dMaxDrift)
+	throw (std::ios::failure)
+{
+	std::vector<int> speeds;
+	std::istringstream ss(strSpeeds);
+	std::string strSpeed;
+	while (std::getline(ss, strSpeed, ',')) {
+		int iSpeed = atoi(strSpeed.c_str());
+		if (iSpeed <= 0) throw std::ios::failure("Invalid speed in --timing: " + strSpeed);
+		speeds.push_back(iSpeed);
+	}
+
+	pack::mapping in(strFile);
+	int ret = 0;
+	for (std::vector<int>::iterator i = speeds.begin(); i != speeds.end(); i++) {
+		opt.iSpeed = *i;
+		timing::REPORT report;
+		timing::analyse(in.data(), in.size(), opt, report);
+		timing::print(std::cout, report);
+		if ((dMaxDrift > 0) && (fabs(report.dMaxDrift) > dMaxDrift)) {
+			std::cout << "  FAIL: worst drift is over " << dMaxDrift << " ms" << std::endl;
+			ret = 3;
+		}
+	}
+	return ret;
+}
+
+/// Time how long the player takes over each event of a song.
+int reportLatency(const std::string& strFile, const imf::OPTIONS& opt,
+	unsigned long iBudgetNS, const std::string& strExport)
+	throw (std::ios::failure)
+{
+	pack::mapping in(strFile);
+	latency::REPORT report;
+	latency::analyse(in.data(), in.size(), opt, report);
+	latency::print(std::cout, report);
+
+	if (!strExport.empty()) {
+		std::ofstream out(strExport.c_str(), std::ios::out | std::ios::trunc);
+		if (!out.is_open()) throw std::ios::failure("Unable to create " + strExport);
+		latency::write(out, report);
+		out.close();
+		if (out.fail()) throw std::ios::failure("Unable to write " + strExport);
+	}
+
+	if ((iBudgetNS) && (report.iP999NS > iBudgetNS)) {
+		std::cout << "  FAIL: p99.9 is over " << iBudgetNS << " ns" << std::endl;
+		return 3;
+	}
+	return 0;
+}
+
+/// Play a song into a shared memory ring, and wait for the reader to finish.
+void playShm(shm::writer& ring, const pack::mapping& in, const imf::OPTIONS& opt)
+	throw (std::ios::failure)
+{
+	imf::source song(in.data(), in.size(), opt, NULL);
+	for (imf::source::iterator i = song.begin(); i != song.end(); ++i) {
+		if (i->iDelay) ring.setDelay(i->iDelay);
+		else ring.setRegister(i->iRegister, i->iValue);
+		if (ring.readerGone()) break;
+	}
+	ring.finish();
+	if (ring.readerGone()) {
+		throw std::ios::failure("The shared memory reader exited early, or never "
+			"opened the ring");
+	}
+	return;
+}
+
+/// Play a song into a shared memory ring for another process to read.
+int writeShm(const std::string& strName, const std::string& strFile,
+	const imf::OPTIONS& opt)
+{
+	try {
+		pack::mapping in(strFile);
+		shm::writer ring(strName);
+		std::cout << "Playing " << strFile << " into " << strName << std::endl;
+		playShm(ring, in, opt);
+	} catch (std::ios::failure& e) {
+		std::cerr << "ERROR: " << e.what() << std::endl;
+		return 2;
+	}
+	return 0;
+}
+
+/// Read a song from a shared memory ring and write it out as an IMF file.
+int readShm(const std::string& strName, const std::string& strIMF,
+	const imf::OPTIONS& opt)
+{
+	try {
+		shm::reader ring(strName, 10000); // wait up to 10 seconds for the writer
+		imf::RECORDS records;
+		imf::writer w(records, opt.iSpeed);
+		shm::RECORD r;
+		uint32_t iTime = 0;
+		while (ring.read(r)) {
+			for (; r.iTime - iTime > 0xFFFF; iTime += 0xFFFF) w.setDelay(0xFFFF);
+			w.setDelay(r.iTime - iTime);
+			iTime = r.iTime;
+			w.setRegister(r.iRegister, r.iValue);
+		}
+		for (; ring.length() - iTime > 0xFFFF; iTime += 0xFFFF) w.setDelay(0xFFFF);
+		w.setDelay(ring.length() - iTime);
+		w.finish();
+
+		std::ofstream outfile(strIMF.c_str(), std::ios::out | std::ios::trunc | std::ios::binary);
+		if (!outfile.is_open()) throw std::ios::failure("Unable to create " + strIMF);
+		imf::write(outfile, records, opt.iType);
+		outfile.close();
+		if (outfile.fail()) throw std::ios::failure("Unable to write " + strIMF);
+		std::cout << "Wrote " << strIMF << std::endl;
+	} catch (std::ios::failure& e) {
+		std::cerr << "ERROR: " << e.what() << std::endl;
+		return 2;
+	}
+	return 0;
+}
+
+/// Number of records in the ring used by --shm-check.  Kept small so the
+/// writer keeps having to wait for the reader.
+#define SHM_CHECK_SLOTS 64
+
+/// Read a song from a shared memory ring and check it matches what was played.
+/**
+ * @return Exit code: 0 if it matches, 2 on error or 3 if it doesn't match.
+ */
+int compareShm(const std::string& strName, const std::vector<shm::RECORD>& expected,
+	uint32_t iLength)
+{
+	try {
+		shm::reader ring(strName, 10000);
+		shm::RECORD r;
+		size_t iCount = 0;
+		while (ring.read(r)) {
+			if ((iCount >= expected.size()) || (r.iTime != expected[iCount].iTime)
+				|| (r.iRegister != expected[iCount].iRegister)
+				|| (r.iValue != expected[iCount].iValue)
+			) {
+				std::cout << "  FAIL: write " << iCount << " is wrong (register 0x"
+					<< std::hex << (int)r.iRegister << " = 0x" << (int)r.iValue
+					<< " at " << std::dec << r.iTime << " ms)" << std::endl;
+				return 3;
+			}
+			iCount++;
+		}
+		if (iCount != expected.size()) {
+			std::cout << "  FAIL: only " << iCount << " of " << expected.size()
+				<< " writes arrived" << std::endl;
+			return 3;
+		}
+		if (ring.length() != iLength) {
+			std::cout << "  FAIL: song length is " << ring.length() << " ms instead of "
+				<< iLength << " ms" << std::endl;
+			return 3;
+		}
+	} catch (std::ios::failure& e) {
+		std::cerr << "ERROR: " << e.what() << std::endl;
+		return 2;
+	}
+	return 0;
+}
+
+/// Play a song through a shared memory ring to a reader in another process,
+/// and check every write arrives unchanged.
+int checkShm(const std::string& strName, const std::string& strFile,
+	const imf::OPTIONS& opt)
+{
+	try {
+		pack::mapping in(strFile);
+
+		// Work out what the reader should get
+		std::vector<shm::RECORD> expected;
+		uint32_t iLength = 0;
+		imf::source song(in.data(), in.size(), opt, NULL);
+		for (imf::source::iterator i = song.begin(); i != song.end(); ++i) {
+			if (i->iDelay) {
+				iLength += i->iDelay;
+			} else {
+				shm::RECORD r = {iLength, i->iRegister, i->iValue, 0};
+				expected.push_back(r);
+			}
+		}
+
+		shm::writer ring(strName, SHM_CHECK_SLOTS);
+		std::cout << "Checking " << strFile << " through " << strName
+			<< " with a " << SHM_CHECK_SLOTS << " record ring" << std::endl;
+
+		pid_t pid = fork();
+		if (pid < 0) throw std::ios::failure("Unable to start the reader process");
+		if (pid == 0) {
+			// The reader.  _exit() so the writer's destructor doesn't remove the
+			// ring out from under the parent.
+			int ret = compareShm(strName, expected, iLength);
+			std::cout.flush();
+			_exit(ret);
+		}
+
+		int iStatus = 0;
+		try {
+			playShm(ring, in, opt);
+		} catch (std::ios::failure& e) {
+			// The reader may have found a problem and given up, so see what it
+			// has to say first
+			waitpid(pid, &iStatus, 0);
+			if ((WIFEXITED(iStatus)) && (WEXITSTATUS(iStatus) == 3)) return 3;
+			throw;
+		}
+		waitpid(pid, &iStatus, 0);
+		if (!WIFEXITED(iStatus)) throw std::ios::failure("The reader process crashed");
+		if (WEXITSTATUS(iStatus) != 0) return WEXITSTATUS(iStatus);
+		std::cout << "  OK: " << expected.size() << " writes over " << iLength
+			<< " ms arrived unchanged" << std::endl;
+	} catch (std::ios::failure& e) {
+		std::cerr << "ERROR: " << e.what() << std::endl;
+		return 2;
+	}
+	return 0;
+}
+
+/// Change the speed of every IMF file in a pack.
+int retimePack(const std::string& strIn, const std::string& strOut, int iInType,
+	int iFromSpeed, int iToSpeed, int iOutType)
+{
+	try {
+		pack::mapping in(strIn);
+		std::vector<pack::ENTRY> entries;
+		pack::readEntries(in.data(), in.size(), entries);
+
+		pack::writer out(strOut);
+		std::string strIMF;
+		for (std::vector<pack::ENTRY>::iterator i = entries.begin(); i != entries.end(); i++) {
+			imf::retime(in.data() + i->iOffset, i->iLength, iInType, iFromSpeed,
+				iToSpeed, iOutType, strIMF);
+			out.add(i->strName, strIMF.data(), strIMF.length());
+		}
+		out.close();
+		std::cout << "Wrote " << entries.size() << " files to " << strOut << std::endl;
+	} catch (std::ios::failure& e) {
+		std::cerr << "ERROR: " << e.what() << std::endl;
+		return 2;
+	}
+	return 0;
+}
+
+/// Convert every CMF file in a pack, writing the IMF files into another pack.
+int convertPack(const std::string& strIn, const std::string& strOut,
+	const imf::OPTIONS& opt, cache::store *pCache)
+{
+	bool bCreated = false;
+	try {
+		pack::mapping in(strIn);
+		std::vector<pack::ENTRY> entries;
+		pack::readEntries(in.data(), in.size(), entries);
+
+		pack::writer out(strOut);
+		bCreated = true;
+		// Songs already converted in this batch, so duplicates are only
+		// converted once
+		std::map<std::string, std::string> converted;
+		unsigned int iHits = 0, iWritten = 0, iFailed = 0;
+		for (std::vector<pack::ENTRY>::iterator i = entries.begin(); i != entries.end(); i++) {
+			const char *pData = in.data() + i->iOffset;
+			std::string strKey = cache::store::key(pData, i->iLength, opt);
+			std::map<std::string, std::string>::iterator c = converted.find(strKey);
+			if (c == converted.end()) {
+				c = converted.insert(std::make_pair(strKey, std::string())).first;
+				if ((pCache) && (pCache->read(strKey, c->second))) {
+					iHits++;
+				} else {
+					std::cout << "Converting " << i->strName << std::endl;
+					try {
+						convertData(pData, i->iLength, c->second, opt);
+					} catch (std::ios::failure& e) {
+						// Leave this one out, but carry on with the rest
+						std::cerr << "ERROR: " << i->strName << ": " << e.what() << std::endl;
+						converted.erase(c);
+						iFailed++;
+						continue;
+					}
+					if (pCache) pCache->add(strKey, c->second);
+				}
+			} else {
+				iHits++;
+			}
+			out.add(imfName(i->strName), c->second.data(), c->second.length());
+			iWritten++;
+		}
+		out.close();
+		std::cout << "Wrote " << iWritten << " files to " << strOut
+			<< " (" << iHits << " reused without converting)" << std::endl;
+		if (iFailed) {
+			std::cerr << "ERROR: " << iFailed << " of " << entries.size()
+				<< " files could not be converted" << std::endl;
+			return 2;
+		}
+	} catch (std::ios::failure& e) {
+		// Don't leave half a pack behind
+		if (bCreated) unlink(strOut.c_str());
+		std::cerr << "ERROR: " << e.what() << std::endl;
+		return 2;
+	}
+	return 0;
+}
+
+/// Store a list of files in a new pack file.
+int createPack(const std::string& strOut, const std::vector<std::string>& files)
+{
+	try {
+		pack::writer out(strOut);
+		for (std::vector<std::string>::const_iterator i = files.begin(); i != files.end(); i++) {
+			pack::mapping in(*i);
+			std::string::size_type iSlash = i->rfind('/');
+			out.add((iSlash == std::string::npos) ? *i : i->substr(iSlash + 1),
+				in.data(), in.size());
+		}
+		out.close();
+		std::cout << "Wrote " << files.size() << " files to " << strOut << std::endl;
+	} catch (std::ios::failure& e) {
+		std::cerr << "ERROR: " << e.what() << std::endl;
+		return 2;
+	}
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
 	// Set a better exception handler
@@ -61,7 +662,39 @@ int main(int argc, char *argv[])
 	po::options_description poOptions("Options");
 	poOptions.add_options()
 		("speed,s", po::value<int>(), "speed in Hertz (280, 560, 700)")
-		("type,t",  po::value<int>(), "0 or 1 to create type-0 or type-1 IMF")
+		("type,t",  po::value<int>(), "0 or 1 to create type-0 or type-1 IMF (2 for type-1 with a 32-bit length)")
+		("split",   po::value<int>(), "split the song into files no bigger than this many bytes")
+		("timing",  po::value<std::string>(), "report how far the timing drifts at these speeds (e.g. 280,560,700) instead of converting")
+		("max-drift", po::value<double>(), "with --timing, fail if any note is further out than this many milliseconds")
+		("latency", "report how long the player takes over each event instead of converting")
+		("latency-budget", po::value<int>(), "with --latency, fail if the p99.9 time is over this many nanoseconds")
+		("latency-export", po::value<std::string>(), "with --latency, also write the results to this file as tab-separated values")
+		("engine-check", po::value<int>(), "check the engine for playing many songs at once against the normal player, and time it with this many copies of the song")
+		("shm",     po::value<std::string>(), "play the song into this shared memory ring (e.g. /cmf2imf) for another process")
+		("shm-read", po::value<std::string>(), "read a song from this shared memory ring and write it as an IMF file")
+		("shm-check", po::value<std::string>(), "play the song through this shared memory ring to a second process, and check it arrives unchanged")
+		("playlist", "convert all the files into one IMF, one song after the other")
+		("retime",  "input is an IMF file to change to --speed and --type")
+		("from-speed", po::value<int>(), "speed of the input IMF file for --retime")
+		("in-type", po::value<int>(), "type of the input IMF file for --retime (default: detect)")
+		("start",   po::value<int>(), "only convert from this time (in milliseconds)")
+		("end",     po::value<int>(), "stop converting at this time (in milliseconds)")
+		("bank,b",  po::value<std::string>(), "instruments (.ibk or .sbi) to use for MIDI files")
+		("alloc",   po::value<std::string>(), "voice allocation: greedy (default) or lookahead")
+		("prefetch", "load instruments early, while the channel is silent")
+		("format",  po::value<std::string>(), "output format: imf (default), loop (repeated sections stored once) or delta (compact encoding)")
+		("format-bench", "compare the size and decoding speed of each --format for one song instead of converting")
+		("decode",  "input is a file written with --format, to write out as an IMF file of --type")
+		("spread",  po::value<int>(), "move writes out of moments needing more than this many microseconds of OPL2 bus time")
+		("spread-tolerance", po::value<int>(), "furthest a write may move for --spread, in milliseconds (default 5)")
+		("bus-report", "report the OPL2 bus time needed by the busiest moments")
+		("pack,p",  "input and output files are pack files holding many songs")
+		("make-pack", po::value<std::string>(), "store the given files in a new pack file")
+		("server",  po::value<std::string>(), "run as a conversion server on this Unix socket")
+		("jobs,j",  po::value<int>(), "number of server threads (default: one per CPU), or convert one large song in this many segments at once")
+		("cache-dir", po::value<std::string>(), "reuse earlier conversions stored in this directory")
+		("cache-size", po::value<int>(), "maximum cache size in MB (default 256)")
+		("cache-age", po::value<int>(), "remove cached files unused for this many days (default 30)")
 	;
 
 	po::options_description poHidden("Hidden options");
@@ -98,76 +731,355 @@ int main(int argc, char *argv[])
 			"see <http://www.gnu.org/licenses/> for details.\n"
 			"\n"
 			"Utility to convert Creative Labs' CMF files into id Software's IMF format.\n"
+			"Standard MIDI files (type 0 and 1) can also be converted.\n"
 			"\n"
-			"Usage: cmf2imf -s <speed> -t <imftype> cmffile imffile\n\n" << poOptions
+			"Usage: cmf2imf -s <speed> -t <imftype> cmffile imffile\n"
+			"       cmf2imf -s <speed> -t <imftype> --pack cmfpack imfpack\n"
+			"       cmf2imf -s <speed> -t <imftype> --playlist song1.cmf song2.cmf ... imffile\n"
+			"       cmf2imf -s <speed> -t <imftype> --format loop cmffile outfile\n"
+			"       cmf2imf -t <imftype> --decode infile imffile\n"
+			"       cmf2imf -s <speed> -t <imftype> --format-bench cmffile\n"
+			"       cmf2imf --timing 280,560,700 [--max-drift <ms>] cmffile\n"
+			"       cmf2imf --latency [--latency-budget <ns>] cmffile\n"
+			"       cmf2imf -s <speed> --engine-check <songs> cmffile\n"
+			"       cmf2imf --shm /name cmffile\n"
+			"       cmf2imf -s <speed> -t <imftype> --shm-read /name imffile\n"
+			"       cmf2imf --shm-check /name cmffile\n"
+			"       cmf2imf --retime --from-speed <speed> -s <speed> -t <imftype> in.imf out.imf\n"
+			"       cmf2imf --make-pack cmfpack file1.cmf file2.cmf ...\n"
+			"       cmf2imf --server /path/to/socket [-j <threads>]\n\n" << poOptions
 			<< std::endl;
 		return 0;
 	}
 
-	if (vm.count("speed") == 0) { std::cerr << "ERROR: No --speed option given, use --help for usage info." << std::endl; return 1; }
-	if (vm.count("type")  == 0) { std::cerr << "ERROR: No --type option given, use --help for usage info."  << std::endl; return 1; }
+	if (vm.count("make-pack")) {
+		if (!vm.count("files")) {
+			std::cerr << "ERROR: No filenames given, use --help for usage info." << std::endl;
+			return 1;
+		}
+		return createPack(vm["make-pack"].as<std::string>(),
+			vm["files"].as< std::vector<std::string> >());
+	}
+
+	int jobs = vm.count("jobs") ? vm["jobs"].as<int>() : boost::thread::hardware_concurrency();
+	if (jobs < 1) jobs = 1;
+
+	if (vm.count("server")) {
+		try {
+			server::run(vm["server"].as<std::string>(), jobs);
+		} catch (std::ios::failure& e) {
+			std::cerr << "ERROR: " << e.what() << std::endl;
+			return 2;
+		}
+		return 0;
+	}
+
+	if (vm.count("timing")) {
+		if ((!vm.count("files")) || (vm["files"].as< std::vector<std::string> >().size() != 1)) {
+			std::cerr << "ERROR: --timing needs one input filename, use --help for usage info." << std::endl;
+			return 1;
+		}
+		imf::OPTIONS opt;
+		opt.iSpeed = 0;
+		opt.iType = 0;
+		opt.iStart = 0;
+		opt.iEnd = 0;
+		opt.pBank = NULL;
+		opt.bLookahead = false;
+		opt.bPrefetch = false;
+		opt.iBusBudget = 0;
+		opt.iBusTolerance = 0;
+		imf::BANK bank;
+		try {
+			if (vm.count("bank")) {
+				pack::mapping bankFile(vm["bank"].as<std::string>());
+				smf::readBank(bankFile.data(), bankFile.size(), bank);
+				opt.pBank = &bank;
+			}
+			return reportTiming(vm["files"].as< std::vector<std::string> >()[0],
+				vm["timing"].as<std::string>(), opt,
+				vm.count("max-drift") ? vm["max-drift"].as<double>() : 0);
+		} catch (std::ios::failure& e) {
+			std::cerr << "ERROR: " << e.what() << std::endl;
+			return 2;
+		}
+	}
+
+	if (vm.count("latency")) {
+		if ((!vm.count("files")) || (vm["files"].as< std::vector<std::string> >().size() != 1)) {
+			std::cerr << "ERROR: --latency needs one input filename, use --help for usage info." << std::endl;
+			return 1;
+		}
+		imf::OPTIONS opt;
+		opt.iSpeed = 0;
+		opt.iType = 0;
+		opt.iStart = 0;
+		opt.iEnd = 0;
+		opt.pBank = NULL;
+		opt.bLookahead = (vm.count("alloc"))
+			&& (vm["alloc"].as<std::string>().compare("lookahead") == 0);
+		opt.bPrefetch = false;
+		opt.iBusBudget = 0;
+		opt.iBusTolerance = 0;
+		imf::BANK bank;
+		try {
+			if (vm.count("bank")) {
+				pack::mapping bankFile(vm["bank"].as<std::string>());
+				smf::readBank(bankFile.data(), bankFile.size(), bank);
+				opt.pBank = &bank;
+			}
+			return reportLatency(vm["files"].as< std::vector<std::string> >()[0], opt,
+				vm.count("latency-budget") ? vm["latency-budget"].as<int>() : 0,
+				vm.count("latency-export") ? vm["latency-export"].as<std::string>() : "");
+		} catch (std::ios::failure& e) {
+			std::cerr << "ERROR: " << e.what() << std::endl;
+			return 2;
+		}
+	}
+
+	if (vm.count("engine-check")) {
+		if ((!vm.count("files")) || (vm["files"].as< std::vector<std::string> >().size() != 1)) {
+			std::cerr << "ERROR: --engine-check needs one input filename, use --help for usage info." << std::endl;
+			return 1;
+		}
+		int iSpeed = vm.count("speed") ? vm["speed"].as<int>() : 0;
+		int iSongs = vm["engine-check"].as<int>();
+		if ((iSpeed <= 0) || (iSongs < 1) || (iSongs > 0x10000)) {
+			std::cerr << "ERROR: --engine-check needs a --speed and between 1 and "
+				"65536 songs, use --help for usage info." << std::endl;
+			return 1;
+		}
+		try {
+			pack::mapping in(vm["files"].as< std::vector<std::string> >()[0]);
+			cmf::ENGINECHECK result;
+			cmf::checkEngine(in.data(), in.size(), iSpeed, iSongs, result);
+			return cmf::printEngineCheck(std::cout, result) ? 0 : 3;
+		} catch (std::ios::failure& e) {
+			std::cerr << "ERROR: " << e.what() << std::endl;
+			return 2;
+		}
+	}
+
+	// Songs played into shared memory keep their delays in milliseconds, so
+	// there's no IMF speed or type
+	bool bIMF = !vm.count("shm") && !vm.count("shm-check");
+	if ((bIMF) && (!vm.count("decode")) && (vm.count("speed") == 0)) { std::cerr << "ERROR: No --speed option given, use --help for usage info." << std::endl; return 1; }
+	if ((bIMF) && (vm.count("type")  == 0)) { std::cerr << "ERROR: No --type option given, use --help for usage info."  << std::endl; return 1; }
 
 	if (!vm.count("files")) {
 		std::cerr << "ERROR: No filenames given, use --help for usage info." << std::endl;
 		return 1;
 	}
 
+	// --shm and --shm-check have no output file and --shm-read has no input file
 	const std::vector<std::string>& files = vm["files"].as< std::vector<std::string> >();
-	if (files.size() == 1) {
+	size_t iNumFiles = (vm.count("shm") || vm.count("shm-read")
+		|| vm.count("shm-check") || vm.count("format-bench")) ? 1 : 2;
+	if (files.size() < iNumFiles) {
 		std::cerr << "ERROR: No output IMF filename given, use --help for usage info." << std::endl;
 		return 1;
-	} else if (files.size() != 2) {
+	} else if ((files.size() != iNumFiles) && (!vm.count("playlist"))) {
 		std::cerr << "ERROR: Too many filenames given, use --help for usage info." << std::endl;
 		return 1;
 	}
 
-	int type = vm["type"].as<int>();
-
-	std::cout << "Opening " << files[0] << std::endl;
+	int type = vm.count("type") ? vm["type"].as<int>() : 0;
+	if ((type < 0) || (type > 2)) {
+		std::cerr << "ERROR: Invalid --type, use --help for usage info." << std::endl;
+		return 1;
+	}
+	int split = vm.count("split") ? vm["split"].as<int>() : 0;
+	if ((split < 0) || ((split) && (vm.count("pack")))) {
+		std::cerr << "ERROR: Invalid --split size (or used with --pack), use --help for usage info." << std::endl;
+		return 1;
+	}
+	int start = vm.count("start") ? vm["start"].as<int>() : 0;
+	int end = vm.count("end") ? vm["end"].as<int>() : 0;
+	if ((start < 0) || (end < 0) || ((end) && (end <= start))) {
+		std::cerr << "ERROR: Invalid --start/--end range, use --help for usage info." << std::endl;
+		return 1;
+	}
 
-	std::fstream infile(files[0].c_str(), std::ios::in | std::ios::binary);
-	std::fstream outfile(files[1].c_str(), std::ios::out | std::ios::trunc | std::ios::binary);
+	if (vm.count("retime")) {
+		if (!vm.count("from-speed")) {
+			std::cerr << "ERROR: No --from-speed option given, use --help for usage info." << std::endl;
+			return 1;
+		}
+		int iFromSpeed = vm["from-speed"].as<int>();
+		int iToSpeed = vm["speed"].as<int>();
+		int iInType = vm.count("in-type") ? vm["in-type"].as<int>() : -1;
+		if ((iInType < -1) || (iInType > 2)) {
+			std::cerr << "ERROR: Invalid --in-type, use --help for usage info." << std::endl;
+			return 1;
+		}
+		if (vm.count("pack")) {
+			return retimePack(files[0], files[1], iInType, iFromSpeed, iToSpeed, type);
+		}
+		try {
+			pack::mapping in(files[0]);
+			std::string strIMF;
+			imf::retime(in.data(), in.size(), iInType, iFromSpeed, iToSpeed, type, strIMF);
+			std::ofstream outfile(files[1].c_str(), std::ios::out | std::ios::trunc | std::ios::binary);
+			if (!outfile.is_open()) throw std::ios::failure("Unable to create " + files[1]);
+			outfile.write(strIMF.data(), strIMF.length());
+			outfile.close();
+			if (outfile.fail()) throw std::ios::failure("Unable to write " + files[1]);
+			std::cout << "Wrote " << files[1] << std::endl;
+		} catch (std::ios::failure& e) {
+			std::cerr << "ERROR: " << e.what() << std::endl;
+			return 2;
+		}
+		return 0;
+	}
 
-	uint16_t delay = 0;
-	cmf::FN_SETREGISTER fnSetReg = boost::bind<void>(setRegister,
-		_1,
-		_2,
-		&delay,
-		boost::ref(outfile),
-		vm["speed"].as<int>()
-	);
-	cmf::FN_DELAY fnDelay = boost::bind<void>(setDelay,
-		_1,
-		&delay
-	);
+	imf::OPTIONS opt;
+	opt.iSpeed = vm.count("speed") ? vm["speed"].as<int>() : 0;
+	opt.iType = type;
+	opt.iStart = start;
+	opt.iEnd = end;
+	opt.pBank = NULL;
+	opt.bLookahead = false;
+	opt.bPrefetch = vm.count("prefetch") > 0;
+	opt.iBusBudget = 0;
+	opt.iBusTolerance = 0;
+	if (vm.count("spread")) {
+		int iBudget = vm["spread"].as<int>();
+		int iTolerance = vm.count("spread-tolerance") ? vm["spread-tolerance"].as<int>() : 5;
+		if ((iBudget < 1) || (iTolerance < 0)) {
+			std::cerr << "ERROR: Invalid --spread or --spread-tolerance time, use "
+				"--help for usage info." << std::endl;
+			return 1;
+		}
+		opt.iBusBudget = iBudget;
+		opt.iBusTolerance = iTolerance;
+	}
+	bool bBusReport = vm.count("bus-report") > 0;
+	if (vm.count("alloc")) {
+		const std::string& strAlloc = vm["alloc"].as<std::string>();
+		if (strAlloc.compare("lookahead") == 0) opt.bLookahead = true;
+		else if (strAlloc.compare("greedy") != 0) {
+			std::cerr << "ERROR: Invalid --alloc mode, use --help for usage info." << std::endl;
+			return 1;
+		}
+	}
 
-	// Insert some bytes to update later with the file length
-	if (type == 1) outfile << u16le(0);
+	imf::BANK bank;
+	if (vm.count("bank")) {
+		try {
+			pack::mapping bankFile(vm["bank"].as<std::string>());
+			smf::readBank(bankFile.data(), bankFile.size(), bank);
+		} catch (std::ios::failure& e) {
+			std::cerr << "ERROR: " << e.what() << std::endl;
+			return 2;
+		}
+		opt.pBank = &bank;
+	}
 
-	// Initial bytes
-	outfile << u16le(0);
+	cache::store *pCache = NULL;
+	if (vm.count("cache-dir")) {
+		try {
+			pCache = new cache::store(vm["cache-dir"].as<std::string>());
+		} catch (std::ios::failure& e) {
+			std::cerr << "ERROR: " << e.what() << std::endl;
+			return 2;
+		}
+	}
 
-	try {
-		cmf::player p(infile, fnSetReg, fnDelay);
-		p.init();
-		while (p.tick()) { } ;
-	} catch (std::ios::failure& e) {
-		std::cerr << "ERROR: " << e.what() << std::endl;
-		return 2;
+	std::string strFormat = vm.count("format") ? vm["format"].as<std::string>() : "imf";
+	if ((strFormat.compare("imf") != 0) && (strFormat.compare("loop") != 0)
+		&& (strFormat.compare("delta") != 0)
+	) {
+		std::cerr << "ERROR: Invalid --format, use --help for usage info." << std::endl;
+		return 1;
+	}
+	if ((strFormat.compare("imf") != 0) && ((vm.count("pack")) || (split)
+		|| (vm.count("shm")) || (vm.count("shm-read")) || (vm.count("shm-check")))
+	) {
+		std::cerr << "ERROR: --format can't be used with --pack, --split, --shm, "
+			"--shm-read or --shm-check." << std::endl;
+		return 1;
 	}
 
-	// Last delay in the file
-	outfile << u16le(delay);
+	int ret = 0;
+	if (vm.count("decode")) {
+		try {
+			decodeFile(files[0], files[1], type);
+		} catch (std::ios::failure& e) {
+			std::cerr << "ERROR: " << e.what() << std::endl;
+			ret = 2;
+		}
+	} else if (vm.count("format-bench")) {
+		try {
+			ret = benchFormats(files[0], opt);
+		} catch (std::ios::failure& e) {
+			std::cerr << "ERROR: " << e.what() << std::endl;
+			ret = 2;
+		}
+	} else if (vm.count("playlist")) {
+		if ((vm.count("pack")) || (split) || (start) || (end)) {
+			std::cerr << "ERROR: --playlist can't be used with --pack, --split, "
+				"--start or --end." << std::endl;
+			ret = 1;
+		} else {
+			try {
+				convertPlaylist(files, opt, strFormat);
+			} catch (std::ios::failure& e) {
+				std::cerr << "ERROR: " << e.what() << std::endl;
+				ret = 2;
+			}
+		}
+	} else if (vm.count("shm")) {
+		ret = writeShm(vm["shm"].as<std::string>(), files[0], opt);
+	} else if (vm.count("shm-read")) {
+		ret = readShm(vm["shm-read"].as<std::string>(), files[0], opt);
+	} else if (vm.count("shm-check")) {
+		ret = checkShm(vm["shm-check"].as<std::string>(), files[0], opt);
+	} else if (vm.count("pack")) {
+		ret = convertPack(files[0], files[1], opt, pCache);
+	} else if (split) {
+		std::cout << "Opening " << files[0] << std::endl;
+		try {
+			pack::mapping in(files[0]);
+			convertSplit(in.data(), in.size(), files[1], opt, split);
+		} catch (std::ios::failure& e) {
+			std::cerr << "ERROR: " << e.what() << std::endl;
+			ret = 2;
+		}
+	} else {
+		std::cout << "Opening " << files[0] << std::endl;
+		try {
+			pack::mapping in(files[0]);
+			std::string strKey;
+			if (pCache) strKey = cache::store::key(in.data(), in.size(), opt);
+			if (strFormat.compare("imf") != 0) strKey += "-" + strFormat;
+			if ((pCache) && (!bBusReport) && (pCache->fetch(strKey, files[1]))) {
+				std::cout << "Reused cached conversion" << std::endl;
+			} else {
+				std::string strIMF;
+				// Only split the song into segments when asked to
+				convertData(in.data(), in.size(), strIMF, opt,
+					vm.count("jobs") ? jobs : 1, bBusReport, strFormat);
 
-	if (type == 1) {
-		// Update the file length at the start
-		uint16_t size = outfile.tellp();
-		size -= 2; // don't count field itself
-		std::cout << "Updating type-1 header to file size " << size << std::endl;
-		outfile.seekp(0, std::ios::beg);
-		outfile << u16le(size);
+				std::ofstream outfile(files[1].c_str(), std::ios::out | std::ios::trunc | std::ios::binary);
+				if (!outfile.is_open()) throw std::ios::failure("Unable to create " + files[1]);
+				outfile.write(strIMF.data(), strIMF.length());
+				outfile.close();
+				if (outfile.fail()) throw std::ios::failure("Unable to write " + files[1]);
+
+				if (pCache) pCache->add(strKey, strIMF);
+			}
+			std::cout << "Wrote " << files[1] << std::endl;
+		} catch (std::ios::failure& e) {
+			std::cerr << "ERROR: " << e.what() << std::endl;
+			ret = 2;
+		}
 	}
 
-	std::cout << "Wrote " << files[1] << std::endl;
-	return 0;
+	if (pCache) {
+		int iMaxSize = vm.count("cache-size") ? vm["cache-size"].as<int>() : 256;
+		int iMaxAge = vm.count("cache-age") ? vm["cache-age"].as<int>() : 30;
+		pCache->evict((uint64_t)iMaxSize << 20, (time_t)iMaxAge * 24 * 60 * 60);
+		delete pCache;
+	}
+	return ret;
 }
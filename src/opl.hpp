@@ -0,0 +1,41 @@
+/*
+ * CMF2IMF - convert CMF files into id Software IMF files
+ * Copyright (C) 2005-2010 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef OPL_HPP_
+#define OPL_HPP_
+
+// OPL register offsets
+#define BASE_CHAR_MULT  0x20
+#define BASE_SCAL_LEVL  0x40
+#define BASE_ATCK_DCAY  0x60
+#define BASE_SUST_RLSE  0x80
+#define BASE_FNUM_L     0xA0
+#define BASE_KEYON_FREQ 0xB0
+#define BASE_RHYTHM     0xBD
+#define BASE_WAVE       0xE0
+#define BASE_FEED_CONN  0xC0
+
+#define OPLBIT_KEYON    0x20 // Bit in BASE_KEYON_FREQ register for turning a note on
+
+// Supplied with a channel, return the offset from a base OPL register for the
+// Modulator cell (e.g. channel 4's modulator is at offset 0x09.  Since 0x60 is
+// the attack/decay function, register 0x69 will thus set the attack/decay for
+// channel 4's modulator.)  (channels go from 0 to 8 inclusive)
+#define OPLOFFSET(channel)   (((channel) / 3) * 8 + ((channel) % 3))
+
+#endif // OPL_HPP_
@@ -0,0 +1,207 @@
+/*
+ * CMF2IMF - convert CMF files into id Software IMF files
+ * Copyright (C) 2010 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <camoto/iostream_helpers.hpp>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "pack.hpp"
+
+namespace pack {
+
+using namespace camoto;
+
+#define PACK_SIG "CIPK"
+#define PACK_HEADER_LEN 12
+
+mapping::mapping(const std::string& strFilename)
+	throw (std::ios::failure) :
+	pData(NULL),
+	iSize(0)
+{
+	int fd = open(strFilename.c_str(), O_RDONLY);
+	if (fd < 0) throw std::ios::failure("Unable to open " + strFilename);
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		throw std::ios::failure("Unable to get the size of " + strFilename);
+	}
+	this->iSize = st.st_size;
+	if (this->iSize) {
+		void *p = mmap(NULL, this->iSize, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED) {
+			close(fd);
+			throw std::ios::failure("Unable to map " + strFilename + " into memory");
+		}
+		// We'll be reading straight through the file
+		madvise(p, this->iSize, MADV_SEQUENTIAL);
+		this->pData = (const char *)p;
+	}
+	close(fd); // the mapping stays valid
+}
+
+mapping::~mapping()
+	throw ()
+{
+	if (this->pData) munmap((void *)this->pData, this->iSize);
+}
+
+const char *mapping::data() const
+	throw ()
+{
+	return this->pData;
+}
+
+size_t mapping::size() const
+	throw ()
+{
+	return this->iSize;
+}
+
+membuf::membuf(const char *pData, size_t iSize)
+	throw ()
+{
+	char *p = const_cast<char *>(pData); // never written to
+	this->setg(p, p, p + iSize);
+}
+
+membuf::pos_type membuf::seekoff(off_type off, std::ios_base::seekdir way,
+	std::ios_base::openmode which)
+{
+	if (!(which & std::ios_base::in)) return pos_type(off_type(-1));
+	char *pTarget;
+	switch (way) {
+		case std::ios_base::beg: pTarget = this->eback() + off; break;
+		case std::ios_base::cur: pTarget = this->gptr() + off; break;
+		case std::ios_base::end: pTarget = this->egptr() + off; break;
+		default: return pos_type(off_type(-1));
+	}
+	if ((pTarget < this->eback()) || (pTarget > this->egptr())) return pos_type(off_type(-1));
+	this->setg(this->eback(), pTarget, this->egptr());
+	return pos_type(pTarget - this->eback());
+}
+
+membuf::pos_type membuf::seekpos(pos_type pos, std::ios_base::openmode which)
+{
+	return this->seekoff(off_type(pos), std::ios_base::beg, which);
+}
+
+static uint32_t readU32(const char *p)
+{
+	const uint8_t *b = (const uint8_t *)p;
+	return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+void readEntries(const char *pData, size_t iSize, std::vector<ENTRY>& entries)
+	throw (std::ios::failure)
+{
+	if ((iSize < PACK_HEADER_LEN) || (memcmp(pData, PACK_SIG, 4) != 0)) {
+		throw std::ios::failure("Input file is not a pack file! (" PACK_SIG " header missing)");
+	}
+	uint32_t iCount = readU32(pData + 4);
+	uint32_t iTable = readU32(pData + 8);
+
+	if (iTable > iSize) throw std::ios::failure("Pack file table is missing");
+
+	// Don't trust the count until the table has been read, but every entry
+	// takes at least nine bytes so it can't be more than that.
+	entries.clear();
+	entries.reserve(std::min<size_t>(iCount, (iSize - iTable) / 9));
+	size_t iPos = iTable;
+	for (uint32_t i = 0; i < iCount; i++) {
+		if (iPos + 9 > iSize) throw std::ios::failure("Pack file table is truncated");
+		ENTRY e;
+		e.iOffset = readU32(pData + iPos);
+		e.iLength = readU32(pData + iPos + 4);
+		uint8_t iNameLen = pData[iPos + 8];
+		iPos += 9;
+		if (iPos + iNameLen > iSize) throw std::ios::failure("Pack file table is truncated");
+		e.strName.assign(pData + iPos, iNameLen);
+		iPos += iNameLen;
+		if (((uint64_t)e.iOffset + e.iLength) > iSize) {
+			throw std::ios::failure("Pack file entry " + e.strName + " runs past the end of the file");
+		}
+		entries.push_back(e);
+	}
+	return;
+}
+
+writer::writer(const std::string& strFilename)
+	throw (std::ios::failure) :
+	iOffset(PACK_HEADER_LEN)
+{
+	// Use a large buffer so the data goes out in big sequential writes
+	this->file.rdbuf()->pubsetbuf(this->cBuffer, sizeof(this->cBuffer));
+	this->file.open(strFilename.c_str(), std::ios::out | std::ios::trunc | std::ios::binary);
+	if (!this->file.is_open()) throw std::ios::failure("Unable to create " + strFilename);
+	this->file.exceptions(std::ios::badbit | std::ios::failbit);
+
+	// Placeholder header, filled in by close()
+	char cHeader[PACK_HEADER_LEN];
+	memset(cHeader, 0, sizeof(cHeader));
+	this->file.write(cHeader, sizeof(cHeader));
+}
+
+void writer::add(const std::string& strName, const char *pData, size_t iLength)
+	throw (std::ios::failure)
+{
+	if (strName.length() > 255) throw std::ios::failure("Filename too long for pack file: " + strName);
+	if ((uint64_t)this->iOffset + iLength > 0xFFFFFFFF) {
+		throw std::ios::failure("Pack file would be over 4GB with " + strName);
+	}
+	ENTRY e;
+	e.iOffset = this->iOffset;
+	e.iLength = iLength;
+	e.strName = strName;
+	this->entries.push_back(e);
+	this->file.write(pData, iLength);
+	this->iOffset += iLength;
+	return;
+}
+
+void writer::close()
+	throw (std::ios::failure)
+{
+	uint32_t iTable = this->iOffset;
+	for (std::vector<ENTRY>::iterator i = this->entries.begin(); i != this->entries.end(); i++) {
+		uint8_t iNameLen = i->strName.length();
+		this->file
+			<< u32le(i->iOffset)
+			<< u32le(i->iLength)
+			<< u8(iNameLen)
+		;
+		this->file.write(i->strName.data(), iNameLen);
+	}
+
+	uint32_t iCount = this->entries.size();
+	this->file.seekp(0, std::ios::beg);
+	this->file.write(PACK_SIG, 4);
+	this->file
+		<< u32le(iCount)
+		<< u32le(iTable)
+	;
+	this->file.close();
+	return;
+}
+
+} // namespace pack
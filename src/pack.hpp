@@ -0,0 +1,121 @@
+/*
+ * CMF2IMF - convert CMF files into id Software IMF files
+ * Copyright (C) 2010 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Pack files hold many small files in one, so large collections of songs
+ * can be converted without opening thousands of individual files.
+ *
+ * Layout (all values little-endian):
+ *
+ *   char[4]  "CIPK" signature
+ *   uint32   number of files
+ *   uint32   offset of the file table
+ *   ...      file data
+ *   file table, one entry per file:
+ *     uint32   offset of the file data
+ *     uint32   length of the file data
+ *     uint8    length of the filename
+ *     char[]   filename (not NULL-terminated)
+ */
+
+#ifndef PACK_HPP_
+#define PACK_HPP_
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace pack {
+
+/// Read-only memory mapping of an entire file
+class mapping {
+	private:
+		const char *pData;
+		size_t iSize;
+
+	public:
+		/// Map the given file into memory.
+		mapping(const std::string& strFilename)
+			throw (std::ios::failure);
+		~mapping()
+			throw ();
+
+		const char *data() const
+			throw ();
+		size_t size() const
+			throw ();
+
+	private:
+		mapping(const mapping&);
+		mapping& operator=(const mapping&);
+};
+
+/// Stream buffer reading from a block of memory, so a std::istream can be
+/// used on mapped data without copying it.
+class membuf: public std::streambuf {
+	public:
+		membuf(const char *pData, size_t iSize)
+			throw ();
+
+	protected:
+		virtual pos_type seekoff(off_type off, std::ios_base::seekdir way,
+			std::ios_base::openmode which = std::ios_base::in | std::ios_base::out);
+		virtual pos_type seekpos(pos_type pos,
+			std::ios_base::openmode which = std::ios_base::in | std::ios_base::out);
+};
+
+/// A single file inside a pack
+typedef struct {
+	uint32_t iOffset;
+	uint32_t iLength;
+	std::string strName;
+} ENTRY;
+
+/// Read the file table out of a (mapped) pack file.
+/**
+ * @param pData Start of the pack data.
+ * @param iSize Length of the pack data.
+ * @param entries Filled with one entry per file.
+ */
+void readEntries(const char *pData, size_t iSize, std::vector<ENTRY>& entries)
+	throw (std::ios::failure);
+
+/// Create a new pack file, appending each file in large sequential writes.
+class writer {
+	private:
+		std::ofstream file;
+		std::vector<ENTRY> entries;
+		uint32_t iOffset;  // Where the next file will be written
+		char cBuffer[1 << 20];
+
+	public:
+		writer(const std::string& strFilename)
+			throw (std::ios::failure);
+
+		/// Append a file to the pack.
+		void add(const std::string& strName, const char *pData, size_t iLength)
+			throw (std::ios::failure);
+
+		/// Write out the file table and close the file.
+		void close()
+			throw (std::ios::failure);
+};
+
+} // namespace pack
+
+#endif // PACK_HPP_
@@ -0,0 +1,417 @@
+/*
+ * CMF2IMF - convert CMF files into id Software IMF files
+ * Copyright (C) 2010 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iomanip>
+#include <map>
+#include <vector>
+#include <string.h>
+
+#include "opl.hpp"
+#include "schedule.hpp"
+
+namespace schedule {
+
+/// One register write
+typedef struct {
+	uint8_t iRegister;
+	uint8_t iValue;
+} WRITE;
+
+/// Register writes grouped by the time they happen, in IMF ticks
+typedef std::map<uint32_t, std::vector<WRITE> > TIMELINE;
+
+/// Operators (two per channel, modulator first) affected by writing to an
+/// instrument register, as a bitfield.  0 if it isn't an instrument register.
+static uint32_t instrumentOperators(uint8_t iRegister)
+{
+	if ((iRegister >= BASE_FEED_CONN) && (iRegister <= BASE_FEED_CONN + 8)) {
+		return 3 << ((iRegister - BASE_FEED_CONN) * 2);
+	}
+	int iOffset;
+	if ((iRegister >= BASE_CHAR_MULT) && (iRegister < BASE_FNUM_L)) {
+		iOffset = iRegister & 0x1F;
+	} else if (iRegister >= BASE_WAVE) {
+		iOffset = iRegister - BASE_WAVE;
+	} else {
+		return 0;
+	}
+	// Offsets 0-5, 8-13 and 16-21: three modulators followed by three carriers
+	int iWithin = iOffset % 8;
+	if ((iWithin > 5) || (iOffset > 21)) return 0;
+	int iChannel = (iOffset / 8) * 3 + (iWithin % 3);
+	int iOperator = iWithin / 3;
+	return 1 << (iChannel * 2 + iOperator);
+}
+
+/// Which operators are currently sounding, as a bitfield.
+static uint32_t activeOperators(const uint8_t *iRegs)
+{
+	uint32_t iActive = 0;
+	for (int i = 0; i < 9; i++) {
+		if (iRegs[BASE_KEYON_FREQ + i] & OPLBIT_KEYON) iActive |= 3 << (i * 2);
+	}
+	uint8_t iRhythm = iRegs[BASE_RHYTHM];
+	if (iRhythm & 0x20) {
+		if (iRhythm & 0x10) iActive |= 3 << (6 * 2); // bass drum, both operators
+		if (iRhythm & 0x01) iActive |= 1 << (7 * 2);     // hihat, ch 8 modulator
+		if (iRhythm & 0x08) iActive |= 1 << (7 * 2 + 1); // snare, ch 8 carrier
+		if (iRhythm & 0x04) iActive |= 1 << (8 * 2);     // tom tom, ch 9 modulator
+		if (iRhythm & 0x02) iActive |= 1 << (8 * 2 + 1); // cymbal, ch 9 carrier
+	}
+	return iActive;
+}
+
+/// Turn a timeline back into records.
+/**
+ * @param iEnd Length of the song, in IMF ticks.
+ */
+static void toRecords(const TIMELINE& timeline, uint32_t iEnd,
+	imf::RECORDS& records)
+{
+	records.clear();
+	for (TIMELINE::const_iterator t = timeline.begin(); t != timeline.end(); t++) {
+		for (std::vector<WRITE>::const_iterator w = t->second.begin(); w != t->second.end(); w++) {
+			imf::RECORD r = {w->iRegister, w->iValue, 0};
+			records.push_back(r);
+		}
+		TIMELINE::const_iterator next = t;
+		next++;
+		records.back().iDelay = ((next == timeline.end()) ? iEnd : next->first) - t->first;
+	}
+	return;
+}
+
+unsigned int prefetch(imf::RECORDS& records)
+	throw ()
+{
+	if (records.empty()) return 0;
+
+	TIMELINE out;
+	uint8_t iRegs[256];
+	uint32_t iLastWrite[256];  // Time of the last write to each register
+	uint32_t iSilentSince[18]; // Time each operator was last keyed off
+	memset(iRegs, 0, sizeof(iRegs));
+	memset(iLastWrite, 0, sizeof(iLastWrite));
+	memset(iSilentSince, 0, sizeof(iSilentSince));
+	uint32_t iActive = 0;
+	unsigned int iMoved = 0;
+
+	uint32_t iTime = 0;
+	for (imf::RECORDS::const_iterator i = records.begin(); i != records.end(); i++) {
+		WRITE w = {i->iRegister, i->iValue};
+		uint32_t iOperators = instrumentOperators(w.iRegister);
+		uint32_t iTarget = iTime;
+		if ((iOperators) && (!(iActive & iOperators))) {
+			// The operators are silent, so this write can go anywhere after they
+			// were keyed off (as long as it stays after the last write to the
+			// same register.)
+			uint32_t iEarliest = iLastWrite[w.iRegister];
+			for (int o = 0; o < 18; o++) {
+				if ((iOperators & (1 << o)) && (iSilentSince[o] > iEarliest)) {
+					iEarliest = iSilentSince[o];
+				}
+			}
+			if ((iTime > PREFETCH_MAX_TICKS) && (iEarliest < iTime - PREFETCH_MAX_TICKS)) {
+				iEarliest = iTime - PREFETCH_MAX_TICKS;
+			}
+
+			// Find the quietest moment, nearest the note if there's a tie
+			size_t iLeast = (size_t)-1;
+			for (uint32_t t = iTime; t-- > iEarliest; ) {
+				TIMELINE::const_iterator n = out.find(t);
+				size_t iLoad = (n == out.end()) ? 0 : n->second.size();
+				if (iLoad < iLeast) {
+					iLeast = iLoad;
+					iTarget = t;
+					if (iLoad == 0) break;
+				}
+			}
+			if (iTarget != iTime) iMoved++;
+		}
+		// Moved writes go last, after anything (e.g. a key-off) already there
+		out[iTarget].push_back(w);
+
+		iLastWrite[w.iRegister] = iTime;
+		iRegs[w.iRegister] = w.iValue;
+		if (((w.iRegister >= BASE_KEYON_FREQ) && (w.iRegister <= BASE_KEYON_FREQ + 8))
+			|| (w.iRegister == BASE_RHYTHM)
+		) {
+			uint32_t iNow = activeOperators(iRegs);
+			uint32_t iStopped = iActive & ~iNow;
+			for (int o = 0; o < 18; o++) {
+				if (iStopped & (1 << o)) iSilentSince[o] = iTime;
+			}
+			iActive = iNow;
+		}
+		iTime += i->iDelay;
+	}
+
+	toRecords(out, iTime, records);
+	return iMoved;
+}
+
+unsigned int peakWrites(const imf::RECORDS& records)
+	throw ()
+{
+	unsigned int iPeak = 0, iCount = 0;
+	bool bStarted = false; // skip the chip setup before the first delay
+	for (imf::RECORDS::const_iterator i = records.begin(); i != records.end(); i++) {
+		iCount++;
+		if (i->iDelay) {
+			if ((bStarted) && (iCount > iPeak)) iPeak = iCount;
+			bStarted = true;
+			iCount = 0;
+		}
+	}
+	if (iCount > iPeak) iPeak = iCount;
+	return iPeak;
+}
+
+void busCost(const imf::RECORDS& records, int iSpeed, unsigned long iBudgetNS,
+	BUSREPORT& report)
+	throw ()
+{
+	report.iTickNS = iSpeed ? 1000000000UL / iSpeed : 0;
+	report.iBudgetNS = iBudgetNS ? iBudgetNS : report.iTickNS;
+	report.iSetupWrites = 0;
+	report.iPeakWrites = 0;
+	report.iPeakTime = 0;
+	report.iMoments = 0;
+	report.iOverBudget = 0;
+
+	unsigned int iCount = 0;
+	uint32_t iTime = 0;
+	bool bStarted = false; // the chip setup is counted separately
+	for (imf::RECORDS::const_iterator i = records.begin(); i != records.end(); i++) {
+		iCount++;
+		if ((!i->iDelay) && (i + 1 != records.end())) continue;
+
+		// End of a moment
+		if (!bStarted) {
+			report.iSetupWrites = iCount;
+			bStarted = true;
+		} else {
+			report.iMoments++;
+			if (iCount > report.iPeakWrites) {
+				report.iPeakWrites = iCount;
+				report.iPeakTime = iTime;
+			}
+			if (iCount * BUS_WRITE_NS > report.iBudgetNS) report.iOverBudget++;
+		}
+		iTime += i->iDelay;
+		iCount = 0;
+	}
+	report.iPeakNS = (unsigned long)report.iPeakWrites * BUS_WRITE_NS;
+	return;
+}
+
+void printBusCost(std::ostream& out, const BUSREPORT& report)
+	throw ()
+{
+	double dPercent = report.iTickNS ? report.iPeakNS * 100.0 / report.iTickNS : 0;
+	out << std::dec << std::fixed << std::setprecision(1)
+		<< "OPL2 bus time: " << (BUS_WRITE_NS / 1000.0) << " us per register write\n"
+		<< "  Chip setup:      " << report.iSetupWrites << " writes, "
+		<< (report.iSetupWrites * (BUS_WRITE_NS / 1000.0)) << " us\n"
+		<< "  Busiest moment:  " << report.iPeakWrites << " writes at tick "
+		<< report.iPeakTime << ", " << (report.iPeakNS / 1000.0) << " us ("
+		<< dPercent << "% of a " << (report.iTickNS / 1000.0) << " us tick)\n"
+		<< "  Over " << (report.iBudgetNS / 1000.0) << " us: " << report.iOverBudget
+		<< " of " << report.iMoments << " moments\n";
+	out.unsetf(std::ios::floatfield);
+	out << std::flush;
+	return;
+}
+
+/// Channels affected by writing to a register, as a bitfield.
+static uint32_t registerChannels(uint8_t iRegister)
+{
+	if ((iRegister >= BASE_FNUM_L) && (iRegister <= BASE_FNUM_L + 8)) {
+		return 1 << (iRegister - BASE_FNUM_L);
+	}
+	if ((iRegister >= BASE_KEYON_FREQ) && (iRegister <= BASE_KEYON_FREQ + 8)) {
+		return 1 << (iRegister - BASE_KEYON_FREQ);
+	}
+	if (iRegister == BASE_RHYTHM) return 7 << 6; // the percussion channels
+	uint32_t iOperators = instrumentOperators(iRegister);
+	uint32_t iChannels = 0;
+	for (int c = 0; c < 9; c++) {
+		if (iOperators & (3 << (c * 2))) iChannels |= 1 << c;
+	}
+	return iChannels;
+}
+
+/// Can a write to this register be moved to another moment?
+static bool movable(uint8_t iRegister)
+{
+	// The low and high halves of a channel's frequency are always written as a
+	// pair, so neither can move or the chip plays a frequency in between.
+	if ((iRegister >= BASE_FNUM_L) && (iRegister <= BASE_FNUM_L + 8)) return false;
+	if ((iRegister >= BASE_KEYON_FREQ) && (iRegister <= BASE_KEYON_FREQ + 8)) return false;
+	if (iRegister == BASE_RHYTHM) return false;
+	// Global registers and unused ones affect no channels
+	return registerChannels(iRegister) != 0;
+}
+
+/// Can w be moved past writes[iFrom] to writes[iTo - 1]?
+static bool canPass(const std::vector<WRITE>& writes, size_t iFrom, size_t iTo,
+	const WRITE& w, uint32_t iChannels)
+{
+	for (size_t i = iFrom; i < iTo; i++) {
+		uint8_t iRegister = writes[i].iRegister;
+		if (iRegister == w.iRegister) return false;
+		if (!movable(iRegister)) {
+			uint32_t iAffects = registerChannels(iRegister);
+			// Globals affect everything
+			if ((!iAffects) || (iAffects & iChannels)) return false;
+		}
+	}
+	return true;
+}
+
+/// Move one write from moment t to the end of a less busy moment before it.
+static bool moveEarlier(TIMELINE& timeline, TIMELINE::iterator t,
+	unsigned int iMaxWrites, uint32_t iTolerance)
+{
+	std::vector<WRITE>& now = t->second;
+	// Stay after the chip setup
+	uint32_t iEarliest = timeline.begin()->first + 1;
+	if ((t->first > iTolerance) && (t->first - iTolerance > iEarliest)) {
+		iEarliest = t->first - iTolerance;
+	}
+
+	for (size_t k = 0; k < now.size(); k++) {
+		WRITE w = now[k];
+		if (!movable(w.iRegister)) continue;
+		uint32_t iChannels = registerChannels(w.iRegister);
+		if (!canPass(now, 0, k, w, iChannels)) continue;
+
+		// Find the quietest moment, nearest this one if there's a tie
+		size_t iLeast = iMaxWrites;
+		uint32_t iTarget = t->first;
+		TIMELINE::iterator p = t;
+		for (uint32_t tm = t->first; tm-- > iEarliest; ) {
+			size_t iLoad = 0;
+			bool bMoment = false;
+			if (p != timeline.begin()) {
+				TIMELINE::iterator q = p;
+				q--;
+				if (q->first == tm) {
+					p = q;
+					iLoad = p->second.size();
+					bMoment = true;
+				}
+			}
+			if (iLoad < iLeast) {
+				iLeast = iLoad;
+				iTarget = tm;
+				if (iLoad == 0) break;
+			}
+			// The write can go at the end of this moment but no further back
+			if ((bMoment) && (!canPass(p->second, 0, p->second.size(), w, iChannels))) break;
+		}
+		if (iTarget == t->first) continue;
+
+		now.erase(now.begin() + k);
+		timeline[iTarget].push_back(w);
+		return true;
+	}
+	return false;
+}
+
+/// Move one write from moment t to the start of a less busy moment after it.
+static bool moveLater(TIMELINE& timeline, TIMELINE::iterator t,
+	unsigned int iMaxWrites, uint32_t iTolerance, uint32_t iEnd)
+{
+	std::vector<WRITE>& now = t->second;
+	// Stay before the end of the song
+	uint32_t iLatest = t->first + iTolerance;
+	if (iLatest >= iEnd) iLatest = iEnd - 1;
+
+	for (size_t k = now.size(); k-- > 0; ) {
+		WRITE w = now[k];
+		if (!movable(w.iRegister)) continue;
+		uint32_t iChannels = registerChannels(w.iRegister);
+		if (!canPass(now, k + 1, now.size(), w, iChannels)) continue;
+
+		size_t iLeast = iMaxWrites;
+		uint32_t iTarget = t->first;
+		TIMELINE::iterator n = t;
+		n++;
+		for (uint32_t tm = t->first + 1; tm <= iLatest; tm++) {
+			size_t iLoad = 0;
+			bool bMoment = false;
+			if ((n != timeline.end()) && (n->first == tm)) {
+				iLoad = n->second.size();
+				bMoment = true;
+			}
+			if (iLoad < iLeast) {
+				iLeast = iLoad;
+				iTarget = tm;
+				if (iLoad == 0) break;
+			}
+			if (bMoment) {
+				// The write can go at the start of this moment but no further on
+				if (!canPass(n->second, 0, n->second.size(), w, iChannels)) break;
+				n++;
+			}
+		}
+		if (iTarget == t->first) continue;
+
+		now.erase(now.begin() + k);
+		std::vector<WRITE>& later = timeline[iTarget];
+		later.insert(later.begin(), w);
+		return true;
+	}
+	return false;
+}
+
+unsigned int spread(imf::RECORDS& records, unsigned int iMaxWrites,
+	uint32_t iTolerance)
+	throw ()
+{
+	if ((records.empty()) || (!iMaxWrites) || (!iTolerance)) return 0;
+
+	TIMELINE timeline;
+	uint32_t iTime = 0;
+	for (imf::RECORDS::const_iterator i = records.begin(); i != records.end(); i++) {
+		WRITE w = {i->iRegister, i->iValue};
+		timeline[iTime].push_back(w);
+		iTime += i->iDelay;
+	}
+
+	// Writes moved later land on moments still to come, which are checked in
+	// turn, so the first pass through is all that's needed.
+	unsigned int iMoved = 0;
+	TIMELINE::iterator t = timeline.begin();
+	for (t++; t != timeline.end(); t++) {
+		while (t->second.size() > iMaxWrites) {
+			if ((!moveEarlier(timeline, t, iMaxWrites, iTolerance))
+				&& (!moveLater(timeline, t, iMaxWrites, iTolerance, iTime))
+			) {
+				break;
+			}
+			iMoved++;
+		}
+	}
+
+	toRecords(timeline, iTime, records);
+	return iMoved;
+}
+
+} // namespace schedule
@@ -0,0 +1,110 @@
+/*
+ * CMF2IMF - convert CMF files into id Software IMF files
+ * Copyright (C) 2010 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Rearranging the register writes in converted songs, so that fewer writes
+ * happen at the same moment.
+ */
+
+#ifndef SCHEDULE_HPP_
+#define SCHEDULE_HPP_
+
+#include <iostream>
+
+#include "imf.hpp"
+
+namespace schedule {
+
+/// Furthest back (in IMF ticks) an instrument change will be moved
+#define PREFETCH_MAX_TICKS 256
+
+/// Load instruments before the notes that use them.
+/**
+ * Instrument registers (0x20-0x95, 0xC0-0xC8, 0xE0-0xF5) written while an
+ * operator is keyed off are moved earlier, to the least busy moment since the
+ * operator was last keyed off.  The chip ends up in the same state at every
+ * note-on, but the note-on itself is left with only the frequency and key-on
+ * writes.
+ *
+ * @param records Song to rearrange.  The length of the song doesn't change.
+ * @return Number of register writes moved.
+ */
+unsigned int prefetch(imf::RECORDS& records)
+	throw ();
+
+/// Find the largest number of register writes made at the same moment, not
+/// counting the chip setup at the start of the song.
+unsigned int peakWrites(const imf::RECORDS& records)
+	throw ();
+
+/// Time a real OPL2 needs after the register number is written, in ns
+#define BUS_ADDRESS_NS 3300
+
+/// Time a real OPL2 needs after the value is written, in ns
+#define BUS_DATA_NS 23000
+
+/// Bus time taken by one register write, in nanoseconds
+#define BUS_WRITE_NS (BUS_ADDRESS_NS + BUS_DATA_NS)
+
+/// How much time real hardware spends writing registers.
+typedef struct {
+	unsigned long iTickNS;      ///< Length of one IMF tick
+	unsigned long iBudgetNS;    ///< Bus time allowed at one moment
+	unsigned int iSetupWrites;  ///< Writes in the chip setup at the start
+	unsigned int iPeakWrites;   ///< Most writes at one moment after the setup
+	unsigned long iPeakNS;      ///< Bus time needed by those writes
+	uint32_t iPeakTime;         ///< When they happen, in IMF ticks
+	unsigned long iMoments;     ///< Number of moments with any writes, after the setup
+	unsigned long iOverBudget;  ///< Number of those needing more than iBudgetNS
+} BUSREPORT;
+
+/// Work out how long the register writes keep a real OPL2 busy.
+/**
+ * @param records Song to measure.
+ * @param iSpeed IMF speed in Hertz.
+ * @param iBudgetNS Bus time allowed at one moment, in nanoseconds, or 0 to
+ *   allow one IMF tick.
+ * @param report Set to the results.
+ */
+void busCost(const imf::RECORDS& records, int iSpeed, unsigned long iBudgetNS,
+	BUSREPORT& report)
+	throw ();
+
+/// Print a bus report in a readable form.
+void printBusCost(std::ostream& out, const BUSREPORT& report)
+	throw ();
+
+/// Move register writes to the moments around a burst that has too many.
+/**
+ * Frequency and key-on (0xA0-0xB8), rhythm (0xBD) and global registers (below
+ * 0x20) stay where they are, and nothing moves past one of them that affects
+ * the same channel, or past another write to the same register.  So every note
+ * starts and stops at the same time with the same settings, and any change
+ * made to a note while it plays is out by no more than iTolerance.  The chip
+ * setup at the start of the song is left alone.
+ *
+ * @param records Song to rearrange.  The length of the song doesn't change.
+ * @param iMaxWrites Most writes wanted at one moment.
+ * @param iTolerance Furthest a write can move, in IMF ticks.
+ * @return Number of register writes moved.
+ */
+unsigned int spread(imf::RECORDS& records, unsigned int iMaxWrites,
+	uint32_t iTolerance)
+	throw ();
+
+} // namespace schedule
+
+#endif // SCHEDULE_HPP_
@@ -0,0 +1,247 @@
+/*
+ * CMF2IMF - convert CMF files into id Software IMF files
+ * Copyright (C) 2010 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <boost/thread.hpp>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <string.h>
+#include <sstream>
+#include <vector>
+
+#include "imf.hpp"
+#include "server.hpp"
+
+namespace server {
+
+#define REQUEST_HEADER_LEN 15
+#define RESPONSE_HEADER_LEN 5
+
+/// Read exactly iLength bytes, returning false if the connection closed.
+static bool readAll(int fd, char *pData, size_t iLength)
+{
+	while (iLength) {
+		ssize_t iRead = read(fd, pData, iLength);
+		if (iRead < 0) {
+			if (errno == EINTR) continue;
+			return false;
+		}
+		if (iRead == 0) return false;
+		pData += iRead;
+		iLength -= iRead;
+	}
+	return true;
+}
+
+/// Write exactly iLength bytes, returning false if the connection closed.
+static bool writeAll(int fd, const char *pData, size_t iLength)
+{
+	while (iLength) {
+		ssize_t iWritten = write(fd, pData, iLength);
+		if (iWritten < 0) {
+			if (errno == EINTR) continue;
+			return false;
+		}
+		pData += iWritten;
+		iLength -= iWritten;
+	}
+	return true;
+}
+
+static uint32_t getU32(const char *p)
+{
+	const uint8_t *b = (const uint8_t *)p;
+	return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+/// One thread handling connections.  The buffers are kept between requests
+/// so a busy worker doesn't keep reallocating them.
+class worker {
+	private:
+		int fdListen;
+		std::vector<char> request;
+		std::ostringstream response;
+		imf::RECORDS records;
+
+	public:
+		worker(int fdListen)
+			throw () :
+			fdListen(fdListen)
+		{
+		}
+
+		void operator()()
+			throw ()
+		{
+			for (;;) {
+				int fd = accept(this->fdListen, NULL, NULL);
+				if (fd < 0) {
+					if (errno == EINTR) continue;
+					std::cerr << "ERROR: Unable to accept connection: "
+						<< strerror(errno) << std::endl;
+					return;
+				}
+				while (this->serve(fd)) { } ;
+				close(fd);
+			}
+		}
+
+	private:
+		/// Handle one request, returning false once the connection has closed.
+		bool serve(int fd)
+			throw ()
+		{
+			try {
+				return this->handle(fd);
+			} catch (std::exception& e) {
+				// Out of memory or similar partway through a request, so we can't
+				// tell where the next one starts.  Drop the connection.
+				std::cerr << "ERROR: " << e.what() << std::endl;
+				return false;
+			}
+		}
+
+		/// Read one request and send back the reply.
+		bool handle(int fd)
+		{
+			char cHeader[REQUEST_HEADER_LEN];
+			if (!readAll(fd, cHeader, REQUEST_HEADER_LEN)) return false;
+
+			imf::OPTIONS opt;
+			opt.iSpeed = (uint8_t)cHeader[0] | ((uint8_t)cHeader[1] << 8);
+			opt.iType = cHeader[2];
+			opt.iStart = getU32(cHeader + 3);
+			opt.iEnd = getU32(cHeader + 7);
+			opt.pBank = NULL;
+			opt.bLookahead = false;
+			opt.bPrefetch = false;
+			opt.iBusBudget = 0;
+			opt.iBusTolerance = 0;
+			uint32_t iLength = getU32(cHeader + 11);
+			if (iLength > SERVER_MAX_REQUEST) {
+				this->reply(fd, 1, "Request too large");
+				return false;
+			}
+			this->request.resize(iLength);
+			if ((iLength) && (!readAll(fd, &this->request[0], iLength))) return false;
+
+			if ((opt.iType < 0) || (opt.iType > 2)) {
+				return this->reply(fd, 1, "Invalid IMF type");
+			}
+			if ((opt.iEnd) && (opt.iEnd <= opt.iStart)) {
+				return this->reply(fd, 1, "Invalid start/end range");
+			}
+
+			// Leave room for the response header, so it all goes out in one write
+			this->response.str(std::string(RESPONSE_HEADER_LEN, '\0'));
+			this->response.seekp(0, std::ios::end);
+			try {
+				imf::convert(iLength ? &this->request[0] : NULL, iLength,
+					this->records, opt, NULL); // no messages
+				imf::write(this->response, this->records, opt.iType);
+			} catch (std::exception& e) {
+				return this->reply(fd, 1, e.what());
+			}
+			std::string strData = this->response.str();
+			setHeader(&strData[0], 0, strData.length() - RESPONSE_HEADER_LEN);
+			return writeAll(fd, strData.data(), strData.length());
+		}
+
+		/// Send an error message back to the client.
+		bool reply(int fd, uint8_t iStatus, const std::string& strMessage)
+			throw ()
+		{
+			std::string strData(RESPONSE_HEADER_LEN, '\0');
+			strData.append(strMessage);
+			setHeader(&strData[0], iStatus, strMessage.length());
+			return writeAll(fd, strData.data(), strData.length());
+		}
+
+		static void setHeader(char *p, uint8_t iStatus, uint32_t iLength)
+			throw ()
+		{
+			p[0] = iStatus;
+			p[1] = iLength & 0xFF;
+			p[2] = (iLength >> 8) & 0xFF;
+			p[3] = (iLength >> 16) & 0xFF;
+			p[4] = (iLength >> 24) & 0xFF;
+			return;
+		}
+};
+
+void run(const std::string& strSocket, int iWorkers)
+	throw (std::ios::failure)
+{
+	// Don't die if a client disconnects while we're replying
+	signal(SIGPIPE, SIG_IGN);
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strSocket.length() >= sizeof(addr.sun_path)) {
+		throw std::ios::failure("Socket path is too long: " + strSocket);
+	}
+	strcpy(addr.sun_path, strSocket.c_str());
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) throw std::ios::failure("Unable to create socket");
+
+	// Clear away a socket left over from an earlier run, but don't go deleting
+	// anything else that happens to have been given as the path.
+	struct stat st;
+	if (lstat(strSocket.c_str(), &st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) {
+			close(fd);
+			throw std::ios::failure(strSocket + " already exists and is not a socket");
+		}
+		unlink(strSocket.c_str());
+	}
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		throw std::ios::failure("Unable to bind to " + strSocket + ": " + strerror(errno));
+	}
+	if (listen(fd, SOMAXCONN) < 0) {
+		close(fd);
+		throw std::ios::failure("Unable to listen on " + strSocket + ": " + strerror(errno));
+	}
+
+	std::cout << "Listening on " << strSocket << " with " << iWorkers
+		<< " workers" << std::endl;
+
+	// Every worker blocks in accept() on the same socket, so whichever one is
+	// free picks up the next connection.
+	std::vector<worker *> workers;
+	boost::thread_group threads;
+	for (int i = 0; i < iWorkers; i++) {
+		workers.push_back(new worker(fd));
+		threads.create_thread(boost::ref(*workers.back()));
+	}
+	threads.join_all();
+
+	for (std::vector<worker *>::iterator i = workers.begin(); i != workers.end(); i++) {
+		delete *i;
+	}
+	close(fd);
+	return;
+}
+
+} // namespace server
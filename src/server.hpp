@@ -0,0 +1,63 @@
+/*
+ * CMF2IMF - convert CMF files into id Software IMF files
+ * Copyright (C) 2010 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Conversion server, so tools that convert songs often don't have to start
+ * a new process each time.
+ *
+ * Clients connect to the Unix domain socket and send any number of
+ * requests over the one connection.  Each request is (little-endian):
+ *
+ *   uint16   speed in Hertz
+ *   uint8    IMF type (0, 1 or 2)
+ *   uint32   start time in milliseconds (0 == start of song)
+ *   uint32   end time in milliseconds (0 == end of song)
+ *   uint32   length of the CMF data
+ *   char[]   CMF data
+ *
+ * and each response is:
+ *
+ *   uint8    0 == success, 1 == error
+ *   uint32   length of the data
+ *   char[]   IMF file on success, error message on failure
+ */
+
+#ifndef SERVER_HPP_
+#define SERVER_HPP_
+
+#include <iostream>
+#include <string>
+
+namespace server {
+
+/// Largest CMF file a client is allowed to send
+#define SERVER_MAX_REQUEST (16 << 20)
+
+/// Listen on a Unix domain socket and convert songs until killed.
+/**
+ * @param strSocket Path of the socket to create.  A socket left behind by an
+ *   earlier run is removed first.  It is an error if the path exists and is
+ *   not a socket.
+ *
+ * @param iWorkers Number of threads serving connections.  Each thread
+ *   handles one connection at a time.
+ */
+void run(const std::string& strSocket, int iWorkers)
+	throw (std::ios::failure);
+
+} // namespace server
+
+#endif // SERVER_HPP_
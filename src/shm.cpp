@@ -0,0 +1,333 @@
+/*
+ * CMF2IMF - convert CMF files into id Software IMF files
+ * Copyright (C) 2010 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sstream>
+
+#include "shm.hpp"
+
+namespace shm {
+
+/// Number of times to spin before sleeping while waiting for the other side
+#define SHM_SPINS 1000
+
+/// How long to sleep between checks once spinning hasn't helped
+#define SHM_SLEEP_NS 100000
+
+/// Check the other process is still there after this many sleeps
+#define SHM_CHECK_SLEEPS 1000
+
+/// Give up on a reader that hasn't opened the ring after this many
+/// milliseconds, the same as readShm() waits for the writer
+#define SHM_ATTACH_MS 10000
+
+static inline uint32_t loadAcquire(const uint32_t *p)
+{
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void storeRelease(uint32_t *p, uint32_t v)
+{
+	__atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+/// How long we've been waiting for the other process
+typedef struct {
+	unsigned int iWaits;     // Number of times we've waited so far
+	struct timespec tStart;  // When we first had to sleep
+} WAIT;
+
+/// Wait a little while for the other process.
+/**
+ * @param wait Progress of this wait, all zero to start with.
+ * @param pid Other process, or 0 if it hasn't opened the ring yet.
+ * @return false if the other process has exited, or still hasn't opened the
+ *   ring after SHM_ATTACH_MS.
+ */
+static bool pause(WAIT& wait, pid_t pid)
+{
+	wait.iWaits++;
+	if (wait.iWaits < SHM_SPINS) {
+		__asm__ __volatile__ ("" ::: "memory");
+		return true;
+	}
+	if (wait.iWaits == SHM_SPINS) clock_gettime(CLOCK_MONOTONIC, &wait.tStart);
+	struct timespec ts = {0, SHM_SLEEP_NS};
+	nanosleep(&ts, NULL);
+	if ((wait.iWaits - SHM_SPINS) % SHM_CHECK_SLEEPS == 0) {
+		if (pid) {
+			if ((kill(pid, 0) < 0) && (errno == ESRCH)) return false;
+		} else {
+			struct timespec tNow;
+			clock_gettime(CLOCK_MONOTONIC, &tNow);
+			long iWaitedMS = (tNow.tv_sec - wait.tStart.tv_sec) * 1000
+				+ (tNow.tv_nsec - wait.tStart.tv_nsec) / 1000000;
+			if (iWaitedMS >= SHM_ATTACH_MS) return false;
+		}
+	}
+	return true;
+}
+
+/// Check whether a shared memory object is a ring, and whether its writer is
+/// still running.
+/**
+ * @param fd Open shared memory object.
+ * @param pWriterPid Set to the writer's process if it's still running, or 0.
+ * @return true if fd is a ring.
+ */
+static bool isRing(int fd, pid_t *pWriterPid)
+{
+	*pWriterPid = 0;
+	struct stat st;
+	if ((fstat(fd, &st) < 0) || ((size_t)st.st_size < sizeof(HEADER))) return false;
+	void *p = mmap(NULL, sizeof(HEADER), PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) return false;
+	const HEADER *pHeader = (const HEADER *)p;
+	bool bRing = (loadAcquire(&pHeader->iMagic) == SHM_MAGIC);
+	pid_t pid = pHeader->iWriterPid;
+	munmap(p, sizeof(HEADER));
+	if ((bRing) && (pid > 0) && ((kill(pid, 0) == 0) || (errno != ESRCH))) {
+		*pWriterPid = pid;
+	}
+	return bRing;
+}
+
+writer::writer(const std::string& strName, uint32_t iSlots)
+	throw (std::ios::failure) :
+	strName(strName),
+	pHeader(NULL),
+	pSlots(NULL),
+	iHead(0),
+	iTailSeen(0),
+	iTime(0),
+	bReaderGone(false)
+{
+	uint32_t iSize = 1;
+	while (iSize < iSlots) iSize <<= 1;
+	this->iMask = iSize - 1;
+	this->iMapSize = sizeof(HEADER) + iSize * sizeof(RECORD);
+
+	// Replace a ring left behind by an earlier run (e.g. one that was killed)
+	// but nothing else that happens to have the same name.
+	int fd = shm_open(strName.c_str(), O_RDONLY, 0);
+	if (fd >= 0) {
+		pid_t iOldPid;
+		bool bRing = isRing(fd, &iOldPid);
+		close(fd);
+		if (!bRing) {
+			throw std::ios::failure("Shared memory " + strName
+				+ " already exists and is not a ring");
+		}
+		if (iOldPid) {
+			std::ostringstream ss;
+			ss << "Shared memory " << strName << " is in use by process " << iOldPid;
+			throw std::ios::failure(ss.str());
+		}
+		shm_unlink(strName.c_str());
+	}
+	fd = shm_open(strName.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		throw std::ios::failure("Unable to create shared memory " + strName + ": "
+			+ strerror(errno));
+	}
+	if (ftruncate(fd, this->iMapSize) < 0) {
+		close(fd);
+		shm_unlink(strName.c_str());
+		throw std::ios::failure("Unable to size shared memory " + strName);
+	}
+	void *p = mmap(NULL, this->iMapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd); // the mapping stays valid
+	if (p == MAP_FAILED) {
+		shm_unlink(strName.c_str());
+		throw std::ios::failure("Unable to map shared memory " + strName);
+	}
+	this->pHeader = (HEADER *)p;
+	this->pSlots = (RECORD *)(this->pHeader + 1);
+
+	// ftruncate() filled everything with zeroes, so only the non-zero fields
+	// need setting.  The magic number goes last so a reader never sees a
+	// half-initialised ring.
+	this->pHeader->iSlots = iSize;
+	this->pHeader->iWriterPid = getpid();
+	storeRelease(&this->pHeader->iMagic, SHM_MAGIC);
+}
+
+writer::~writer()
+	throw ()
+{
+	munmap(this->pHeader, this->iMapSize);
+	shm_unlink(this->strName.c_str());
+}
+
+void writer::setDelay(uint16_t iDelay)
+	throw ()
+{
+	this->iTime += iDelay;
+	return;
+}
+
+void writer::setRegister(uint8_t iRegister, uint8_t iValue)
+	throw ()
+{
+	// Only look at the reader's position when our old copy says the ring is
+	// full, so normally the reader's cache line is left alone.
+	if (this->iHead - this->iTailSeen > this->iMask) {
+		if (this->bReaderGone) return;
+		WAIT wait = {0, {0, 0}};
+		for (;;) {
+			this->iTailSeen = loadAcquire(&this->pHeader->iTail);
+			if (this->iHead - this->iTailSeen <= this->iMask) break;
+			if (!pause(wait, __atomic_load_n(&this->pHeader->iReaderPid, __ATOMIC_RELAXED))) {
+				this->bReaderGone = true;
+				return;
+			}
+		}
+	}
+	RECORD& r = this->pSlots[this->iHead & this->iMask];
+	r.iTime = this->iTime;
+	r.iRegister = iRegister;
+	r.iValue = iValue;
+	r.iReserved = 0;
+	this->iHead++;
+	storeRelease(&this->pHeader->iHead, this->iHead);
+	return;
+}
+
+bool writer::readerGone() const
+	throw ()
+{
+	return this->bReaderGone;
+}
+
+void writer::finish()
+	throw ()
+{
+	this->pHeader->iLength = this->iTime;
+	storeRelease(&this->pHeader->iFinished, 1);
+
+	WAIT wait = {0, {0, 0}};
+	while ((!this->bReaderGone) && (loadAcquire(&this->pHeader->iTail) != this->iHead)) {
+		if (!pause(wait, __atomic_load_n(&this->pHeader->iReaderPid, __ATOMIC_RELAXED))) {
+			this->bReaderGone = true;
+		}
+	}
+	return;
+}
+
+reader::reader(const std::string& strName, unsigned int iWaitMS)
+	throw (std::ios::failure) :
+	pHeader(NULL),
+	pSlots(NULL),
+	iMapSize(0),
+	iTail(0),
+	iHeadSeen(0)
+{
+	// Wait for the writer to create the ring and finish setting it up
+	int fd;
+	unsigned int iWaited = 0;
+	for (;;) {
+		fd = shm_open(strName.c_str(), O_RDWR, 0);
+		if (fd >= 0) {
+			struct stat st;
+			if ((fstat(fd, &st) == 0) && ((size_t)st.st_size > sizeof(HEADER))) {
+				void *p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+				if (p != MAP_FAILED) {
+					HEADER *pHeader = (HEADER *)p;
+					if (loadAcquire(&pHeader->iMagic) == SHM_MAGIC) {
+						this->pHeader = pHeader;
+						this->iMapSize = st.st_size;
+						close(fd);
+						break;
+					}
+					munmap(p, st.st_size);
+				}
+			}
+			close(fd);
+		}
+		if (iWaited >= iWaitMS) {
+			throw std::ios::failure("Unable to open shared memory " + strName);
+		}
+		struct timespec ts = {0, 1000000};
+		nanosleep(&ts, NULL);
+		iWaited++;
+	}
+
+	this->iMask = this->pHeader->iSlots - 1;
+	if ((this->pHeader->iSlots & this->iMask) ||
+		(sizeof(HEADER) + this->pHeader->iSlots * sizeof(RECORD) > this->iMapSize)
+	) {
+		munmap(this->pHeader, this->iMapSize);
+		throw std::ios::failure("Shared memory " + strName + " is not a valid ring");
+	}
+	this->pSlots = (RECORD *)(this->pHeader + 1);
+	this->iTail = loadAcquire(&this->pHeader->iTail);
+	__atomic_store_n(&this->pHeader->iReaderPid, getpid(), __ATOMIC_RELAXED);
+}
+
+reader::~reader()
+	throw ()
+{
+	munmap(this->pHeader, this->iMapSize);
+}
+
+bool reader::tryRead(RECORD& r)
+	throw ()
+{
+	// As with the writer, only look at the writer's position when our old
+	// copy says there's nothing left.
+	if (this->iTail == this->iHeadSeen) {
+		this->iHeadSeen = loadAcquire(&this->pHeader->iHead);
+		if (this->iTail == this->iHeadSeen) return false;
+	}
+	r = this->pSlots[this->iTail & this->iMask];
+	this->iTail++;
+	storeRelease(&this->pHeader->iTail, this->iTail);
+	return true;
+}
+
+bool reader::read(RECORD& r)
+	throw (std::ios::failure)
+{
+	WAIT wait = {0, {0, 0}};
+	while (!this->tryRead(r)) {
+		// Check the finished flag before looking at iHead one last time, since
+		// the writer sets it after writing the last record.
+		if (loadAcquire(&this->pHeader->iFinished)) {
+			return this->tryRead(r);
+		}
+		if (!pause(wait, this->pHeader->iWriterPid)) {
+			throw std::ios::failure("The shared memory writer has exited");
+		}
+	}
+	return true;
+}
+
+uint32_t reader::length() const
+	throw ()
+{
+	return this->pHeader->iLength;
+}
+
+} // namespace shm
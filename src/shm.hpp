@@ -0,0 +1,172 @@
+/*
+ * CMF2IMF - convert CMF files into id Software IMF files
+ * Copyright (C) 2010 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Passing register writes to another process through a ring buffer in POSIX
+ * shared memory, so a song can be played live (e.g. by an emulator) without
+ * writing an IMF file first.
+ *
+ * There is one writer (the player) and one reader.  The writer only changes
+ * iHead and the reader only changes iTail, so no locks are needed.  When the
+ * ring is full the writer waits for the reader to catch up, so a slow reader
+ * holds the player back rather than losing writes.
+ */
+
+#ifndef SHM_HPP_
+#define SHM_HPP_
+
+#include <iostream>
+#include <string>
+#include <stdint.h>
+#include <sys/types.h>
+
+namespace shm {
+
+/// Identifies an initialised ring ("CIRB")
+#define SHM_MAGIC 0x42524943
+
+/// Number of records in a ring unless told otherwise (must be a power of two)
+#define SHM_DEFAULT_SLOTS 4096
+
+/// One register write.
+typedef struct {
+	uint32_t iTime;      ///< Song time of the write, in milliseconds
+	uint8_t iRegister;
+	uint8_t iValue;
+	uint16_t iReserved;  ///< Always zero
+} RECORD;
+
+/// Start of the shared memory.  iHead and iTail are on their own cache lines
+/// so the two processes don't keep taking the line off each other.
+typedef struct {
+	uint32_t iMagic;     ///< SHM_MAGIC, set last once everything else is ready
+	uint32_t iSlots;     ///< Number of records in the ring (a power of two)
+	pid_t iWriterPid;    ///< Process writing to the ring
+	pid_t iReaderPid;    ///< Process reading from the ring (0 until attached)
+	uint32_t iFinished;  ///< Non-zero once the writer has written everything
+	uint32_t iLength;    ///< Song length in milliseconds (valid once iFinished is set)
+	uint8_t pad1[64 - 24];
+	uint32_t iHead;      ///< Number of records written (only changed by the writer)
+	uint8_t pad2[64 - 4];
+	uint32_t iTail;      ///< Number of records read (only changed by the reader)
+	uint8_t pad3[64 - 4];
+	// RECORD slots[iSlots] follows
+} HEADER;
+
+/// Producer end of a ring.  Can be used as the player's callbacks.
+class writer {
+	private:
+		std::string strName;
+		HEADER *pHeader;
+		RECORD *pSlots;
+		size_t iMapSize;
+		uint32_t iMask;
+		uint32_t iHead;      // Local copy of pHeader->iHead
+		uint32_t iTailSeen;  // Last value read from pHeader->iTail
+		uint32_t iTime;      // Song time in milliseconds
+		bool bReaderGone;    // Set if the reader exited
+
+	public:
+		/// Create a new ring.
+		/**
+		 * @param strName Shared memory name, e.g. "/cmf2imf".  A ring left behind
+		 *   by a writer that has exited is replaced.  It is an error if the name
+		 *   is in use by anything else.
+		 * @param iSlots Number of records in the ring, rounded up to a power of
+		 *   two.
+		 */
+		writer(const std::string& strName, uint32_t iSlots = SHM_DEFAULT_SLOTS)
+			throw (std::ios::failure);
+
+		/// Remove the ring.  A reader that has already opened it keeps working.
+		~writer()
+			throw ();
+
+		/// cmf::FN_DELAY callback.
+		void setDelay(uint16_t iDelay)
+			throw ();
+
+		/// cmf::FN_SETREGISTER callback.  Waits if the ring is full.
+		/**
+		 * The player can't handle exceptions from its callbacks, so if the
+		 * reader exits (or never opens the ring) the write is dropped and
+		 * readerGone() returns true.
+		 */
+		void setRegister(uint8_t iRegister, uint8_t iValue)
+			throw ();
+
+		/// Has the reader exited while the writer was waiting for it, or not
+		/// opened the ring within 10 seconds?
+		bool readerGone() const
+			throw ();
+
+		/// Tell the reader there's nothing more to come, and wait for it to
+		/// read everything.
+		/**
+		 * Any delay since the last write is included in the song length.  The
+		 * wait means the ring isn't removed before the reader has opened it,
+		 * unless no reader turns up within 10 seconds.
+		 */
+		void finish()
+			throw ();
+};
+
+/// Consumer end of a ring.
+class reader {
+	private:
+		HEADER *pHeader;
+		RECORD *pSlots;
+		size_t iMapSize;
+		uint32_t iMask;
+		uint32_t iTail;      // Local copy of pHeader->iTail
+		uint32_t iHeadSeen;  // Last value read from pHeader->iHead
+
+	public:
+		/// Open a ring created by a writer.
+		/**
+		 * @param strName Shared memory name given to the writer.
+		 * @param iWaitMS How long to wait for the writer to create the ring.
+		 */
+		reader(const std::string& strName, unsigned int iWaitMS = 0)
+			throw (std::ios::failure);
+
+		~reader()
+			throw ();
+
+		/// Get the next record if there is one, without waiting.
+		/**
+		 * @return true if r was filled in, false if the ring is empty.
+		 */
+		bool tryRead(RECORD& r)
+			throw ();
+
+		/// Get the next record, waiting for the writer if needed.
+		/**
+		 * @return true if r was filled in, false if the writer has finished and
+		 *   every record has been read.
+		 * @throw std::ios::failure if the writer exited without finishing.
+		 */
+		bool read(RECORD& r)
+			throw (std::ios::failure);
+
+		/// Song length in milliseconds, once read() has returned false.
+		uint32_t length() const
+			throw ();
+};
+
+} // namespace shm
+
+#endif // SHM_HPP_
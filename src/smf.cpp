@@ -0,0 +1,309 @@
+/*
+ * CMF2IMF - convert CMF files into id Software IMF files
+ * Copyright (C) 2010 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "smf.hpp"
+
+namespace smf {
+
+#define SMF_HEADER_LEN 14
+#define SMF_DEFAULT_TEMPO 500000 // 120 BPM
+
+static uint32_t readU32BE(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static uint16_t readU16BE(const uint8_t *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+bool isSMF(const char *pData, size_t iLength)
+	throw ()
+{
+	return (iLength >= SMF_HEADER_LEN) && (memcmp(pData, "MThd", 4) == 0);
+}
+
+mergebuf::mergebuf(const char *pData, size_t iLength, std::ostream *pLog)
+	throw (std::ios::failure) :
+	iTempo(SMF_DEFAULT_TEMPO),
+	bSMPTE(false),
+	iLastTick(0),
+	iTime(0),
+	iLastOutput(0),
+	bFinished(false)
+{
+	const uint8_t *p = (const uint8_t *)pData;
+	if (!isSMF(pData, iLength)) {
+		throw std::ios::failure("Input file is not a MIDI file! (MThd header missing)");
+	}
+	uint32_t iHeaderLen = readU32BE(p + 4);
+	uint16_t iFormat = readU16BE(p + 8);
+	uint16_t iNumTracks = readU16BE(p + 10);
+	uint16_t iDiv = readU16BE(p + 12);
+	if (iFormat > 1) {
+		throw std::ios::failure("Only type-0 and type-1 MIDI files are supported");
+	}
+	if (iDiv & 0x8000) {
+		// SMPTE timing: frames per second * ticks per frame.  Treat it as a
+		// fixed tempo of one "quarter note" per second.
+		int iFPS = -(int8_t)(iDiv >> 8);
+		int iTicksPerFrame = iDiv & 0xFF;
+		this->bSMPTE = true;
+		if (iFPS == 29) {
+			// 29.97 drop-frame
+			this->iDivision = 2997 * iTicksPerFrame;
+			this->iTempo = 100000000;
+		} else {
+			this->iDivision = iFPS * iTicksPerFrame;
+			this->iTempo = 1000000;
+		}
+	} else {
+		this->iDivision = iDiv;
+	}
+	if (this->iDivision == 0) throw std::ios::failure("MIDI file has an invalid time division");
+
+	// Find each track
+	const uint8_t *pEnd = p + iLength;
+	const uint8_t *pChunk = p + 8 + iHeaderLen;
+	this->tracks.reserve(iNumTracks);
+	while ((this->tracks.size() < iNumTracks) && (pChunk + 8 <= pEnd)) {
+		uint32_t iChunkLen = readU32BE(pChunk + 4);
+		const uint8_t *pData = pChunk + 8;
+		const uint8_t *pChunkEnd = ((size_t)(pEnd - pData) < iChunkLen) ? pEnd : pData + iChunkLen;
+		if (memcmp(pChunk, "MTrk", 4) == 0) {
+			TRACK t;
+			t.pPos = pData;
+			t.pEnd = pChunkEnd;
+			t.iStatus = 0;
+			this->tracks.push_back(t);
+		} // else unknown chunk, skip it
+		pChunk = pChunkEnd;
+	}
+	if ((pLog) && (this->tracks.size() < iNumTracks)) {
+		*pLog << std::dec << "Warning: MIDI file is truncated, only found "
+			<< this->tracks.size() << " of " << iNumTracks << " tracks" << std::endl;
+	}
+
+	// Queue up the first event in each track
+	for (uint32_t i = 0; i < this->tracks.size(); i++) {
+		TRACK& t = this->tracks[i];
+		if (t.pPos < t.pEnd) this->heap.push(NEXTEVENT(readNumber(t), i));
+	}
+
+	this->setg(this->cEvent, this->cEvent, this->cEvent);
+}
+
+uint32_t mergebuf::readNumber(TRACK& t)
+	throw ()
+{
+	uint32_t iValue = 0;
+	for (int i = 0; (i < 4) && (t.pPos < t.pEnd); i++) {
+		uint8_t iNext = *t.pPos++;
+		iValue = (iValue << 7) | (iNext & 0x7F);
+		if ((iNext & 0x80) == 0) break;
+	}
+	return iValue;
+}
+
+int mergebuf::readEvent(TRACK& t)
+	throw ()
+{
+	if (t.pPos >= t.pEnd) return 0;
+	uint8_t iStatus = *t.pPos;
+	if (iStatus & 0x80) {
+		t.pPos++;
+	} else {
+		iStatus = t.iStatus; // running status
+		if (!(iStatus & 0x80)) {
+			// Corrupt track, give up on it
+			t.pPos = t.pEnd;
+			return 0;
+		}
+	}
+
+	switch (iStatus) {
+		case 0xFF: { // Meta event
+			if (t.pPos >= t.pEnd) return 0;
+			uint8_t iType = *t.pPos++;
+			uint32_t iLen = readNumber(t);
+			if ((size_t)(t.pEnd - t.pPos) < iLen) iLen = t.pEnd - t.pPos;
+			if ((iType == 0x51) && (iLen == 3) && (!this->bSMPTE)) {
+				// Set tempo, takes effect from this point on
+				this->iTempo = (t.pPos[0] << 16) | (t.pPos[1] << 8) | t.pPos[2];
+			} else if (iType == 0x2F) {
+				t.pPos = t.pEnd; // end of track
+				return 0;
+			}
+			t.pPos += iLen;
+			return 0;
+		}
+		case 0xF0:   // Sysex
+		case 0xF7: { // Sysex continuation/escape
+			uint32_t iLen = readNumber(t);
+			if ((size_t)(t.pEnd - t.pPos) < iLen) iLen = t.pEnd - t.pPos;
+			t.pPos += iLen;
+			return 0;
+		}
+	}
+	if (iStatus >= 0xF0) {
+		// Not valid in a MIDI file
+		t.pPos = t.pEnd;
+		return 0;
+	}
+
+	t.iStatus = iStatus;
+	int iDataLen = (((iStatus & 0xF0) == 0xC0) || ((iStatus & 0xF0) == 0xD0)) ? 1 : 2;
+	if (t.pEnd - t.pPos < iDataLen) {
+		t.pPos = t.pEnd;
+		return 0;
+	}
+
+	// Work out how long since the last event we sent out
+	uint64_t iNow = this->iTime / ((uint64_t)this->iDivision * 1000);
+	uint32_t iDelay = iNow - this->iLastOutput;
+	this->iLastOutput = iNow;
+
+	// Write it out as a CMF event, always including the status byte
+	int iPos = 0;
+	char cDelay[5];
+	int iDelayLen = 0;
+	do {
+		cDelay[iDelayLen++] = iDelay & 0x7F;
+		iDelay >>= 7;
+	} while (iDelay);
+	while (iDelayLen > 1) this->cEvent[iPos++] = cDelay[--iDelayLen] | 0x80;
+	this->cEvent[iPos++] = cDelay[0];
+	this->cEvent[iPos++] = iStatus;
+	for (int i = 0; i < iDataLen; i++) this->cEvent[iPos++] = *t.pPos++;
+	return iPos;
+}
+
+mergebuf::int_type mergebuf::underflow()
+{
+	if (this->gptr() < this->egptr()) return traits_type::to_int_type(*this->gptr());
+
+	while (!this->heap.empty()) {
+		NEXTEVENT next = this->heap.top();
+		this->heap.pop();
+		TRACK& t = this->tracks[next.second];
+
+		// Move the song position up to this event
+		this->iTime += (next.first - this->iLastTick) * this->iTempo;
+		this->iLastTick = next.first;
+
+		int iLen = this->readEvent(t);
+
+		// Queue up this track's next event
+		if (t.pPos < t.pEnd) {
+			this->heap.push(NEXTEVENT(next.first + readNumber(t), next.second));
+		}
+		if (iLen) {
+			this->setg(this->cEvent, this->cEvent, this->cEvent + iLen);
+			return traits_type::to_int_type(this->cEvent[0]);
+		}
+	}
+
+	if (!this->bFinished) {
+		// No more events, tell the player the song has finished
+		this->bFinished = true;
+		this->cEvent[0] = 0x00; // no delay
+		this->cEvent[1] = 0xFF;
+		this->cEvent[2] = 0x2F; // end of track
+		this->cEvent[3] = 0x00;
+		this->setg(this->cEvent, this->cEvent, this->cEvent + 4);
+		return traits_type::to_int_type(this->cEvent[0]);
+	}
+	return traits_type::eof();
+}
+
+mergebuf::pos_type mergebuf::seekoff(off_type off, std::ios_base::seekdir way,
+	std::ios_base::openmode which)
+{
+	// Only small seeks within the current event are possible (used by the
+	// player for MIDI running status.)
+	if ((way != std::ios_base::cur) || (!(which & std::ios_base::in))) {
+		return pos_type(off_type(-1));
+	}
+	char *pTarget = this->gptr() + off;
+	if ((pTarget < this->eback()) || (pTarget > this->egptr())) return pos_type(off_type(-1));
+	this->setg(this->eback(), pTarget, this->egptr());
+	return pos_type(off_type(0));
+}
+
+reader::reader(const char *pData, size_t iLength, int iNumInstruments,
+	std::ostream *pLog)
+	throw (std::ios::failure) :
+	buf(pData, iLength, pLog),
+	stream(&this->buf)
+{
+	memset(&this->cmfHeader, 0, sizeof(this->cmfHeader));
+	this->cmfHeader.iTicksPerSecond = SMF_TICKS_PER_SECOND;
+	this->cmfHeader.iNumInstruments = iNumInstruments;
+	for (int i = 0; i < 16; i++) this->cmfHeader.iChannelsInUse[i] = 1;
+}
+
+const cmf::CMFHEADER& reader::header() const
+	throw ()
+{
+	return this->cmfHeader;
+}
+
+std::istream& reader::events()
+	throw ()
+{
+	return this->stream;
+}
+
+/// Read one 16-byte instrument, in the same layout as CMF/SBI/IBK files
+static void readInstrument(const uint8_t *p, cmf::SBI& inst)
+{
+	inst.op[0].iCharMult = p[0];
+	inst.op[1].iCharMult = p[1];
+	inst.op[0].iScalingOutput = p[2];
+	inst.op[1].iScalingOutput = p[3];
+	inst.op[0].iAttackDecay = p[4];
+	inst.op[1].iAttackDecay = p[5];
+	inst.op[0].iSustainRelease = p[6];
+	inst.op[1].iSustainRelease = p[7];
+	inst.op[0].iWaveSel = p[8];
+	inst.op[1].iWaveSel = p[9];
+	inst.iConnection = p[10];
+	return;
+}
+
+void readBank(const char *pData, size_t iLength, std::vector<cmf::SBI>& bank)
+	throw (std::ios::failure)
+{
+	const uint8_t *p = (const uint8_t *)pData;
+	bank.clear();
+	if ((iLength >= 4 + 128 * 16) && (memcmp(pData, "IBK\x1A", 4) == 0)) {
+		bank.resize(128);
+		for (int i = 0; i < 128; i++) readInstrument(p + 4 + i * 16, bank[i]);
+	} else if ((iLength >= 36 + 16) && (memcmp(pData, "SBI\x1A", 4) == 0)) {
+		bank.resize(1);
+		readInstrument(p + 36, bank[0]);
+	} else {
+		throw std::ios::failure("Instrument bank is not an .ibk or .sbi file");
+	}
+	return;
+}
+
+} // namespace smf
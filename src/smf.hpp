@@ -0,0 +1,151 @@
+/*
+ * CMF2IMF - convert CMF files into id Software IMF files
+ * Copyright (C) 2010 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Standard MIDI File (type 0 and 1) support.  The tracks are merged as the
+ * song plays and turned into the same event format as a CMF file, so the
+ * normal CMF player can play them.
+ */
+
+#ifndef SMF_HPP_
+#define SMF_HPP_
+
+#include <iostream>
+#include <queue>
+#include <vector>
+#include <stdint.h>
+
+#include "cmf.hpp"
+
+namespace smf {
+
+/// Event timing of the merged stream, in ticks per second.  One tick is one
+/// millisecond, which is as fine as the player's delays go anyway.
+#define SMF_TICKS_PER_SECOND 1000
+
+/// Is this data a Standard MIDI File?
+bool isSMF(const char *pData, size_t iLength)
+	throw ();
+
+/// Stream buffer producing the events of every track in a MIDI file, merged
+/// in time order.
+/**
+ * Each track's next event sits in a min-heap keyed on its absolute time, so
+ * getting the next event costs O(log tracks) no matter how many tracks or
+ * events there are.  Only one event is ever held in the buffer.
+ *
+ * Tempo changes are applied exactly: the song position is kept as a whole
+ * number of (microseconds / division) so no rounding error builds up.
+ */
+class mergebuf: public std::streambuf {
+	private:
+		typedef struct {
+			const uint8_t *pPos;   // Next byte to read in this track
+			const uint8_t *pEnd;   // End of this track's data
+			uint8_t iStatus;       // Running status
+		} TRACK;
+
+		/// Heap entry: absolute tick of the track's next event, and track index
+		typedef std::pair<uint64_t, uint32_t> NEXTEVENT;
+
+		std::vector<TRACK> tracks;
+		std::priority_queue<NEXTEVENT, std::vector<NEXTEVENT>, std::greater<NEXTEVENT> > heap;
+
+		uint32_t iDivision;    // Song ticks per quarter note (or per second, for SMPTE)
+		uint32_t iTempo;       // Microseconds per quarter note
+		bool bSMPTE;           // Tempo events are ignored for SMPTE timing
+		uint64_t iLastTick;    // Absolute song tick of the last event
+		uint64_t iTime;        // Song position, in microseconds * iDivision
+		uint64_t iLastOutput;  // Time of the last event sent out, in milliseconds
+		bool bFinished;        // Has the end-of-song event been sent?
+
+		char cEvent[16];       // The event being sent out
+
+	public:
+		/// Set up the merge.
+		/**
+		 * @param pData Complete MIDI file.  Must remain valid while the stream
+		 *   is in use.
+		 * @param iLength Length of pData.
+		 * @param pLog Where to write warnings, or NULL to leave them out.
+		 */
+		mergebuf(const char *pData, size_t iLength, std::ostream *pLog)
+			throw (std::ios::failure);
+
+	protected:
+		virtual int_type underflow();
+		virtual pos_type seekoff(off_type off, std::ios_base::seekdir way,
+			std::ios_base::openmode which = std::ios_base::in | std::ios_base::out);
+
+	private:
+		/// Read a variable-length number from a track
+		static uint32_t readNumber(TRACK& t)
+			throw ();
+
+		/// Process the next event in a track.
+		/**
+		 * @return Length of the event written to cEvent, or 0 if the event
+		 *   doesn't need to be passed on (meta events, sysex, etc.)
+		 */
+		int readEvent(TRACK& t)
+			throw ();
+};
+
+/// A MIDI file ready to be played with a cmf::player.
+class reader {
+	private:
+		cmf::CMFHEADER cmfHeader;
+		mergebuf buf;
+		std::istream stream;
+
+	public:
+		/// Open a MIDI file.
+		/**
+		 * @param pData Complete MIDI file.  Must remain valid while the reader
+		 *   is in use.
+		 * @param iLength Length of pData.
+		 * @param iNumInstruments Number of instruments that will be passed to
+		 *   the player.
+		 * @param pLog Where to write warnings, or NULL to leave them out.
+		 */
+		reader(const char *pData, size_t iLength, int iNumInstruments,
+			std::ostream *pLog)
+			throw (std::ios::failure);
+
+		/// Header to pass to the cmf::player constructor.
+		const cmf::CMFHEADER& header() const
+			throw ();
+
+		/// Merged events to pass to the cmf::player constructor.
+		std::istream& events()
+			throw ();
+};
+
+/// Load an instrument bank to use with a MIDI file.
+/**
+ * Both .ibk banks (128 instruments) and single .sbi instruments are
+ * supported.
+ *
+ * @param pData Bank file.
+ * @param iLength Length of pData.
+ * @param bank Set to the instruments in the file.
+ */
+void readBank(const char *pData, size_t iLength, std::vector<cmf::SBI>& bank)
+	throw (std::ios::failure);
+
+} // namespace smf
+
+#endif // SMF_HPP_
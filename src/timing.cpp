@@ -0,0 +1,101 @@
+/*
+ * CMF2IMF - convert CMF files into id Software IMF files
+ * Copyright (C) 2010 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iomanip>
+#include <math.h>
+#include <sstream>
+
+#include "timing.hpp"
+
+namespace timing {
+
+const double cBucketLimits[TIMING_BUCKETS - 1] = {
+	0.5, 1, 2, 5, 10, 20, 50, 100, 1000
+};
+
+void analyse(const char *pData, size_t iLength, const imf::OPTIONS& opt,
+	REPORT& report)
+	throw (std::ios::failure)
+{
+	imf::RECORDS records;
+	imf::KEYONS keyons;
+	uint64_t iSongTicks;
+	unsigned int iTicksPerSecond;
+	imf::timeline(pData, iLength, records, opt, keyons, &iSongTicks, &iTicksPerSecond);
+	if (!iTicksPerSecond) throw std::ios::failure("Song has zero ticks per second");
+
+	report.iSpeed = opt.iSpeed;
+	report.iNotes = keyons.size();
+	report.iEarly = report.iLate = 0;
+	report.dMaxDrift = report.dMeanDrift = 0;
+	for (int i = 0; i < TIMING_BUCKETS; i++) report.iHistogram[i] = 0;
+
+	// Walk through the records adding up the delays, so each key-on's output
+	// time is known when we get to it.
+	uint64_t iTime = 0; // Output time in IMF ticks
+	double dTotal = 0;
+	uint32_t iRecord = 0;
+	for (imf::KEYONS::const_iterator k = keyons.begin(); k != keyons.end(); k++) {
+		for (; iRecord < k->iRecord; iRecord++) iTime += records[iRecord].iDelay;
+		double dActual = iTime * 1000.0 / opt.iSpeed;
+		double dIdeal = k->iSongTicks * 1000.0 / iTicksPerSecond;
+		double dDrift = dActual - dIdeal;
+		double dAbs = fabs(dDrift);
+
+		if (dAbs > fabs(report.dMaxDrift)) report.dMaxDrift = dDrift;
+		dTotal += dAbs;
+		// Anything less than a microsecond out is just floating point error
+		if (dDrift < -0.001) report.iEarly++;
+		else if (dDrift > 0.001) report.iLate++;
+
+		int iBucket = 0;
+		while ((iBucket < TIMING_BUCKETS - 1) && (dAbs >= cBucketLimits[iBucket])) iBucket++;
+		report.iHistogram[iBucket]++;
+	}
+	for (; iRecord < records.size(); iRecord++) iTime += records[iRecord].iDelay;
+
+	if (report.iNotes) report.dMeanDrift = dTotal / report.iNotes;
+	report.dLengthError = iTime * 1000.0 / opt.iSpeed
+		- iSongTicks * 1000.0 / iTicksPerSecond;
+	return;
+}
+
+void print(std::ostream& out, const REPORT& report)
+	throw ()
+{
+	out << std::dec << std::fixed << std::setprecision(2)
+		<< "Timing at " << report.iSpeed << "Hz: " << report.iNotes << " notes ("
+		<< report.iEarly << " early, " << report.iLate << " late)\n"
+		<< "  Worst drift:  " << report.dMaxDrift << " ms\n"
+		<< "  Mean drift:   " << report.dMeanDrift << " ms\n"
+		<< "  Length error: " << report.dLengthError << " ms\n";
+	for (int i = 0; i < TIMING_BUCKETS; i++) {
+		std::ostringstream range;
+		if (i == 0) range << "< " << cBucketLimits[0];
+		else if (i == TIMING_BUCKETS - 1) range << ">= " << cBucketLimits[i - 1];
+		else range << cBucketLimits[i - 1] << " - " << cBucketLimits[i];
+		double dPercent = report.iNotes ? report.iHistogram[i] * 100.0 / report.iNotes : 0;
+		out << "  " << std::setw(14) << range.str() << " ms: " << std::setw(7)
+			<< report.iHistogram[i] << " (" << std::setw(6) << dPercent << "%)\n";
+	}
+	out.unsetf(std::ios::floatfield);
+	out << std::flush;
+	return;
+}
+
+} // namespace timing
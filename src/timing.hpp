@@ -0,0 +1,66 @@
+/*
+ * CMF2IMF - convert CMF files into id Software IMF files
+ * Copyright (C) 2010 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Measuring how far the timing of converted songs drifts from the original.
+ */
+
+#ifndef TIMING_HPP_
+#define TIMING_HPP_
+
+#include <iostream>
+#include <stdint.h>
+
+#include "imf.hpp"
+
+namespace timing {
+
+/// Number of bars in REPORT::iHistogram
+#define TIMING_BUCKETS 10
+
+/// Upper limit of each histogram bar except the last, in milliseconds
+extern const double cBucketLimits[TIMING_BUCKETS - 1];
+
+/// Timing accuracy of a song converted at one speed.
+typedef struct {
+	int iSpeed;             ///< IMF speed in Hertz
+	unsigned long iNotes;   ///< Number of key-ons measured
+	unsigned long iEarly;   ///< Number of notes starting early
+	unsigned long iLate;    ///< Number of notes starting late
+	double dMaxDrift;       ///< Worst difference between when a note should start and when it does, in ms (negative if early)
+	double dMeanDrift;      ///< Average of the absolute differences, in ms
+	double dLengthError;    ///< Output length minus exact song length, in ms
+	unsigned long iHistogram[TIMING_BUCKETS]; ///< Number of notes in each range of absolute difference
+} REPORT;
+
+/// Convert a song and compare when each note starts to when it should.
+/**
+ * @param pData Input song, either a CMF file or a type-0/1 MIDI file.
+ * @param iLength Length of pData.
+ * @param opt Conversion options.  opt.iSpeed is the speed to measure.
+ * @param report Set to the results.
+ */
+void analyse(const char *pData, size_t iLength, const imf::OPTIONS& opt,
+	REPORT& report)
+	throw (std::ios::failure);
+
+/// Print a report in a readable form.
+void print(std::ostream& out, const REPORT& report)
+	throw ();
+
+} // namespace timing
+
+#endif // TIMING_HPP_